@@ -22,6 +22,8 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
 #include <errno.h>
 
 #include "getopts.h"
@@ -44,25 +46,52 @@ char *g_zGETRepAddr = NULL;
 char *g_zDELRepAddr = NULL;
 char *g_outputdir = NULL;
 
-void sig_handler(int signum)
+// Block the signals we care about before any threads are started,
+// so they only ever get delivered through the signalfd
+static void block_signals(sigset_t *mask)
 {
-	switch(signum) {
-		case SIGALRM:
-			//Do something useful here
-			//alarm(1);
-			break;
-		case SIGHUP:
-		case SIGINT:
-		case SIGTERM:
-		case SIGQUIT:
-			g_shutdown = 1;
+	sigemptyset(mask);
+	sigaddset(mask, SIGHUP);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGQUIT);
+	(void) sigprocmask(SIG_BLOCK, mask, NULL);
+}
+
+// Sleep in poll() until we get a signal, Mark1 has nothing else to do in the meantime
+static void main_loop(sigset_t *mask)
+{
+	int z, sfd;
+	struct signalfd_siginfo si;
+	struct pollfd pfd;
+
+	sfd = signalfd(-1, mask, SFD_CLOEXEC);
+	if(sfd == -1) { fprintf(stderr, "signalfd() failed: %s\n", strerror(errno)); return; }
+
+	pfd.fd = sfd;
+	pfd.events = POLLIN;
+
+	while(!g_shutdown) {
+		z = poll(&pfd, 1, -1);
+		if(z == -1) {
+			if(errno == EINTR) { continue; }
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
 			break;
+		}
+
+		// HUP, INT, TERM and QUIT all mean the same thing
+		if(pfd.revents & POLLIN) {
+			if(read(sfd, &si, sizeof(si)) == sizeof(si)) { g_shutdown = 1; }
+		}
 	}
+
+	close(sfd);
 }
 
 int main(int argc, char **argv)
 {
 	int z;
+	sigset_t mask;
 	zmq_reply_t *putrep = NULL;
 	zmq_reply_t *getrep = NULL;
 	zmq_reply_t *delrep = NULL;
@@ -73,6 +102,7 @@ int main(int argc, char **argv)
 	z = chdir(g_outputdir);
 	if(z == -1) { fprintf(stderr, "chdir(%s) failed: %s\n", g_outputdir, strerror(errno)); exit(1); }
 
+	block_signals(&mask);
 	if(g_zPUTRepAddr) {
 		putrep = as_zmq_reply_create(g_zPUTRepAddr, tpad_put_cb, 0, 0, 0, NULL);
 		if(!putrep) {
@@ -97,15 +127,8 @@ int main(int argc, char **argv)
 		}
 	}
 
-	signal(SIGINT,		sig_handler);
-	signal(SIGTERM, 	sig_handler);
-	signal(SIGQUIT,		sig_handler);
-	signal(SIGHUP,		sig_handler);
-	//signal(SIGALRM,	sig_handler);
-	//alarm(1);
-
 	// Wait for the sweet release of death
-	z=0; while(!g_shutdown) { if(z>999) { z=0; } usleep(1000); z++; }
+	main_loop(&mask);
 
 	as_zmq_reply_destroy(delrep);
 	as_zmq_reply_destroy(getrep);
@@ -23,6 +23,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <zmq.h>
 
 #include "getopts.h"
@@ -31,10 +34,14 @@
 #include "gchelper.h"
 #include "gcryptfile.h"
 #include "stats.h"
+#include "tbin.h"
+#include "tune.h"
 
 static void parse_args(int argc, char **argv);
 
 char *g_zmqaddr = NULL;
+// tpad's --pub address, we keep running and drain whenever it tells us to
+char *g_follow = NULL;
 void *g_zContext;
 
 char *g_outputdir = NULL;
@@ -44,19 +51,204 @@ int g_verbosity = 1;
 int g_noclobber = 0;
 #endif
 
-char g_uuid[64+1];
-long g_BS = 1000;
+// One set per socket: every --jobs worker has its own transfer, chunk size, window and place to report to
+__thread char g_uuid[64+1];
+__thread uint64_t g_id = 0;
+__thread ctune_t g_tune;
+__thread FILE *g_out;
+__thread FILE *g_err;
+// What this socket absorbed, for the --jobs stats
+__thread long g_nfiles = 0;
+__thread long g_nbytes = 0;
+// 0 lets g_tune pick the chunk size as we go
+long g_BS = 0;
 char *g_method = RANDOMCMD;
+// The same order for MANIFESTCMD, random takes it by name and shuffles each page
+char *g_order = "random";
+// CLAIMCMD filters, a "key=value\n" line each
+char g_filter[1536];
+
+// Blocks we keep in flight (XFR requests or streaming credit).
+// SIGUSR1 doubles it and SIGUSR2 halves it on every socket, g_winshift counts them up and down
+__thread long g_window = 0;
+__thread long g_maxwindow = MAXWINDOW;
+__thread int g_winseen = 0;
+volatile int g_winshift = 0;
+// -1 until the first reply tells us if tpad answers out of order requests
+int g_pipeline = -1;
+// Binary framing version agreed on with tpad, 0 for ASCII
+int g_binary = 0;
+int g_ascii = 0;
+// Let tpad push the file at us instead of asking for every block
+int g_stream = 0;
+int g_pull = 0;
+// Files absorbed at once, each by a worker on its own socket
+int g_jobs = 1;
+// Files of at least g_stripemin come in up to this many parts at once (TBIN_PROTO 5)
+int g_stripes = 1;
+long g_stripemin = STRIPE_MINSIZE;
+
+// absorb_chunk() when tpad is out of chunk buffers
+#define CHUNK_BUSY (-3)
+// absorb_reply() when claiming, out of the way of what a file that failed returns
+#define ABSORB_NOFILES (-17)
+#define ABSORB_NOCMD (-18)
+// absorb_striped() when tpad would not split the file
+#define ABSORB_NOSTRIPE (-19)
+// claim_file() and absorb_reply() when the socket itself failed
+#define ABSORB_NOSOCK (-20)
+
+// --jobs runs up to JOBS_MAX workers
+#define JOBS_MAX (16)
+
+// A chunk that came back ahead of the ones we are still waiting on
+typedef struct early_s {
+	long offset;
+	long bytes;
+	struct early_s *next;
+	unsigned char data[];
+} early_t;
+
+// One part of a file absorb_striped() is pulling, and what came of it
+typedef struct {
+	char *path;
+	int part, nparts;
+	long size;
+	uint64_t file;
+	pthread_t thr;
+	ctune_t tune;
+	long window, maxwindow;
+	int winseen;
+	int ok;
+	unsigned char digest[TPAD_DIGEST_SIZE];
+	char *out, *err;
+	size_t outlen, errlen;
+} stripe_t;
+
+// A --jobs worker. The socket, chunk size and window carry over from one drain to the next
+typedef struct {
+	int id;
+	void *s;
+	pthread_t thr;
+	ctune_t tune;
+	long window, maxwindow;
+	int winseen;
+	int z;			// what its drain returned
+	long files, bytes, usec;
+} worker_t;
+
+worker_t g_workers[JOBS_MAX];
+static pthread_mutex_t g_outlock = PTHREAD_MUTEX_INITIALIZER;
+
+// zmq calls fail with EINTR if a handler runs on top of them,
+// so SIGUSR1/SIGUSR2 stay blocked everywhere and this thread waits for them
+static void* window_thread(void *arg)
+{
+	int signum;
+	sigset_t *mask = arg;
+
+	while(sigwait(mask, &signum) == 0) {
+		if(signum == SIGUSR1) { g_winshift++; }
+		if(signum == SIGUSR2) { g_winshift--; }
+	}
+
+	return NULL;
+}
+
+// Catch up with the SIGUSR1/SIGUSR2 that came in since we last looked
+static void nudge_window(void)
+{
+	int shift = g_winshift;
+	long w = g_window;
+
+	if(shift == g_winseen) { return; }
+	for(; g_winseen < shift; g_winseen++) {
+		w *= 2;
+		if(w > g_maxwindow) { w = g_maxwindow; }
+	}
+	for(; g_winseen > shift; g_winseen--) {
+		w /= 2;
+		if(w < 1) { w = 1; }
+	}
+	g_window = w;
+	if(g_verbosity >= 2) { fprintf(g_err, "window: %ld\n", w); }
+}
+
+// Scale the window for chunks of BS to about the bytes we had in flight with chunks of oldBS.
+// tpad will not read ahead more than PENDING_MAXBYTES for us
+static void fit_window(long oldBS, long BS)
+{
+	long w;
+
+	g_maxwindow = PENDING_MAXBYTES / BS;
+	if(g_maxwindow > MAXWINDOW) { g_maxwindow = MAXWINDOW; }
+	if(g_maxwindow < 1) { g_maxwindow = 1; }
+
+	w = (g_window * oldBS) / BS;
+	if((w < 2) && (g_window >= 2)) { w = 2; }
+	if(w < 1) { w = 1; }
+	if(w > g_maxwindow) { w = g_maxwindow; }
+	g_window = w;
+}
+
+static int recv_more(void *s)
+{
+	int more = 0;
+	size_t moresz = sizeof(more);
+
+	(void) zmq_getsockopt(s, ZMQ_RCVMORE, &more, &moresz);
+	return more;
+}
+
+// check_hash() for the binary framing
+static int check_hash_bin(void *s, gcfile_t *gcf, long bytes)
+{
+	int z;
+	char *stats;
+	char empty[4];
+	char errmsg[256];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+	tbin_hdr_t h;
+
+	memset(errmsg, 0, sizeof(errmsg));
+
+	tbin_pack(&h, TBIN_SUM, g_id, bytes, TPAD_DIGEST_SIZE);
+	z = zmq_send(s, "",		0,				ZMQ_SNDMORE);
+	z = zmq_send(s, &h,		TBIN_HDRSIZE,	ZMQ_SNDMORE);
+	z = zmq_send(s, gcfile_get_digest(gcf, TPAD_HASH_ALG), TPAD_DIGEST_SIZE, 0);
+
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
+	z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+	if((z == -1) || (tbin_unpack(&h, hbuf, z) != 0)) {
+		fprintf(g_err, "%s(): bad reply\n", __func__);
+		return -1;
+	}
+	if(recv_more(s)) { z = zmq_recv(s, errmsg, sizeof(errmsg)-1, 0); }
+
+	if(h.opcode & TBIN_ERRBIT) {
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", errmsg);
+		return -1;
+	}
+
+	stats = get_stats(gcf, g_tune.value);
+	if(g_verbosity >= 1) { fprintf(g_out, "%s %s\n", TSTAT_OK, stats); }
+	free(stats);
+	return 0;
+}
 
 static int check_hash(void *s, gcfile_t *gcf, long bytes)
 {
 	int z;
 	char *hash, *stats;
 	char offset[32];
+	char empty[4];
 	char status[16];
 	char msg2[1536];
 	char msg3[256];
 
+	if(g_binary) { return check_hash_bin(s, gcf, bytes); }
+
 	memset(offset,	0, sizeof(offset));
 	memset(status,	0, sizeof(status));
 	memset(msg2,	0, sizeof(msg2));
@@ -65,106 +257,607 @@ static int check_hash(void *s, gcfile_t *gcf, long bytes)
 	hash = gcfile_get_hash(gcf, TPAD_HASH_ALG);
 
 	snprintf(offset, sizeof(offset), "%ld", bytes);
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
 	z = zmq_send(s, TCMD_XFR,	strlen(TCMD_XFR)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, g_uuid,		sizeof(g_uuid),		ZMQ_SNDMORE);
 	z = zmq_send(s, offset,		sizeof(offset),		ZMQ_SNDMORE);
 	z = zmq_send(s, hash,		strlen(hash)+1,		0);
 
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
 	z = zmq_recv(s, status,	sizeof(status),	0);
 	// IF TSTAT_ERR - can we do a FUNC CALL here?
 	z = zmq_recv(s, msg2,	sizeof(msg2),	0);
 	z = zmq_recv(s, msg3,	sizeof(msg3),	0);
 
 	if(strcmp(status, TSTAT_ERR) == 0) {
-		if(g_verbosity >= 1) { printf("ERR\n"); }
-		fprintf(stderr, "%s\n", msg2);
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", msg2);
 		return -1;
 	}
 
-	stats = get_stats(gcf);
-	if(g_verbosity >= 1) { printf("%s %s\n", status, stats); }
+	stats = get_stats(gcf, g_tune.value);
+	if(g_verbosity >= 1) { fprintf(g_out, "%s %s\n", status, stats); }
 	free(stats);
 	free(hash);
 	return 0;
 }
 
-static long absorb_chunk(void *s, gcfile_t *gcf, long bytes)
+// absorb talks to tpad over a DEALER socket so that it can have more than one XFR outstanding.
+// Every message starts with the empty delimiter frame a REQ socket would have added for us.
+static void request_chunk(void *s, long bytes, long BS)
 {
 	int z;
-	size_t written;
-	char status[16];
 	char offset[32];
 	char blocksize[32];
-	unsigned char data[g_BS];
-	char len[32];
+	tbin_hdr_t h;
+
+	if(g_binary) {
+		tbin_pack(&h, TBIN_XFR, g_id, bytes, BS);
+		z = zmq_send(s, "",		0,				ZMQ_SNDMORE);
+		z = zmq_send(s, &h,		TBIN_HDRSIZE,	0);
+		return;
+	}
 
+	memset(offset,		0, sizeof(offset));
+	memset(blocksize,	0, sizeof(blocksize));
 	snprintf(offset, sizeof(offset), "%ld", bytes);
-	snprintf(blocksize, sizeof(blocksize), "%ld", g_BS);
+	snprintf(blocksize, sizeof(blocksize), "+%ld", BS);
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
 	z = zmq_send(s, TCMD_XFR,	strlen(TCMD_XFR)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, g_uuid,		sizeof(g_uuid),		ZMQ_SNDMORE);
 	z = zmq_send(s, offset,		sizeof(offset),		ZMQ_SNDMORE);
 	z = zmq_send(s, blocksize,	sizeof(blocksize),	0);
+	(void) z;
 
-	if(g_verbosity >= 2) printf("Requesting Chunk: %s(%s) ...", offset, blocksize);
+	if(g_verbosity >= 2) fprintf(g_out, "Requesting Chunk: %s(%s)\n", offset, blocksize);
+}
 
-	z = zmq_recv(s, status,	sizeof(status),	0);
+// absorb_chunk() for the binary framing
+static long absorb_chunk_bin(void *s, unsigned char *data, long bufsize, long *offset)
+{
+	int z;
+	char empty[4];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+	tbin_hdr_t h;
+
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
+	z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+	if((z == -1) || (tbin_unpack(&h, hbuf, z) != 0)) {
+		fprintf(g_err, "%s(): bad reply\n", __func__);
+		return -1;
+	}
+
+	z = 0;
+	if(recv_more(s)) { z = zmq_recv(s, data, bufsize, 0); }
+	if(z > bufsize) { z = bufsize; }
+	if(z >= 0) { data[z] = 0; }
+
+	if(h.opcode & TBIN_ERRBIT) {
+		// The caller can ask again for this one
+		if(strcmp((char *)data, "SERVER BUSY") == 0) {
+			if(g_verbosity >= 2) { fprintf(g_out, "BUSY at %lu\n", (unsigned long)h.offset); }
+			*offset = h.offset;
+			return CHUNK_BUSY;
+		}
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", data);
+		return -1;
+	}
+
+	if(g_verbosity >= 2) fprintf(g_out, "Got %d bytes at %lu\n", z, (unsigned long)h.offset);
+
+	if(z <= 0) {
+		fprintf(g_err, "BYTES == 0\n");
+		return -2;
+	}
+
+	*offset = h.offset;
+	return z;
+}
+
+// Receive one chunk into data (bufsize+1 bytes), *offset is where it belongs in the file
+static long absorb_chunk(void *s, unsigned char *data, long bufsize, long *offset)
+{
+	int z;
+	char *at;
+	char empty[4];
+	char status[16];
+	char len[48];
+	long bytes;
+
+	if(g_binary) { return absorb_chunk_bin(s, data, bufsize, offset); }
+
+	memset(status,	0, sizeof(status));
+	memset(len,		0, sizeof(len));
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
+	z = zmq_recv(s, status,	sizeof(status)-1,	0);
 	// IF TSTAT_ERR - can we do a FUNC CALL here?
-	z = zmq_recv(s, data,	sizeof(data),	0);
-	z = zmq_recv(s, len,	sizeof(len),	0);
+	z = zmq_recv(s, data,	bufsize,	0);
+	if(z > bufsize) { z = bufsize; }
+	if(z >= 0) { data[z] = 0; }
+	z = zmq_recv(s, len,	sizeof(len)-1,	0);
 
-	if(g_verbosity >= 2) printf(" got %s bytes\n", len);
+	if(g_verbosity >= 2) fprintf(g_out, "Got %s bytes\n", len);
 
 	if(strcmp(status, TSTAT_ERR) == 0) {
-		if(g_verbosity >= 1) { printf("ERR\n"); }
-		fprintf(stderr, "%s\n", data);
+		// The caller can ask again for this one, tpad says which it was after the '@'
+		at = strchr(len, '@');
+		if(at && (strcmp((char *)data, "SERVER BUSY") == 0)) {
+			if(g_verbosity >= 2) { fprintf(g_out, "BUSY at %s\n", at+1); }
+			*offset = atol(at+1);
+			return CHUNK_BUSY;
+		}
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", data);
 		return -1;
 	}
 
+	// An old tpad only answers in order and does not say where the chunk goes
+	at = strchr(len, '@');
+	if(at) { *offset = atol(at+1); }
+	if(g_pipeline == -1) { g_pipeline = (at != NULL); }
+
 	bytes = atol(len);
 	if(bytes == 0) {
-		if(g_verbosity >= 2) { printf("ERR\n"); }
-		fprintf(stderr, "BYTES == 0\n");
+		if(g_verbosity >= 2) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "BYTES == 0\n");
 		return -2;
 	}
 
+	return bytes;
+}
+
+static int write_chunk(gcfile_t *gcf, unsigned char *data, long bytes)
+{
+	size_t written;
+
 	written = gcfile_write(gcf, data, bytes);
 	if(written != bytes) {
-		fprintf(stderr, "written(%ld) != bytes(%ld)", written, bytes);
+		fprintf(g_err, "written(%ld) != bytes(%ld)", written, bytes);
 		return -3;
 	}
 
-	return written;
+	return 0;
 }
 
-static int absorb_file(void *s, char *freq)
+// Write a chunk that belongs at offset, or keep it until the ones in front of it arrive.
+// Chunks are written (and hashed) in file order, *bytes is how much has been written so far
+static int place_chunk(gcfile_t *gcf, early_t **early, long *bytes, unsigned char *data, long n, long offset)
+{
+	early_t *e, **pp;
+
+	if(offset != *bytes) {
+		// Keep it sorted by offset
+		e = malloc(sizeof(early_t) + n);
+		if(!e) { return -6; }
+		e->offset = offset;
+		e->bytes = n;
+		memcpy(e->data, data, n);
+		for(pp=early; *pp; pp=&(*pp)->next) {
+			if((*pp)->offset > offset) { break; }
+		}
+		e->next = *pp;
+		*pp = e;
+		return 0;
+	}
+
+	if(write_chunk(gcf, data, n) != 0) { return -5; }
+	*bytes += n;
+
+	while(*early && ((*early)->offset == *bytes)) {
+		e = *early;
+		*early = e->next;
+		n = e->bytes;
+		if(write_chunk(gcf, e->data, n) != 0) { free(e); return -5; }
+		*bytes += n;
+		free(e);
+	}
+
+	return 0;
+}
+
+static void free_early(early_t *early)
+{
+	early_t *e;
+
+	while(early) {
+		e = early;
+		early = e->next;
+		free(e);
+	}
+}
+
+// Pull [start, end) of g_uuid into gcf, keeping up to g_window requests outstanding.
+// A new chunk size only takes effect once every request of the old size is answered:
+// tpad reads ahead in the block size of the request that skipped a gap,
+// so the blocks it holds only line up with requests of that same size
+static int absorb_chunks(void *s, gcfile_t *gcf, long start, long end, unsigned char *data, long bufsize)
+{
+	int err = 0, inflight = 0, retries = 0;
+	long requested = start, bytes = start;
+	long n, offset, BS = g_tune.value;
+	early_t *early = NULL;
+
+	ctune_epoch(&g_tune);
+	while(((bytes < end) && !err) || (inflight > 0)) {
+		nudge_window();
+		if((inflight == 0) && (BS != g_tune.value)) {
+			fit_window(BS, g_tune.value);
+			BS = g_tune.value;
+		}
+
+		if((requested < end) && !err && (BS == g_tune.value) && ((inflight == 0) ||
+			((g_pipeline == 1) && ((requested - bytes) < (g_window * BS))))) {
+			request_chunk(s, requested, BS);
+			requested += ((end - requested) < BS) ? (end - requested) : BS;
+			inflight++;
+			continue;
+		}
+
+		offset = bytes;
+		n = absorb_chunk(s, data, bufsize, &offset);
+		inflight--;
+		// tpad ran out of buffers, ask for the same block again and take smaller ones from now on
+		if((n == CHUNK_BUSY) && !err && (retries++ < BUSY_RETRIES)) {
+			ctune_backoff(&g_tune);
+			request_chunk(s, offset, BS);
+			inflight++;
+			continue;
+		}
+		if(n <= 0) { err = -5; continue; }
+		if(err) { continue; }
+
+		retries = 0;
+		err = place_chunk(gcf, &early, &bytes, data, n, offset);
+		if(ctune_chunk(&g_tune, n) && (g_verbosity >= 2)) { fprintf(g_out, "chunk size: %ld\n", g_tune.value); }
+	}
+
+	free_early(early);
+	return err;
+}
+
+static void send_credit(void *s, long limit, long BS)
+{
+	int z;
+	tbin_hdr_t h;
+
+	tbin_pack(&h, TBIN_STREAM, g_id, limit, BS);
+	z = zmq_send(s, "",		0,				ZMQ_SNDMORE);
+	z = zmq_send(s, &h,		TBIN_HDRSIZE,	0);
+	(void) z;
+
+	if(g_verbosity >= 2) fprintf(g_out, "Credit up to: %ld\n", limit);
+}
+
+// Let tpad push [start, end) of g_uuid at us, followed by its digest.
+// We hand out credit g_window blocks at a time, topping it up once half of it is written.
+// Blocks from different tpad workers can overtake each other, so they go through place_chunk().
+// tpad cuts blocks in the size of the latest credit, so a new chunk size goes out with the next one
+// Throw away what tpad still sends for the credit it was given, so the next request on s
+// does not take a block for its reply. A stream tpad gives up on (SERVER BUSY, a read that failed)
+// never makes up the credit, so we also stop once s has been quiet for STREAM_DRAIN ms
+static void drain_stream(void *s, long owed, int want_digest, unsigned char *data, long bufsize)
+{
+	int z;
+	char empty[4];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+	tbin_hdr_t h;
+	zmq_pollitem_t item;
+
+	item.socket = s;
+	item.events = ZMQ_POLLIN;
+
+	while((owed > 0) || want_digest) {
+		if(zmq_poll(&item, 1, STREAM_DRAIN) <= 0) { break; }
+
+		z = zmq_recv(s, empty,	sizeof(empty),	0);
+		z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+		if((z == -1) || (tbin_unpack(&h, hbuf, z) != 0)) { memset(&h, 0, sizeof(h)); }
+		z = 0;
+		while(recv_more(s)) { z = zmq_recv(s, data, bufsize, 0); }
+
+		if(h.id != g_id) { continue; }
+		if(h.opcode == TBIN_XFR) { owed -= z; }
+		if(h.opcode == TBIN_SUM) { want_digest = 0; }
+	}
+
+	if(g_verbosity >= 2) { fprintf(g_out, "Stream drained, %ld bytes short\n", owed); }
+}
+
+static int absorb_stream(void *s, gcfile_t *gcf, long start, long end, unsigned char *data, long bufsize)
+{
+	int z, err = 0, got_digest = 0, retries = 0;
+	long bytes = start, credit = start, granted = start, recvd = 0, window, BS = g_tune.value;
+	unsigned char rmt_digest[TPAD_DIGEST_SIZE];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+	char empty[4];
+	tbin_hdr_t h;
+	zmq_pollitem_t item;
+	early_t *early = NULL;
+
+	item.socket = s;
+	item.events = ZMQ_POLLIN;
+
+	ctune_epoch(&g_tune);
+	while(!err && ((bytes < end) || !got_digest)) {
+		nudge_window();
+		if(BS != g_tune.value) {
+			fit_window(BS, g_tune.value);
+			BS = g_tune.value;
+		}
+
+		window = g_window * BS;
+		if((credit < end) && ((credit - bytes) <= (window / 2))) {
+			credit = bytes + window;
+			if(credit > end) { credit = end; }
+			if(credit > granted) { granted = credit; }
+			send_credit(s, credit, BS);
+		}
+
+		z = zmq_poll(&item, 1, STREAM_TIMEOUT);
+		if(z == -1) { err = -8; break; }
+		if(z == 0) { fprintf(g_err, "STREAM STALLED AT %ld\n", bytes); err = -8; break; }
+
+		z = zmq_recv(s, empty,	sizeof(empty),	0);
+		z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+		if((z == -1) || (tbin_unpack(&h, hbuf, z) != 0)) {
+			fprintf(g_err, "%s(): bad message\n", __func__);
+			err = -5;
+			break;
+		}
+
+		z = 0;
+		if(recv_more(s)) { z = zmq_recv(s, data, bufsize, 0); }
+		if(z < 0) { err = -5; break; }
+		if(z > bufsize) { z = bufsize; }
+		data[z] = 0;
+
+		// Leftovers from an earlier transfer
+		if(h.id != g_id) { continue; }
+
+		if(h.opcode & TBIN_ERRBIT) {
+			// tpad ran out of buffers, credit it again and take smaller blocks from now on
+			if((strcmp((char *)data, "SERVER BUSY") == 0) && (retries++ < BUSY_RETRIES)) {
+				if(g_verbosity >= 2) { fprintf(g_out, "BUSY at %ld\n", bytes); }
+				ctune_backoff(&g_tune);
+				credit = bytes;
+				continue;
+			}
+			if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+			fprintf(g_err, "%s\n", data);
+			err = -1;
+		} else if(h.opcode == TBIN_XFR) {
+			recvd += z;
+			if((z <= 0) || (z > g_tune.max)) { err = -5; break; }
+			retries = 0;
+			err = place_chunk(gcf, &early, &bytes, data, z, h.offset);
+			if(ctune_chunk(&g_tune, z) && (g_verbosity >= 2)) { fprintf(g_out, "chunk size: %ld\n", g_tune.value); }
+		} else if((h.opcode == TBIN_SUM) && (z == TPAD_DIGEST_SIZE)) {
+			memcpy(rmt_digest, data, TPAD_DIGEST_SIZE);
+			got_digest = 1;
+		}
+	}
+
+	free_early(early);
+	if(err) {
+		// Every block is sent once, so tpad owes us up to the most credit it was ever given
+		drain_stream(s, (granted - start) - recvd, ((granted == end) && !got_digest), data, bufsize);
+		return err;
+	}
+
+	if(memcmp(gcfile_get_digest(gcf, TPAD_HASH_ALG), rmt_digest, TPAD_DIGEST_SIZE) != 0) {
+		if(g_verbosity >= 1) { fprintf(g_out, "%s\n", "HASH ERROR"); }
+		return -7;
+	}
+
+	return 0;
+}
+
+// Send a binary request and wait for its reply header in h.
+// Returns 0 if tpad took it, -1 with the reason on g_err if not
+static int bin_request(void *s, tbin_hdr_t *h, void *payload, size_t len)
+{
+	int z;
+	char empty[4];
+	char errmsg[1536];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+
+	z = zmq_send(s, "",		0,				ZMQ_SNDMORE);
+	z = zmq_send(s, h,		TBIN_HDRSIZE,	payload ? ZMQ_SNDMORE : 0);
+	if(payload) { z = zmq_send(s, payload, len, 0); }
+
+	memset(errmsg, 0, sizeof(errmsg));
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
+	z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+	if((z == -1) || (tbin_unpack(h, hbuf, z) != 0)) { fprintf(g_err, "%s(): bad reply\n", __func__); return -1; }
+	if(recv_more(s)) { z = zmq_recv(s, errmsg, sizeof(errmsg)-1, 0); }
+
+	if(h->opcode & TBIN_ERRBIT) {
+		fprintf(g_err, "%s\n", errmsg);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Pull one part of a striped file over its own socket into its place in the file, see absorb_striped()
+static void* stripe_worker(void *arg)
+{
+	stripe_t *p = arg;
+	int z;
+	long start, end, bufsize;
+	void *s;
+	unsigned char *data;
+	gcfile_t gcf;
+	tbin_hdr_t h;
+
+	g_out = open_memstream(&p->out, &p->outlen);
+	g_err = open_memstream(&p->err, &p->errlen);
+	if(!g_out) { g_out = stdout; }
+	if(!g_err) { g_err = stderr; }
+	g_tune = p->tune;
+	g_window = p->window;
+	g_maxwindow = p->maxwindow;
+	g_winseen = p->winseen;
+
+	s = zmq_socket(g_zContext, ZMQ_DEALER);
+	zmq_connect(s, g_zmqaddr);
+	bufsize = (g_tune.max > 256) ? g_tune.max : 256;
+	data = malloc(bufsize+1);
+	GCFILE_INIT(&gcf);
+
+	stripe_range(p->size, p->nparts, p->part, &start, &end);
+	tbin_pack(&h, TBIN_PART, p->file, p->part, 0);
+	if(!data) {
+		fprintf(g_err, "%s(): malloc(%ld) failed!\n", __func__, bufsize+1);
+	} else if(bin_request(s, &h, NULL, 0) == 0) {
+		g_id = h.id;
+		snprintf(g_uuid, sizeof(g_uuid), "%lu", (unsigned long)g_id);
+
+		z = gcfile_open(&gcf, p->path, "r+");
+		if(z == 0) { z = gcfile_enable(&gcf, TPAD_HASH_ALG); }
+		if(z == 0) { z = gcfile_seek(&gcf, start); }
+		if(z != 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf)); }
+		if((z == 0) && g_stream) { z = absorb_stream(s, &gcf, start, end, data, bufsize); }
+		else if(z == 0) { z = absorb_chunks(s, &gcf, start, end, data, bufsize); }
+		// tpad keeps the digest of the part for the JOIN
+		if((z == 0) && (check_hash_bin(s, &gcf, end) == 0)) {
+			memcpy(p->digest, gcfile_get_digest(&gcf, TPAD_HASH_ALG), TPAD_DIGEST_SIZE);
+			p->ok = 1;
+		}
+		gcfile_close(&gcf);
+	}
+	p->tune = g_tune;
+
+	free(data);
+	zmq_close(s);
+	if(g_out != stdout) { fclose(g_out); }
+	if(g_err != stderr) { fclose(g_err); }
+	return NULL;
+}
+
+// Pull a large file from the GET or claim in g_id as up to g_stripes parts at once, each over its own socket.
+// Every part is written into its place in a file of the full size and checked with tpad on its own,
+// the JOIN checks the digest of those digests and removes the file from the spool.
+// Returns ABSORB_NOSTRIPE if tpad would not split it, the file can still be pulled as one
+static int absorb_striped(void *s, char *filename, long size)
+{
+	int i, n, nparts, ok;
+	long usec;
+	char *stats;
+	unsigned char *digests;
+	unsigned char digest[TPAD_DIGEST_SIZE];
+	stripe_t *parts;
+	gcfile_t gcf;
+	tbin_hdr_t h;
+	struct timespec start, now;
+
+	nparts = g_stripes;
+	if(nparts > (size / STRIPE_ALIGN)) { nparts = size / STRIPE_ALIGN; }
+
+	tbin_pack(&h, TBIN_STRIPE, g_id, size, nparts);
+	if(bin_request(s, &h, NULL, 0) != 0) { return ABSORB_NOSTRIPE; }
+
+	// The parts write into a file that already has its size
+	GCFILE_INIT(&gcf);
+	if(gcfile_open(&gcf, filename, "w") != 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf)); return -3; }
+	if(file_preallocate(fileno(gcf.f), size) != 0) {
+		fprintf(g_err, "Could not preallocate %ld bytes for %s: %s\n", size, filename, strerror(errno));
+		gcfile_close(&gcf);
+		remove(filename);
+		return -3;
+	}
+	gcfile_close(&gcf);
+
+	parts = calloc(nparts, sizeof(stripe_t));
+	digests = malloc(nparts * TPAD_DIGEST_SIZE);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(n=0; parts && digests && (n<nparts); n++) {
+		parts[n].path = filename;
+		parts[n].part = n;
+		parts[n].nparts = nparts;
+		parts[n].size = size;
+		parts[n].file = h.id;
+		parts[n].tune = g_tune;
+		parts[n].window = g_window;
+		parts[n].maxwindow = g_maxwindow;
+		parts[n].winseen = g_winseen;
+		if(pthread_create(&parts[n].thr, NULL, stripe_worker, &parts[n]) != 0) { break; }
+	}
+
+	// A part that never went out makes the JOIN fail, tpad keeps the file then
+	ok = (n == nparts);
+	for(i=0; i<n; i++) {
+		pthread_join(parts[i].thr, NULL);
+		if(parts[i].outlen && (g_verbosity >= 2)) { fprintf(g_out, "part %d: %s", i, parts[i].out); }
+		if(parts[i].errlen) { fprintf(g_err, "part %d: %s", i, parts[i].err); }
+		free(parts[i].out);
+		free(parts[i].err);
+		if(!parts[i].ok) { ok = 0; }
+		else { memcpy(digests + (i * TPAD_DIGEST_SIZE), parts[i].digest, TPAD_DIGEST_SIZE); }
+	}
+	// The next file starts off with what the first part found out
+	if(n > 0) { g_tune = parts[0].tune; }
+
+	if(ok) { gcry_md_hash_buffer(TPAD_HASH_ALG, digest, digests, nparts * TPAD_DIGEST_SIZE); }
+	tbin_pack(&h, TBIN_JOIN, h.id, size, ok ? TPAD_DIGEST_SIZE : 0);
+	if(bin_request(s, &h, ok ? digest : NULL, TPAD_DIGEST_SIZE) != 0) { ok = 0; }
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = ((now.tv_sec - start.tv_sec) * 1000000L) + ((now.tv_nsec - start.tv_nsec) / 1000L);
+
+	free(digests);
+	free(parts);
+
+	if(!ok) {
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		remove(filename);
+		return -7;
+	}
+
+	stats = rate_stats(size, usec, 0);
+	if(g_verbosity >= 1) { fprintf(g_out, "%s %s <%d stripes>\n", TSTAT_OK, stats, nparts); }
+	free(stats);
+	return 0;
+}
+
+// Take tpad's answer to a GET or a CLAIMCMD, [status][filename][filesize][uuid], and pull the file
+static int absorb_reply(void *s)
 {
 	int z;
 	char status[16];
 	char empty[4];
 	char filename[1024+1];
 	char filesize[32];
-	long size, chunk_size, bytes;
+	long size, bufsize;
+	unsigned char *data;
 	gcfile_t gcf;
 	int err;
 
-	memset(empty, 0, sizeof(empty));
-	z = zmq_send(s, TCMD_GET,	strlen(TCMD_GET)+1,	ZMQ_SNDMORE);
-	z = zmq_send(s, freq,		strlen(freq)+1,		ZMQ_SNDMORE);
-	z = zmq_send(s, empty,		1,					ZMQ_SNDMORE);
-	z = zmq_send(s, empty,		1,					0);
-
-	z = zmq_recv(s, status,		sizeof(status),		0);
+	memset(status, 0, sizeof(status));
+	memset(filename, 0, sizeof(filename));
+	z = zmq_recv(s, empty,		sizeof(empty),		0);
+	if(z == -1) { return ABSORB_NOSOCK; }
+	z = zmq_recv(s, status,		sizeof(status)-1,	0);
 	// IF TSTAT_ERR - can we do a FUNC CALL here?
-	z = zmq_recv(s, filename,	sizeof(filename),	0);
+	z = zmq_recv(s, filename,	sizeof(filename)-1,	0);
 	z = zmq_recv(s, filesize,	sizeof(filesize),	0);
-	z = zmq_recv(s, g_uuid,		sizeof(g_uuid),		0);
+	// An error is one frame short
+	g_uuid[0] = 0;
+	if(recv_more(s)) { z = zmq_recv(s, g_uuid, sizeof(g_uuid)-1, 0); }
+	g_id = strtoull(g_uuid, NULL, 10);
+
+	if(strcmp(status, TSTAT_ERR) == 0) {
+		// Nothing left to claim, or a tpad that can not claim
+		if(strcmp(filename, NOFILESMSG) == 0) { return ABSORB_NOFILES; }
+		if(strncmp(filename, "INVALID COMMAND", 15) == 0) { return ABSORB_NOCMD; }
+	}
 
-	//if(g_verbosity >= 1) printf("Absorbing File: %s(%s) ... ", filename, filesize);
-	if(g_verbosity >= 1) printf("Absorbing File: %s ... ", filename);
+	//if(g_verbosity >= 1) fprintf(g_out, "Absorbing File: %s(%s) ... ", filename, filesize);
+	if(g_verbosity >= 1) fprintf(g_out, "Absorbing File: %s ... ", filename);
 
 	if(strcmp(status, TSTAT_ERR) == 0) {
-		if(g_verbosity >= 1) { printf("ERR\n"); }
-		fprintf(stderr, "%s\n", filename);
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", filename);
 		return -1;
 	}
 
@@ -173,40 +866,135 @@ static int absorb_file(void *s, char *freq)
 	if(g_noclobber) {
 		int file_exists = is_regfile(filename, 0);
 		if(file_exists != -1) {
-			if(g_verbosity >= 1) printf("EXISTS\n");
-			if(g_verbosity >= 2) printf("%s exists and we are set to no_clobber!\n", filename);
+			if(g_verbosity >= 1) fprintf(g_out, "EXISTS\n");
+			if(g_verbosity >= 2) fprintf(g_out, "%s exists and we are set to no_clobber!\n", filename);
 			// If we do this, we have to tell the server that we are aborting the transfer, so it can free the xfer slot
 			return -2;
 		}
 	}
 #endif
 
-	if(g_verbosity >= 2) { printf("\n"); }
+	// A file from under a dir of the spool goes under the same dir here, but never outside of it
+	if(path_security_check(filename) || path_safe_join(filename, 1)) {
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "INVALID FILENAME %s\n", filename);
+		return -5;
+	}
+
+	if(g_verbosity >= 2) { fprintf(g_out, "\n"); }
+
+	// Large files come in parts at once, if tpad knows how
+	size = atol(filesize);
+	if((g_binary >= 5) && (g_stripes > 1) && (size >= g_stripemin) && (size >= (2L * STRIPE_ALIGN))) {
+		err = absorb_striped(s, filename, size);
+		if(err != ABSORB_NOSTRIPE) {
+			if(!err) {
+				g_nfiles++;
+				g_nbytes += size;
+			}
+			return err;
+		}
+	}
 
 	GCFILE_INIT(&gcf);
 	z = gcfile_open(&gcf, filename, "w");
-	if(z != 0) { fprintf(stderr, "%s\n", GCFILE_GETERRMSG(&gcf)); return -3; }
+	if(z != 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf)); return -3; }
 
 	z = gcfile_enable(&gcf, TPAD_HASH_ALG);
-	if(z < 0) { fprintf(stderr, "%s\n", GCFILE_GETERRMSG(&gcf)); return -4; }
+	if(z < 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf)); return -4; }
 
-	size = atol(filesize);
-	bytes = 0;
+	// Big enough for the largest chunk and for any error text
+	bufsize = (g_tune.max > 256) ? g_tune.max : 256;
+	data = malloc(bufsize+1);
+	if(!data) { fprintf(g_err, "%s(): malloc(%ld) failed!\n", __func__, bufsize+1); gcfile_close(&gcf); return -6; }
 
-	while(bytes < size) {
-		chunk_size = absorb_chunk(s, &gcf, bytes);
-		if(chunk_size <= 0) { return -5; }
-		bytes += chunk_size;
+	if(g_stream) {
+		err = absorb_stream(s, &gcf, 0, size, data, bufsize);
+	} else {
+		err = absorb_chunks(s, &gcf, 0, size, data, bufsize);
 	}
+	free(data);
+	if(err) { gcfile_close(&gcf); return err; }
 
 	// Once the transfer it complete, check the hash with the server
-	err = check_hash(s, &gcf, bytes);
+	err = check_hash(s, &gcf, size);
+	if(!err) {
+		g_nfiles++;
+		g_nbytes += gcfile_get_bytecount(&gcf);
+	}
 
 	gcfile_close(&gcf);
 	GCFILE_INIT(&gcf);
 	return err;
 }
 
+static int absorb_file(void *s, char *freq)
+{
+	int z;
+	char empty[4];
+
+	memset(empty, 0, sizeof(empty));
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
+	z = zmq_send(s, TCMD_GET,	strlen(TCMD_GET)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, freq,		strlen(freq)+1,		ZMQ_SNDMORE);
+	z = zmq_send(s, empty,		1,					ZMQ_SNDMORE);
+	z = zmq_send(s, empty,		1,					0);
+	if(z == -1) { return -1; }
+
+	return absorb_reply(s);
+}
+
+// Have tpad pick the next file in g_order that passes g_filter and hand it to us alone
+static int claim_file(void *s)
+{
+	int z;
+	char empty[4];
+	char spec[32+sizeof(g_filter)];
+
+	snprintf(spec, sizeof(spec), "%s\n%s", g_order, g_filter);
+	memset(empty, 0, sizeof(empty));
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
+	z = zmq_send(s, TCMD_CMD,	strlen(TCMD_CMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, CLAIMCMD,	strlen(CLAIMCMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, spec,		strlen(spec)+1,		ZMQ_SNDMORE);
+	z = zmq_send(s, empty,		1,					0);
+	if(z == -1) { return ABSORB_NOSOCK; }
+
+	return absorb_reply(s);
+}
+
+// Ask tpad for the binary framing, returns the version we will use (0 for ASCII)
+// and sets *maxchunk to the largest chunk it serves
+static int say_hello(void *s, long *maxchunk)
+{
+	int z;
+	char vers[16];
+	char empty[4];
+	char status[16];
+	char resp[64];
+
+	memset(status,	0, sizeof(status));
+	memset(resp,	0, sizeof(resp));
+
+	snprintf(vers, sizeof(vers), "%d", TBIN_PROTO);
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
+	z = zmq_send(s, TCMD_CMD,	strlen(TCMD_CMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, HELLOCMD,	strlen(HELLOCMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, vers,		strlen(vers)+1,		ZMQ_SNDMORE);
+	z = zmq_send(s, "",			1,					0);
+
+	z = zmq_recv(s, empty,	sizeof(empty),		0);
+	z = zmq_recv(s, status,	sizeof(status)-1,	0);
+	z = zmq_recv(s, resp,	sizeof(resp)-1,		0);
+	z = zmq_recv(s, vers,	sizeof(vers)-1,		0);
+	if(z == -1) { return 0; }
+
+	// An older tpad does not know the command
+	if(strcmp(status, TSTAT_OK) != 0) { return 0; }
+	if((atol(vers) > 0) && (atol(vers) <= MAXCHUNKLIMIT)) { *maxchunk = atol(vers); }
+	return atoi(resp);
+}
+
 // This must be free()'d
 static char* req_file(void *s, char *method)
 {
@@ -216,6 +1004,7 @@ static char* req_file(void *s, char *method)
 	char resp[1024+1];
 
 	memset(empty, 0, sizeof(empty));
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
 	z = zmq_send(s, TCMD_CMD,	strlen(TCMD_CMD)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, method,		strlen(method)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, empty,		1,					ZMQ_SNDMORE);
@@ -224,6 +1013,7 @@ static char* req_file(void *s, char *method)
 	// Receive Status and File Count
 	memset(status, 0, sizeof(status));
 	memset(resp, 0, sizeof(resp));
+	z = zmq_recv(s, empty,	sizeof(empty)-1,	0);
 	z = zmq_recv(s, status,	sizeof(status)-1,	0);
 	z = zmq_recv(s, resp,	sizeof(resp)-1,		0);
 	z = zmq_recv(s, empty,	sizeof(empty)-1,	0);
@@ -231,12 +1021,12 @@ static char* req_file(void *s, char *method)
 	//if(strcmp(status, TSTAT_ERR) == 0) { print_error(s); return -1; }
 
 	if(strcmp(status, TSTAT_ERR) == 0) {
-		if(g_verbosity >= 1) { printf("ERR\n"); }
-		fprintf(stderr, "%s\n", resp);
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", resp);
 		return NULL;
 	}
 
-	if(g_verbosity >= 2) printf("file: %s\n", resp);
+	if(g_verbosity >= 2) fprintf(g_out, "file: %s\n", resp);
 	return strdup(resp);
 }
 
@@ -249,6 +1039,7 @@ static long req_count(void *s)
 	long count = 0;
 
 	memset(empty, 0, sizeof(empty));
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
 	z = zmq_send(s, TCMD_CMD,	strlen(TCMD_CMD)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, COUNTCMD,	strlen(COUNTCMD)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, empty,		1,					ZMQ_SNDMORE);
@@ -257,6 +1048,7 @@ static long req_count(void *s)
 	// Receive Status and File Count
 	memset(status, 0, sizeof(status));
 	memset(resp, 0, sizeof(resp));
+	z = zmq_recv(s, empty,	sizeof(empty)-1,	0);
 	z = zmq_recv(s, status,	sizeof(status)-1,	0);
 	z = zmq_recv(s, resp,	sizeof(resp)-1,		0);
 	z = zmq_recv(s, empty,	sizeof(empty)-1,	0);
@@ -264,48 +1056,403 @@ static long req_count(void *s)
 	//if(strcmp(status, TSTAT_ERR) == 0) { print_error(s); return -1; }
 
 	if(strcmp(status, TSTAT_ERR) == 0) {
-		if(g_verbosity >= 1) { printf("ERR\n"); }
-		fprintf(stderr, "%s\n", resp);
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", resp);
 		return -1;
 	}
 
 	count = atol(resp);
-	if(g_verbosity >= 2) printf("files available: %lu\n", count);
+	if(g_verbosity >= 2) fprintf(g_out, "files available: %lu\n", count);
 	return count;
 }
 
+// The old way: count, pick one, pull it, repeat
+static int drain_count(void *s)
+{
+	int z = 0;
+	char *incfile;
+	long remote_file_count;
+
+	remote_file_count = req_count(s);
+	while(remote_file_count > 0) {
+		incfile = req_file(s, g_method);
+		if(incfile) {
+			z = absorb_file(s, incfile);
+			free(incfile);
+		}
+		if(z != 0) { break; }
+		//sleep(1);
+		remote_file_count = req_count(s);
+	}
+
+	return z;
+}
+
+// Ask for a page of the manifest after cursor, cursor is updated to where the next page starts.
+// Returns the number of files in *listing (which must be free()'d), -1 if tpad said no
+static long req_manifest(void *s, char *cursor, size_t cursorsz, char **listing)
+{
+	int z;
+	long n = 0;
+	char *p;
+	char empty[4];
+	char status[16];
+	char order[32];
+	zmq_msg_t resp;
+
+	snprintf(order, sizeof(order), "%s %d", (strcmp(g_order, "random") == 0) ? "name" : g_order, MANIFEST_PAGE);
+	z = zmq_send(s, "",				0,						ZMQ_SNDMORE);
+	z = zmq_send(s, TCMD_CMD,		strlen(TCMD_CMD)+1,		ZMQ_SNDMORE);
+	z = zmq_send(s, MANIFESTCMD,	strlen(MANIFESTCMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, order,			strlen(order)+1,		ZMQ_SNDMORE);
+	z = zmq_send(s, cursor,			strlen(cursor)+1,		0);
+
+	// The listing can be any size, take it as a message
+	memset(status, 0, sizeof(status));
+	z = zmq_recv(s, empty,	sizeof(empty),		0);
+	z = zmq_recv(s, status,	sizeof(status)-1,	0);
+	zmq_msg_init(&resp);
+	z = zmq_msg_recv(&resp, s, 0);
+	*listing = (z < 0) ? NULL : malloc(z+1);
+	if(*listing) {
+		memcpy(*listing, zmq_msg_data(&resp), z);
+		(*listing)[z] = 0;
+	}
+	zmq_msg_close(&resp);
+	memset(cursor, 0, cursorsz);
+	z = zmq_recv(s, cursor,	cursorsz-1,	0);
+
+	if((strcmp(status, TSTAT_OK) != 0) || !*listing) {
+		if(g_verbosity >= 2) { fprintf(g_err, "%s: %s\n", MANIFESTCMD, *listing ? *listing : "ERR"); }
+		free(*listing);
+		*listing = NULL;
+		cursor[0] = 0;
+		return -1;
+	}
+
+	for(p=*listing; *p; p++) { if(*p == '\n') { n++; } }
+	if(g_verbosity >= 2) { fprintf(g_out, "manifest: %ld files\n", n); }
+	return n;
+}
+
+// Drain the spool a page of the manifest at a time, instead of asking what to pull before every file.
+// Once the last page is done, start over to pick up what came in meanwhile, until the spool is empty.
+// Returns 1 if tpad does not know MANIFESTCMD
+static int drain_manifest(void *s)
+{
+	int z = 0, fresh = 1;
+	long i, j, n;
+	char *listing, *line, *name, *tmp;
+	char **names;
+	char cursor[1024+32];
+
+	cursor[0] = 0;
+	while(1) {
+		n = req_manifest(s, cursor, sizeof(cursor), &listing);
+		if(n < 0) { return fresh ? 1 : -1; }
+		if(n == 0) {
+			free(listing);
+			if(fresh) { return 0; }
+			fresh = 1;
+			continue;
+		}
+
+		names = calloc(n, sizeof(char *));
+		if(!names) { free(listing); return -1; }
+
+		// "size mtime name" per line
+		i = 0;
+		for(line=strtok_r(listing, "\n", &tmp); line && (i<n); line=strtok_r(NULL, "\n", &tmp)) {
+			name = strchr(line, ' ');
+			if(name) { name = strchr(name+1, ' '); }
+			if(name) { names[i++] = name+1; }
+		}
+		n = i;
+
+		if(strcmp(g_order, "random") == 0) {
+			for(i=n-1; i>0; i--) {
+				j = rand() % (i+1);
+				name = names[i]; names[i] = names[j]; names[j] = name;
+			}
+		}
+
+		for(i=0; i<n; i++) {
+			z = absorb_file(s, names[i]);
+			if(z != 0) { break; }
+		}
+
+		free(names);
+		free(listing);
+		if(z != 0) { return z; }
+		fresh = (cursor[0] == 0);
+	}
+}
+
+// Claim a file and pull it, until tpad has none left for us.
+// Any number of absorbs can drain the same tpad like this, no file goes to two of them.
+// Returns 1 if tpad does not know CLAIMCMD
+static int drain_claim(void *s)
+{
+	int z, fresh = 1;
+
+	while((z = claim_file(s)) == 0) { fresh = 0; }
+	if(z == ABSORB_NOFILES) { return 0; }
+	if(z == ABSORB_NOCMD) { return fresh ? 1 : -1; }
+	return z;
+}
+
+// Print what one claim had to say in one piece, other workers print theirs in between
+static void worker_report(char *out, size_t outlen, char *err, size_t errlen)
+{
+	pthread_mutex_lock(&g_outlock);
+	if(outlen) { fwrite(out, 1, outlen, stdout); }
+	if(errlen) { fwrite(err, 1, errlen, stderr); }
+	pthread_mutex_unlock(&g_outlock);
+}
+
+// drain_claim() on the worker's own socket
+static void* job_worker(void *arg)
+{
+	int z, fresh = 1;
+	char *out, *err;
+	size_t outlen, errlen;
+	worker_t *w = arg;
+	struct timespec start, now;
+
+	g_tune = w->tune;
+	g_window = w->window;
+	g_maxwindow = w->maxwindow;
+	g_winseen = w->winseen;
+	g_nfiles = 0;
+	g_nbytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	do {
+		out = err = NULL;
+		outlen = errlen = 0;
+		g_out = open_memstream(&out, &outlen);
+		g_err = open_memstream(&err, &errlen);
+		if(!g_out) { g_out = stdout; }
+		if(!g_err) { g_err = stderr; }
+		z = claim_file(w->s);
+		if(g_out != stdout) { fclose(g_out); }
+		if(g_err != stderr) { fclose(g_err); }
+		worker_report(out, outlen, err, errlen);
+		free(out);
+		free(err);
+		if(z == 0) { fresh = 0; }
+	} while(z == 0);
+
+	if(z == ABSORB_NOFILES) { z = 0; }
+	if(z == ABSORB_NOCMD) { z = fresh ? 1 : -1; }
+	w->z = z;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	w->usec = ((now.tv_sec - start.tv_sec) * 1000000L) + ((now.tv_nsec - start.tv_nsec) / 1000L);
+	w->files = g_nfiles;
+	w->bytes = g_nbytes;
+	w->tune = g_tune;
+	w->window = g_window;
+	w->maxwindow = g_maxwindow;
+	w->winseen = g_winseen;
+	return NULL;
+}
+
+static void jobs_stop(void)
+{
+	int i;
+
+	for(i=0; i<g_jobs; i++) {
+		if(g_workers[i].s) { zmq_close(g_workers[i].s); }
+		g_workers[i].s = NULL;
+	}
+}
+
+// Connect the workers, they start off with what the main socket found out
+static int jobs_start(void)
+{
+	int i;
+	worker_t *w;
+
+	for(i=0; i<g_jobs; i++) {
+		w = &g_workers[i];
+		memset(w, 0, sizeof(worker_t));
+		w->id = i;
+		w->s = zmq_socket(g_zContext, ZMQ_DEALER);
+		if(!w->s) {
+			fprintf(stderr, "zmq_socket() failed: %s\n", zmq_strerror(zmq_errno()));
+			jobs_stop();
+			return -1;
+		}
+		zmq_connect(w->s, g_zmqaddr);
+		w->tune = g_tune;
+		w->window = g_window;
+		w->maxwindow = g_maxwindow;
+		w->winseen = g_winseen;
+	}
+
+	return 0;
+}
+
+// Claim and pull with g_jobs workers at once until tpad has none left for any of them.
+// Claims keep them off each other's files. Returns 1 if tpad does not know CLAIMCMD
+static int drain_jobs(void)
+{
+	int i, n, z = 0, nocmd = 0;
+	long usec, files = 0, bytes = 0;
+	char *stats;
+	worker_t *w;
+	struct timespec start, now;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(n=0; n<g_jobs; n++) {
+		if(pthread_create(&g_workers[n].thr, NULL, job_worker, &g_workers[n]) != 0) { break; }
+	}
+	if(n < g_jobs) { fprintf(stderr, "pthread_create() failed, %d workers\n", n); }
+	for(i=0; i<n; i++) { pthread_join(g_workers[i].thr, NULL); }
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = ((now.tv_sec - start.tv_sec) * 1000000L) + ((now.tv_nsec - start.tv_nsec) / 1000L);
+	if(n == 0) { return -1; }
+
+	for(i=0; i<n; i++) {
+		w = &g_workers[i];
+		if(w->z == 1) { nocmd++; }
+		else if(w->z != 0) { z = w->z; }
+		files += w->files;
+		bytes += w->bytes;
+		if((g_verbosity >= 2) && (w->files > 0)) {
+			stats = rate_stats(w->bytes, w->usec, w->tune.value);
+			printf("worker %d: %ld files %s\n", w->id, w->files, stats);
+			free(stats);
+		}
+	}
+	if(nocmd == n) { return 1; }
+
+	if((g_verbosity >= 1) && (files > 0)) {
+		stats = rate_stats(bytes, usec, 0);
+		printf("absorbed %ld files with %d workers %s\n", files, n, stats);
+		free(stats);
+	}
+
+	return z;
+}
+
+// An older tpad answers CLAIMCMD or MANIFESTCMD with ERR
+static int drain(void *s)
+{
+	int z;
+
+	if(g_jobs > 1) { z = drain_jobs(); }
+	else { z = drain_claim(s); }
+	// Without CLAIMCMD the filters would be ignored and we would take everything
+	if((z == 1) && g_filter[0]) {
+		fprintf(g_err, "TPAD can not filter, not absorbing anything!\n");
+		z = -1;
+	}
+	if((z == 1) && (g_jobs > 1)) { fprintf(stderr, "TPAD can not claim, absorbing one file at a time\n"); }
+	if(z == 1) { z = drain_manifest(s); }
+	if(z == 1) { z = drain_count(s); }
+	return z;
+}
+
+// Drain the spool every time tpad publishes a FILESEVENT, and every FOLLOW_RECHECK ms in case we missed one.
+// We subscribe before the first drain, so anything that comes in after it gets us going again
+static int follow(void *s)
+{
+	int z;
+	char buf[64];
+	void *sub;
+	zmq_pollitem_t item;
+
+	sub = zmq_socket(g_zContext, ZMQ_SUB);
+	if(!sub) { fprintf(g_err, "zmq_socket(ZMQ_SUB) failed: %s\n", zmq_strerror(zmq_errno())); return -1; }
+	(void) zmq_setsockopt(sub, ZMQ_SUBSCRIBE, FILESEVENT, strlen(FILESEVENT));
+	if(zmq_connect(sub, g_follow) != 0) {
+		fprintf(g_err, "zmq_connect(%s) failed: %s\n", g_follow, zmq_strerror(zmq_errno()));
+		zmq_close(sub);
+		return -1;
+	}
+
+	item.socket = sub;
+	item.fd = 0;
+	item.events = ZMQ_POLLIN;
+	while(1) {
+		// Whatever we heard so far, this drain takes care of
+		while(zmq_recv(sub, buf, sizeof(buf), ZMQ_DONTWAIT) >= 0) { ; }
+
+		// Only claims keep several absorbs off each other's files
+		z = (g_jobs > 1) ? drain_jobs() : drain_claim(s);
+		if((z == 1) || (z == ABSORB_NOCMD)) { fprintf(g_err, "TPAD can not claim, --follow needs it\n"); break; }
+		if(z == ABSORB_NOSOCK) { break; }
+		// A file that did not make it was reported already, it gets another go on the next drain.
+		// Not right away: a file tpad can not open goes straight back to the spool and would be claimed again
+		if((z != 0) && (g_verbosity >= 1)) { fprintf(g_out, "still following\n"); }
+
+		z = zmq_poll(&item, 1, FOLLOW_RECHECK);
+		if((z == -1) && (zmq_errno() != EINTR)) { break; }
+		if((g_verbosity >= 2) && (z == 0)) { fprintf(g_out, "no news from TPAD, checking anyway\n"); }
+	}
+
+	zmq_close(sub);
+	return z;
+}
+
 int main(int argc, char *argv[])
 {
 	int z;
 	void *zSock;
-	char *incfile;
-	long remote_file_count;
+	sigset_t mask;
+	pthread_t thr_id;
+	long maxchunk = MAXCHUNKSIZE;
 
+	g_out = stdout;
+	g_err = stderr;
+	srand(time(NULL));
 	tpad_gcinit(TPAD_GCRYPT_MINVERS);
 	parse_args(argc, argv);
 
 	z = chdir(g_outputdir);
 	if(z == -1) { fprintf(stderr, "chdir(%s) failed: %s\n", g_outputdir, strerror(errno)); exit(1); }
 
+	// Block them before zmq starts its threads, they inherit our mask
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	(void) pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	z = pthread_create(&thr_id, NULL, window_thread, &mask);
+	if(z) { fprintf(stderr, "pthread_create() failed!\n"); exit(1); }
+	(void) pthread_detach(thr_id);
+
 	g_zContext = zmq_ctx_new();
-	zSock = zmq_socket(g_zContext, ZMQ_REQ);
+	zSock = zmq_socket(g_zContext, ZMQ_DEALER);
 	zmq_connect(zSock, g_zmqaddr);
 
-	remote_file_count = req_count(zSock);
-	while(remote_file_count > 0) {
-		incfile = req_file(zSock, g_method);
-		if(incfile) {
-			z = absorb_file(zSock, incfile);
-			free(incfile);
-		}
-		if(z != 0) { break; }
-		//sleep(1);
-		remote_file_count = req_count(zSock);
+	// The binary framing always places replies by offset
+	if(!g_ascii) { g_binary = say_hello(zSock, &maxchunk); }
+	if(g_BS > maxchunk) {
+		fprintf(stderr, "TPAD serves chunks of up to %ld bytes, using that for --BS\n", maxchunk);
+		g_BS = maxchunk;
+	}
+	ctune_init(&g_tune, g_BS, maxchunk);
+
+	// Aim for about WINDOW_AUTOBYTES in flight
+	if(g_window == 0) {
+		g_window = WINDOW_AUTOBYTES / g_tune.value;
+		if(g_window < 2) { g_window = 2; }
 	}
+	fit_window(g_tune.value, g_tune.value);
+	if(g_binary) { g_pipeline = 1; }
+	if((g_binary >= 2) && !g_pull) { g_stream = 1; }
+
+	if((g_jobs > 1) && (jobs_start() != 0)) { g_jobs = 1; }
+	if(g_follow) { (void) follow(zSock); }
+	else { (void) drain(zSock); }
+	if(g_jobs > 1) { jobs_stop(); }
 
 	zmq_close(zSock);
 	zmq_ctx_destroy(g_zContext);
 	if(g_zmqaddr) free(g_zmqaddr);
+	if(g_follow) free(g_follow);
 	return 0;
 }
 
@@ -319,13 +1466,43 @@ struct options opts[] =
 	{  6, "newest",		"Newest files first",				NULL, 0 },
 	{  7, "largest",	"Largest files first",				NULL, 0 },
 	{  8, "smallest",	"Smallest files first",				NULL, 0 },
-	{  9, "BS",			"Set the chunk transfer size",		NULL, 1 },
+	{  9, "BS",			"Set the chunk transfer size (0 = tune it)",	NULL, 1 },
 #ifdef ABSORB_NOCLOBBER
 	{ 10, "nc",			"Do not clobber existing files",	NULL, 0 },
 #endif
+	{ 11, "window",		"Requests in flight (0 picks one from BS)",	NULL, 1 },
+	{ 12, "ascii",		"Do not ask for the binary framing",	NULL, 0 },
+	{ 13, "pull",		"Ask for each block instead of streaming",	NULL, 0 },
+	{ 14, "glob",		"Only files whose name matches this pattern",	NULL, 1 },
+	{ 15, "minsize",	"Only files of at least this many bytes",	NULL, 1 },
+	{ 16, "maxsize",	"Only files of at most this many bytes",	NULL, 1 },
+	{ 17, "older",		"Only files older than this many seconds",	NULL, 1 },
+	{ 18, "newer",		"Only files newer than this many seconds",	NULL, 1 },
+	{ 19, "follow",		"Keep running, woken up by the TPAD --pub address",	NULL, 1 },
+	{ 20, "jobs",		"Absorb this many files at once, each on its own socket",	NULL, 1 },
+	{ 21, "stripes",	"Pull a large file in this many parts at once",	NULL, 1 },
+	{ 22, "stripe-min",	"--stripes only splits files of at least this size",	NULL, 1 },
 	{ 0, NULL,		NULL,									NULL, 0 }
 };
 
+// tpad does the filtering, we only pass them along
+static void add_filter(char *key, char *val)
+{
+	size_t n;
+
+	if(strchr(val, '\n')) {
+		fprintf(stderr, "--%s can not have a newline in it!\n", key);
+		exit(EXIT_FAILURE);
+	}
+
+	n = strlen(g_filter);
+	if((n + strlen(key) + strlen(val) + 3) > sizeof(g_filter)) {
+		fprintf(stderr, "Too many filters!\n");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(g_filter+n, sizeof(g_filter)-n, "%s=%s\n", key, val);
+}
+
 static void parse_args(int argc, char **argv)
 {
 	char *args;
@@ -356,15 +1533,19 @@ static void parse_args(int argc, char **argv)
 				break;
 			case 5:
 				g_method = OLDESTCMD;
+				g_order = "oldest";
 				break;
 			case 6:
 				g_method = NEWESTCMD;
+				g_order = "newest";
 				break;
 			case 7:
 				g_method = LARGESTCMD;
+				g_order = "largest";
 				break;
 			case 8:
 				g_method = SMALLESTCMD;
+				g_order = "smallest";
 				break;
 			case 9:
 				g_BS = atol(args);
@@ -374,6 +1555,42 @@ static void parse_args(int argc, char **argv)
 				g_noclobber = 1;
 				break;
 #endif
+			case 11:
+				g_window = atol(args);
+				break;
+			case 12:
+				g_ascii = 1;
+				break;
+			case 13:
+				g_pull = 1;
+				break;
+			case 14:
+				add_filter("glob", args);
+				break;
+			case 15:
+				add_filter("minsize", args);
+				break;
+			case 16:
+				add_filter("maxsize", args);
+				break;
+			case 17:
+				add_filter("older", args);
+				break;
+			case 18:
+				add_filter("newer", args);
+				break;
+			case 19:
+				g_follow = strdup(args);
+				break;
+			case 20:
+				g_jobs = atoi(args);
+				break;
+			case 21:
+				g_stripes = atoi(args);
+				break;
+			case 22:
+				g_stripemin = atol(args);
+				break;
 			default:
 				fprintf(stderr, "Unexpected getopts Error! (%d)\n", c);
 				break;
@@ -397,4 +1614,29 @@ static void parse_args(int argc, char **argv)
 		//fprintf(stderr, "%s is not a directory!\n", g_outputdir);
 		exit(EXIT_FAILURE);
 	}
+
+	if((g_BS < 0) || (g_BS > MAXCHUNKLIMIT)) {
+		fprintf(stderr, "--BS must be between 0 and %d!\n", MAXCHUNKLIMIT);
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_window < 0) || (g_window > MAXWINDOW)) {
+		fprintf(stderr, "--window must be between 0 and %d!\n", MAXWINDOW);
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_jobs < 1) || (g_jobs > JOBS_MAX)) {
+		fprintf(stderr, "--jobs must be between 1 and %d!\n", JOBS_MAX);
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_stripes < 1) || (g_stripes > STRIPE_MAXPARTS)) {
+		fprintf(stderr, "--stripes must be between 1 and %d!\n", STRIPE_MAXPARTS);
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_stripemin < (2L * STRIPE_ALIGN)) {
+		fprintf(stderr, "--stripe-min must be at least %d!\n", 2 * STRIPE_ALIGN);
+		exit(EXIT_FAILURE);
+	}
 }
@@ -21,4 +21,12 @@ if [ ${METHOD} == "smallest" ]; then
   METHODARG="--smallest"
 fi
 
-exec /app/absorb.exe -Z tcp://${TPAD} -d /absorb/ ${METHODARG}
+if [ -n "${JOBS}" ]; then
+  JOBSARG="--jobs ${JOBS}"
+fi
+
+if [ -n "${STRIPES}" ]; then
+  STRIPESARG="--stripes ${STRIPES}"
+fi
+
+exec /app/absorb.exe -Z tcp://${TPAD} -d /absorb/ ${METHODARG} ${JOBSARG} ${STRIPESARG}
@@ -5,4 +5,25 @@ if [ ! -d /beam ]; then
   exit 1
 fi
 
-exec /app/beam.exe -Z tcp://${TPAD} -d /beam/
+if [ -n "${WATCH}" ]; then
+  WATCHARG="--watch"
+fi
+
+if [ -n "${RECURSIVE}" ]; then
+  RECURSIVEARG="--recursive"
+fi
+
+if [ -n "${WATCH}" ] && [ -n "${RECURSIVE}" ]; then
+  echo "WATCH only looks at /beam itself, it does not go with RECURSIVE!"
+  exit 1
+fi
+
+if [ -n "${JOBS}" ]; then
+  JOBSARG="--jobs ${JOBS}"
+fi
+
+if [ -n "${STRIPES}" ]; then
+  STRIPESARG="--stripes ${STRIPES}"
+fi
+
+exec /app/beam.exe -Z tcp://${TPAD} -d /beam/ ${WATCHARG} ${RECURSIVEARG} ${JOBSARG} ${STRIPESARG}
@@ -16,9 +16,8 @@
 	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
-#ifdef USE_GNU_BASENAME
+// For F_SETLEASE, with USE_POSIX_BASENAME libgen.h still gives us the POSIX basename(3)
 #define _GNU_SOURCE
-#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,7 +28,17 @@
 #endif
 
 #include <unistd.h>
+#include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <search.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <zmq.h>
 
 #include "getopts.h"
@@ -38,9 +47,64 @@
 #include "gchelper.h"
 #include "gcryptfile.h"
 #include "stats.h"
+#include "tbin.h"
+#include "tune.h"
+#include "walk.h"
 
 typedef struct dirent dir_t;
 
+// What --watch hears about, a file is only done once it has been closed after writing or moved in
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO)
+// Default ms a file has to be left alone before --watch sends it
+#define WATCH_SETTLE (100)
+// --jobs runs up to JOBS_MAX workers, each on its own socket.
+// Up to JOBS_QUEUE files (or batches) are handed out but not reported yet
+#define JOBS_MAX (16)
+#define JOBS_QUEUE (256)
+
+// Small files waiting to go out together in one BATCH message
+typedef struct {
+	int count;
+	long bytes;
+	char *path[BATCH_MAXFILES];
+	long len[BATCH_MAXFILES];
+} batch_t;
+
+// What a --jobs worker sends, and what it had to say about it once it is done
+typedef struct {
+	batch_t batch;
+	int done;
+	char *out, *err;
+	size_t outlen, errlen;
+} job_t;
+
+// One part of a file send_striped() is sending, and what came of it
+typedef struct {
+	char *path;
+	int part, nparts;
+	long size;
+	uint64_t file;
+	int ok;
+	unsigned char digest[TPAD_DIGEST_SIZE];
+	char *out, *err;
+	size_t outlen, errlen;
+} stripe_t;
+
+// A file --watch is waiting on, due once the settle delay has passed.
+// The delay is the same for every file, so the list stays in due order
+typedef struct pend_s {
+	struct pend_s *prev, *next;
+	long long due;
+	char name[];
+} pend_t;
+
+// A file --watch --keep has sent, as it was then
+typedef struct sent_s {
+	struct timespec ctime;
+	long size;
+	char name[];
+} sent_t;
+
 static void parse_args(int argc, char **argv);
 
 char *g_zmqaddr = NULL;
@@ -49,11 +113,52 @@ char *g_file = NULL;
 char *g_inputdir = NULL;
 
 int g_recursive = 0;
+int g_walkers = WALK_THREADS;
+// With --recursive a file goes to tpad by its path from here, ending in '/'
+char *g_top = NULL;
+size_t g_toplen = 0;
 int g_verbosity = 1;
 int g_delete = 1;
+int g_watch = 0;
+long g_settle = WATCH_SETTLE;
+// What --watch --keep sent, so an inotify overflow does not send the whole dir again.
+// One entry for every name it sent, until the watch ends
+void *g_sent = NULL;
+
+// One set per socket: every --jobs worker has its own transfer, chunk size and place to report to
+__thread char g_uuid[64+1];
+__thread uint64_t g_id = 0;
+__thread ctune_t g_tune;
+__thread FILE *g_out;
+__thread FILE *g_err;
+// 0 lets g_tune pick the chunk size as we go
+long g_BS = 0;
+long g_maxchunk = MAXCHUNKSIZE;
+// 0 keeps about WINDOW_AUTOBYTES in flight
+long g_window = 0;
+// Files up to this size go in a single message (TBIN_PROTO 3)
+long g_small = SMALLFILE_MAX;
+// and up to this many of them in a batch (TBIN_PROTO 4)
+int g_batch = BATCH_MAXFILES;
+// Files of at least g_stripemin go in up to this many parts at once (TBIN_PROTO 5)
+int g_stripes = 1;
+long g_stripemin = STRIPE_MINSIZE;
+// Binary framing version agreed on with tpad, 0 for ASCII
+int g_binary = 0;
+int g_ascii = 0;
 
-char g_uuid[64+1];
-long g_BS = 1000;
+void *g_zContext;
+// 1 sends everything from the main thread, 0 lets g_jtune pick how many workers send at once
+int g_jobs = 1;
+jtune_t g_jtune;
+static pthread_mutex_t g_jlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_jwork = PTHREAD_COND_INITIALIZER;	// a job to take, or time to go
+static pthread_cond_t g_jroom = PTHREAD_COND_INITIALIZER;	// a free slot in g_jobq
+static job_t g_jobq[JOBS_QUEUE];
+static long g_jsubmitted = 0, g_jtaken = 0, g_jreported = 0;
+static int g_jstop = 0;
+static int g_nworkers = 0;
+static pthread_t g_workers[JOBS_MAX];
 
 /*
 static void print_error(void *req)
@@ -69,56 +174,188 @@ static void print_error(void *req)
 }
 */
 
-static int send_chunk(void *s, gcfile_t *gcf, unsigned char *buf, size_t bytes)
+// beam talks to tpad over a DEALER socket so that it can have more than one chunk in flight.
+// Every message starts with the empty delimiter frame a REQ socket would have added for us.
+static void send_chunk(void *s, unsigned char *buf, size_t bytes, long offset)
+{
+	int z;
+	char chunkoff[24];
+	tbin_hdr_t h;
+
+	if(g_binary) {
+		tbin_pack(&h, TBIN_PUT, g_id, offset, bytes);
+		z = zmq_send(s, "",			0,				ZMQ_SNDMORE);
+		z = zmq_send(s, &h,			TBIN_HDRSIZE,	ZMQ_SNDMORE);
+		z = zmq_send(s, buf,		bytes,			0);
+		return;
+	}
+
+	snprintf(chunkoff, sizeof(chunkoff), "%ld", offset);
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
+	z = zmq_send(s, TCMD_PUT,	strlen(TCMD_PUT)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, g_uuid,		strlen(g_uuid)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, buf,		bytes,				ZMQ_SNDMORE);
+	z = zmq_send(s, chunkoff,	strlen(chunkoff)+1,	0);
+	(void) z;
+}
+
+static int compare_digest(gcfile_t *gcf, char *status, unsigned char *rmt_digest, char *rmt_hash)
+{
+	int r;
+	char *hashptr, *stats;
+
+	if(rmt_digest) {
+		r = memcmp(gcfile_get_digest(gcf, TPAD_HASH_ALG), rmt_digest, TPAD_DIGEST_SIZE);
+	} else {
+		hashptr = gcfile_get_hash(gcf, TPAD_HASH_ALG);
+		r = strcmp(hashptr, rmt_hash);
+		free(hashptr);
+	}
+
+	if(r == 0) {
+		stats = get_stats(gcf, g_tune.value);
+		if(g_verbosity >= 1) { fprintf(g_out, "%s %s\n", status, stats); }
+		free(stats);
+		return 1;
+	}
+
+	if(g_verbosity >= 1) { fprintf(g_out, "%s\n", "HASH ERROR"); }
+	return -1;
+}
+
+// recv_ack() for the binary framing
+static int recv_ack_bin(void *s, gcfile_t *gcf, long *acked)
+{
+	int z, more;
+	size_t moresz = sizeof(more);
+	char empty[4];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+	unsigned char payload[256];
+	tbin_hdr_t h;
+
+	memset(payload, 0, sizeof(payload));
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
+	z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+	if(z == -1) { fprintf(g_err, "%s(): zmq_recv(): %s\n", __func__, strerror(errno)); return -1; }
+	if(tbin_unpack(&h, hbuf, z) != 0) { fprintf(g_err, "%s(): bad reply header\n", __func__); return -1; }
+
+	more = 0;
+	zmq_getsockopt(s, ZMQ_RCVMORE, &more, &moresz);
+	if(more) { z = zmq_recv(s, payload, sizeof(payload)-1, 0); }
+
+	if(h.opcode & TBIN_ERRBIT) {
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", payload);
+		return -1;
+	}
+
+	if((long)h.offset > *acked) { *acked = h.offset; }
+
+	// tpad sends its digest along with the ack for the last chunk
+	if(h.length == TPAD_DIGEST_SIZE) {
+		return compare_digest(gcf, TSTAT_OK, payload, NULL);
+	}
+
+	return 0;
+}
+
+// Wait for the reply to one of our chunks
+// Returns 1 once the remote hash matches ours, 0 for any other ack and -1 on error
+static int recv_ack(void *s, gcfile_t *gcf, long *acked)
 {
 	int z, r=0;
+	long offset;
 	char empty[4];
 	char status[16];
 	char completion[256];
 	char rmt_hash[TPAD_HASH_SIZE+1];
-	char *hashptr, *stats;
 
-	memset(empty,		0, sizeof(empty));
 	memset(status,		0, sizeof(status));
 	memset(completion,	0, sizeof(completion));
+	memset(rmt_hash,	0, sizeof(rmt_hash));
 
-	z = zmq_send(s, TCMD_PUT,	strlen(TCMD_PUT)+1,	ZMQ_SNDMORE);
-	z = zmq_send(s, g_uuid,		strlen(g_uuid)+1,	ZMQ_SNDMORE);
-	z = zmq_send(s, buf,		bytes,				ZMQ_SNDMORE);
-	z = zmq_send(s, empty,		1,	0);
+	z = zmq_recv(s, empty,		sizeof(empty),			0);
+	z = zmq_recv(s, status,		sizeof(status)-1,		0);
+	z = zmq_recv(s, completion,	sizeof(completion)-1,	0);
+	z = zmq_recv(s, rmt_hash,	sizeof(rmt_hash)-1,		0);
+	if(z == -1) { fprintf(g_err, "%s(): zmq_recv(): %s\n", __func__, strerror(errno)); return -1; }
+
+	if(strcmp(status, TSTAT_ERR) == 0) {
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", completion);
+		return -1;
+	}
 
-	z = zmq_recv(s, status,		sizeof(status),		0);
-	z = zmq_recv(s, completion,	sizeof(completion),	0);
-	z = zmq_recv(s, rmt_hash,	sizeof(rmt_hash),	0);
+	offset = atol(completion);
+	if(offset > *acked) { *acked = offset; }
 
 	// If the remote end sent us a hash
 	// Check for completion
 	if(strlen(rmt_hash) > 0) {
-		hashptr = gcfile_get_hash(gcf, TPAD_HASH_ALG);
-		stats = get_stats(gcf);
-		if(strcmp(hashptr, rmt_hash) == 0) {
-			if(g_verbosity >= 1) { printf("%s %s\n", status, stats); }
-		} else {
-			if(g_verbosity >= 1) { printf("%s\n", "HASH ERROR"); r=1; }
-		}
-		free(stats);
-		free(hashptr);
+		r = compare_digest(gcf, status, NULL, rmt_hash);
 	}
 
 /*
 #ifdef DEBUG
-	printf("%s/%s/%s/%s\n", status, g_uuid, completion, rmt_hash);
+	fprintf(g_out, "%s/%s/%s/%s\n", status, g_uuid, completion, rmt_hash);
 #endif
 */
 
 	return r;
 }
 
+// Ask tpad for the binary framing, returns the version we will use (0 for ASCII)
+// and sets *maxchunk to the largest chunk it takes
+static int say_hello(void *s, long *maxchunk)
+{
+	int z;
+	char vers[16];
+	char empty[4];
+	char status[16];
+	char resp[64];
+
+	memset(status,	0, sizeof(status));
+	memset(resp,	0, sizeof(resp));
+
+	snprintf(vers, sizeof(vers), "%d", TBIN_PROTO);
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
+	z = zmq_send(s, TCMD_CMD,	strlen(TCMD_CMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, HELLOCMD,	strlen(HELLOCMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, vers,		strlen(vers)+1,		ZMQ_SNDMORE);
+	z = zmq_send(s, "",			1,					0);
+
+	z = zmq_recv(s, empty,	sizeof(empty),		0);
+	z = zmq_recv(s, status,	sizeof(status)-1,	0);
+	z = zmq_recv(s, resp,	sizeof(resp)-1,		0);
+	z = zmq_recv(s, vers,	sizeof(vers)-1,		0);
+	if(z == -1) { return 0; }
+
+	// An older tpad does not know the command
+	if(strcmp(status, TSTAT_OK) != 0) { return 0; }
+	if((atol(vers) > 0) && (atol(vers) <= MAXCHUNKLIMIT)) { *maxchunk = atol(vers); }
+	return atoi(resp);
+}
+
+// What tpad calls path, free() it when done
+static char* remote_name(char *path)
+{
+	char *tmp, *name;
+
+	if(g_top && (strncmp(path, g_top, g_toplen) == 0)) { return strdup(path + g_toplen); }
+
+	tmp = strdup(path);
+	if(!tmp) { return NULL; }
+	name = strdup(basename(tmp));
+	free(tmp);
+	return name;
+}
+
 static int send_header(void *s, char *path, long size)
 {
 	int z;
-	char *tmp, *filename;
+	char *filename;
 	char filesize[64];
+	char empty[4];
 	char status[16];
 	char msg2[1536];
 	char msg3[256];
@@ -129,78 +366,349 @@ static int send_header(void *s, char *path, long size)
 	memset(msg2,		0, sizeof(msg2));
 	memset(msg3,		0, sizeof(msg3));
 
-	tmp = strdup(path);
-	filename = basename(tmp);
+	filename = remote_name(path);
+	if(!filename) { fprintf(g_err, "%s(): out of memory\n", __func__); return 1; }
 	snprintf(filesize, sizeof(filesize), "%ld", size);
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
 	z = zmq_send(s, TCMD_PUT,	strlen(TCMD_PUT)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, g_uuid,		strlen(g_uuid)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, filename,	strlen(filename)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, filesize,	strlen(filesize)+1,	0);
-	free(tmp);
+	free(filename);
 
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
 	z = zmq_recv(s, status,	sizeof(status),	0);
 	// IF TSTAT_ERR - can we do a FUNC CALL here?
 	z = zmq_recv(s, msg2,	sizeof(msg2),	0);
 	z = zmq_recv(s, msg3,	sizeof(msg3),	0);
 
 	if(strcmp(status, TSTAT_ERR) == 0) {
-		if(g_verbosity >= 1) { printf("ERR\n"); }
-		fprintf(stderr, "%s\n", msg2);
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", msg2);
 		return 1;
 	}
 
 	z = sizeof(g_uuid);	//65
 	memcpy(g_uuid, msg2, z-1);
 	g_uuid[z-1] = 0;
+	g_id = strtoull(g_uuid, NULL, 10);
 	//snprintf(g_uuid, sizeof(g_uuid), "%s", msg2);
 
 /*
 #ifdef DEBUG
-	printf("%s/%s/%s ", status, uuid, completion);
+	fprintf(g_out, "%s/%s/%s ", status, uuid, completion);
 #endif
 */
 
 	return 0;
 }
 
+// Send all len bytes of a file with its name and digest in one message,
+// tpad writes it and checks the digest before it answers.
+// Returns 1 once tpad has it and -1 on error
+static int send_small(void *s, char *path, gcfile_t *gcf, unsigned char *buf, long len)
+{
+	int z;
+	char *filename, *stats;
+	char empty[4];
+	char errmsg[1536];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+	tbin_hdr_t h;
+
+	if(gcfile_read(gcf, buf, len) != len) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(gcf)); return -1; }
+
+	filename = remote_name(path);
+	if(!filename) { fprintf(g_err, "%s(): out of memory\n", __func__); return -1; }
+	tbin_pack(&h, TBIN_FILE, 0, len, len);
+	z = zmq_send(s, "",			0,					ZMQ_SNDMORE);
+	z = zmq_send(s, &h,			TBIN_HDRSIZE,		ZMQ_SNDMORE);
+	z = zmq_send(s, filename,	strlen(filename),	ZMQ_SNDMORE);
+	z = zmq_send(s, buf,		len,				ZMQ_SNDMORE);
+	z = zmq_send(s, gcfile_get_digest(gcf, TPAD_HASH_ALG), TPAD_DIGEST_SIZE, 0);
+	free(filename);
+
+	memset(errmsg, 0, sizeof(errmsg));
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
+	z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+	if((z == -1) || (tbin_unpack(&h, hbuf, z) != 0)) { fprintf(g_err, "%s(): bad reply\n", __func__); return -1; }
+	if(h.opcode & TBIN_ERRBIT) {
+		z = zmq_recv(s, errmsg, sizeof(errmsg)-1, 0);
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		fprintf(g_err, "%s\n", errmsg);
+		return -1;
+	}
+
+	stats = get_stats(gcf, 0);
+	if(g_verbosity >= 1) { fprintf(g_out, "%s %s\n", TSTAT_OK, stats); }
+	free(stats);
+	return 1;
+}
+
+// Keep about WINDOW_AUTOBYTES or g_window chunks in flight,
+// but no more than tpad will hold for us ahead of a gap
+static long window_for(long BS)
+{
+	long w = g_window;
+
+	if(w == 0) {
+		w = WINDOW_AUTOBYTES / BS;
+		if(w < 2) { w = 2; }
+	}
+	if(w > MAXWINDOW) { w = MAXWINDOW; }
+	if((w * BS) > PENDING_MAXBYTES) { w = PENDING_MAXBYTES / BS; }
+	if(w < 1) { w = 1; }
+	return w;
+}
+
+// Send [start, end) of gcf, read up to start already, to the transfer in g_id/g_uuid.
+// Returns 1 once tpad has all of it and its digest matches ours, -1 if not
+static int send_range(void *s, gcfile_t *gcf, unsigned char *buf, long start, long end)
+{
+	int z, done=0, failed=0, inflight=0;
+	long sent=start, acked=start, last, BS;
+	size_t bytes;
+
+	// Keep at most a window of chunks past what tpad has written, then wait for an ack.
+	// tpad acks a chunk it had to hold without moving its offset,
+	// so the window is measured from that offset and not by the replies we are owed.
+	// tpad places chunks by offset, so the chunk size can change from one chunk to the next.
+	// After an error stop sending, but collect every reply still owed to us
+	// so they do not get mistaken for replies about the next file.
+	ctune_epoch(&g_tune);
+	while(((sent < end) && !failed) || (inflight > 0)) {
+		BS = g_tune.value;
+		if((sent < end) && !failed && ((inflight == 0) || ((sent - acked) < (window_for(BS) * BS)))) {
+			bytes = gcfile_read(gcf, buf, ((end - sent) < BS) ? (end - sent) : BS);
+			if(bytes == 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(gcf)); failed = 1; continue; }
+			send_chunk(s, buf, bytes, sent);
+			sent += bytes;
+			inflight++;
+			continue;
+		}
+
+		last = acked;
+		if(g_binary) {
+			z = recv_ack_bin(s, gcf, &acked);
+		} else {
+			z = recv_ack(s, gcf, &acked);
+		}
+		inflight--;
+		if(z < 0) { failed = 1; }
+		if(z > 0) { done = 1; }
+		if((z >= 0) && ctune_chunk(&g_tune, acked - last) && (g_verbosity >= 2)) {
+			fprintf(g_err, "chunk size: %ld\n", g_tune.value);
+		}
+	}
+
+#ifdef DEBUG
+	fprintf(g_out, "%s(): %s sent %ld acked %ld\n", __func__, GCFILE_GETPATH(gcf), sent, acked);
+#endif
+
+	return (done && !failed) ? 1 : -1;
+}
+
+// Send a binary request and wait for its reply header in h.
+// Returns 0 if tpad took it, -1 with the reason on g_err if not
+static int bin_request(void *s, tbin_hdr_t *h, void *payload, size_t len)
+{
+	int z, more;
+	size_t moresz = sizeof(more);
+	char empty[4];
+	char errmsg[1536];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+
+	z = zmq_send(s, "",		0,				ZMQ_SNDMORE);
+	z = zmq_send(s, h,		TBIN_HDRSIZE,	payload ? ZMQ_SNDMORE : 0);
+	if(payload) { z = zmq_send(s, payload, len, 0); }
+
+	memset(errmsg, 0, sizeof(errmsg));
+	z = zmq_recv(s, empty,	sizeof(empty),	0);
+	z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+	if((z == -1) || (tbin_unpack(h, hbuf, z) != 0)) { fprintf(g_err, "%s(): bad reply\n", __func__); return -1; }
+
+	more = 0;
+	zmq_getsockopt(s, ZMQ_RCVMORE, &more, &moresz);
+	if(more) { z = zmq_recv(s, errmsg, sizeof(errmsg)-1, 0); }
+
+	if(h->opcode & TBIN_ERRBIT) {
+		fprintf(g_err, "%s\n", errmsg);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Send one part of a striped file over its own socket, see send_striped()
+static void* stripe_worker(void *arg)
+{
+	stripe_t *p = arg;
+	int z;
+	long start, end;
+	void *s;
+	unsigned char *buf;
+	gcfile_t gcf;
+	tbin_hdr_t h;
+
+	g_out = open_memstream(&p->out, &p->outlen);
+	g_err = open_memstream(&p->err, &p->errlen);
+	if(!g_out) { g_out = stdout; }
+	if(!g_err) { g_err = stderr; }
+
+	s = zmq_socket(g_zContext, ZMQ_DEALER);
+	zmq_connect(s, g_zmqaddr);
+	ctune_init(&g_tune, g_BS, g_maxchunk);
+	buf = malloc(g_tune.max);
+	GCFILE_INIT(&gcf);
+
+	stripe_range(p->size, p->nparts, p->part, &start, &end);
+	tbin_pack(&h, TBIN_PART, p->file, p->part, 0);
+	if(!buf) {
+		fprintf(g_err, "%s(): malloc(%ld) failed!\n", __func__, g_tune.max);
+	} else if(bin_request(s, &h, NULL, 0) == 0) {
+		g_id = h.id;
+		snprintf(g_uuid, sizeof(g_uuid), "%lu", (unsigned long)g_id);
+
+		z = gcfile_open(&gcf, p->path, "r");
+		if(z == 0) { z = gcfile_enable(&gcf, TPAD_HASH_ALG); }
+		if(z == 0) { z = gcfile_seek(&gcf, start); }
+		if(z != 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf)); }
+		// tpad's reply to the last chunk carries the digest of the part
+		if((z == 0) && (send_range(s, &gcf, buf, start, end) > 0)) {
+			memcpy(p->digest, gcfile_get_digest(&gcf, TPAD_HASH_ALG), TPAD_DIGEST_SIZE);
+			p->ok = 1;
+		}
+		gcfile_close(&gcf);
+	}
+
+	free(buf);
+	zmq_close(s);
+	if(g_out != stdout) { fclose(g_out); }
+	if(g_err != stderr) { fclose(g_err); }
+	return NULL;
+}
+
+// Send a large file as up to g_stripes parts at once, each over its own socket.
+// tpad writes every part into its place in the file and keeps the digest of each,
+// the JOIN checks the digest of those digests and puts the file in the spool
+static void send_striped(void *s, char *path, long len)
+{
+	int i, n, nparts, ok;
+	long usec;
+	char *filename, *stats;
+	unsigned char *digests;
+	unsigned char digest[TPAD_DIGEST_SIZE];
+	stripe_t *parts;
+	pthread_t *thr;
+	tbin_hdr_t h;
+	struct timespec start, now;
+
+	nparts = g_stripes;
+	if(nparts > (len / STRIPE_ALIGN)) { nparts = len / STRIPE_ALIGN; }
+
+	if(g_verbosity >= 1) { fprintf(g_out, "Beaming File: %s ... ", path); }
+
+	filename = remote_name(path);
+	if(!filename) { fprintf(g_err, "%s(): out of memory\n", __func__); return; }
+	tbin_pack(&h, TBIN_STRIPE, 0, len, nparts);
+	n = bin_request(s, &h, filename, strlen(filename));
+	free(filename);
+	if(n != 0) {
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		return;
+	}
+
+	parts = calloc(nparts, sizeof(stripe_t));
+	thr = calloc(nparts, sizeof(pthread_t));
+	digests = malloc(nparts * TPAD_DIGEST_SIZE);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(n=0; parts && thr && digests && (n<nparts); n++) {
+		parts[n].path = path;
+		parts[n].part = n;
+		parts[n].nparts = nparts;
+		parts[n].size = len;
+		parts[n].file = h.id;
+		if(pthread_create(&thr[n], NULL, stripe_worker, &parts[n]) != 0) { break; }
+	}
+
+	// A part that never went out makes the JOIN fail, tpad drops the file then
+	ok = (n == nparts);
+	for(i=0; i<n; i++) {
+		pthread_join(thr[i], NULL);
+		if(parts[i].outlen && (g_verbosity >= 2)) { fprintf(g_out, "part %d: %s", i, parts[i].out); }
+		if(parts[i].errlen) { fprintf(g_err, "part %d: %s", i, parts[i].err); }
+		free(parts[i].out);
+		free(parts[i].err);
+		if(!parts[i].ok) { ok = 0; }
+		else { memcpy(digests + (i * TPAD_DIGEST_SIZE), parts[i].digest, TPAD_DIGEST_SIZE); }
+	}
+
+	if(ok) { gcry_md_hash_buffer(TPAD_HASH_ALG, digest, digests, nparts * TPAD_DIGEST_SIZE); }
+	tbin_pack(&h, TBIN_JOIN, h.id, len, ok ? TPAD_DIGEST_SIZE : 0);
+	if(bin_request(s, &h, ok ? digest : NULL, TPAD_DIGEST_SIZE) != 0) { ok = 0; }
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = ((now.tv_sec - start.tv_sec) * 1000000L) + ((now.tv_nsec - start.tv_nsec) / 1000L);
+
+	if(ok) {
+		stats = rate_stats(len, usec, 0);
+		if(g_verbosity >= 1) { fprintf(g_out, "%s %s <%d stripes>\n", TSTAT_OK, stats, nparts); }
+		free(stats);
+		if(g_delete) { remove(path); }
+	} else if(g_verbosity >= 1) {
+		fprintf(g_out, "ERR\n");
+	}
+
+	free(digests);
+	free(thr);
+	free(parts);
+}
+
 static void send_file(void *s, char *path)
 {
 	int z;
 	long len;
-	size_t bytes;
-	unsigned char buf[g_BS];
+	unsigned char *buf;
 	gcfile_t gcf;
 
 	len = file_size(path, 1);
 	if(len < 0) { return; }
 
+	// Large files go in parts at once, if tpad knows how
+	if((g_binary >= 5) && (g_stripes > 1) && (len >= g_stripemin) && (len >= (2L * STRIPE_ALIGN))) {
+		send_striped(s, path, len);
+		return;
+	}
+
+	buf = malloc(g_tune.max);
+	if(!buf) { fprintf(g_err, "%s(): malloc(%ld) failed!\n", __func__, g_tune.max); return; }
+
 	GCFILE_INIT(&gcf);
 	z = gcfile_open(&gcf, path, "r");
-	if(z != 0) { fprintf(stderr, "%s\n", GCFILE_GETERRMSG(&gcf)); return; }
+	if(z != 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf)); free(buf); return; }
 
 	z = gcfile_enable(&gcf, TPAD_HASH_ALG);
-	if(z != 0) { fprintf(stderr, "%s\n", GCFILE_GETERRMSG(&gcf)); return; }
+	if(z != 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf)); free(buf); return; }
 
-	//if(g_verbosity >= 1) { printf("Beaming File: %s(%ld) ... ", path, len); }
-	if(g_verbosity >= 1) { printf("Beaming File: %s ... ", path); }
-	z = send_header(s, path, len);
-	if(z) { gcfile_close(&gcf); return; }
+	//if(g_verbosity >= 1) { fprintf(g_out, "Beaming File: %s(%ld) ... ", path, len); }
+	if(g_verbosity >= 1) { fprintf(g_out, "Beaming File: %s ... ", path); }
 
-	while(len > 0) {
-		if(len < g_BS) {
-			bytes = gcfile_read(&gcf, buf, len);
-		} else {
-			bytes = gcfile_read(&gcf, buf, g_BS);
-		}
-		if(bytes == 0) { gcfile_close(&gcf); fprintf(stderr, "%s\n", GCFILE_GETERRMSG(&gcf)); return; }
-		z = send_chunk(s, &gcf, buf, bytes);
-		len -= bytes;
+	// Small files are all latency, do them in one round trip
+	if((g_binary >= 3) && (len > 0) && (len <= g_small) && (len <= g_tune.max)) {
+		z = send_small(s, path, &gcf, buf, len);
+		if(g_delete && (z > 0)) { remove(path); }
+		gcfile_close(&gcf);
+		GCFILE_INIT(&gcf);
+		free(buf);
+		return;
 	}
 
-	// HOW DO WE CONVEY SUCCESS FOR DELETEION
-	if(g_delete && (z == 0)) { remove(path); }
+	z = send_header(s, path, len);
+	if(z) { gcfile_close(&gcf); free(buf); return; }
+
+	z = send_range(s, &gcf, buf, 0, len);
+	if(g_delete && (z > 0)) { remove(path); }
 	gcfile_close(&gcf);
 	GCFILE_INIT(&gcf);
+	free(buf);
 }
 
 static int regfilesonly(const dir_t *entry)
@@ -212,9 +720,382 @@ static int regfilesonly(const dir_t *entry)
 	return 0;
 }
 
-static void send_dir(void *socket, char *dir)
+// Print how each file of a batch did and delete the ones tpad has.
+// status is NULL if the whole batch failed
+static void batch_report(gcfile_t *gcf, char **path, int n, unsigned char *status, char *errors)
+{
+	int i;
+	char *stats, *eol;
+
+	for(i=0; i<n; i++) {
+		if(g_verbosity >= 1) { fprintf(g_out, "Beaming File: %s ... ", path[i]); }
+		if(status && (status[i] == 0)) {
+			stats = get_stats(&gcf[i], 0);
+			if(g_verbosity >= 1) { fprintf(g_out, "%s %s\n", TSTAT_OK, stats); }
+			free(stats);
+			if(g_delete) { remove(path[i]); }
+			continue;
+		}
+
+		if(g_verbosity >= 1) { fprintf(g_out, "ERR\n"); }
+		if(!status) { continue; }
+		// One line of errors for each file that failed
+		eol = strchr(errors, '\n');
+		if(eol) { *eol = 0; }
+		fprintf(g_err, "%s\n", errors);
+		if(eol) { errors = eol+1; }
+	}
+}
+
+// The batch has its own copy of every path
+static void batch_clear(batch_t *b)
+{
+	int i;
+
+	for(i=0; i<b->count; i++) { free(b->path[i]); }
+	b->count = 0;
+	b->bytes = 0;
+}
+
+// Send every file in b in one message, tpad answers with how each one went
+static void send_batch(void *s, batch_t *b)
+{
+	int i, n, z, more;
+	size_t moresz = sizeof(more);
+	long total;
+	char *tmp;
+	char empty[4];
+	char errors[BATCH_MAXFILES * 128];
+	unsigned char status[BATCH_MAXFILES];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+	unsigned char *buf;
+	char *path[BATCH_MAXFILES];
+	gcfile_t *gcf;
+	tbin_hdr_t h;
+
+	if(b->count == 1) { send_file(s, b->path[0]); }
+	if(b->count < 2) { batch_clear(b); return; }
+
+	buf = malloc(b->bytes);
+	gcf = calloc(b->count, sizeof(gcfile_t));
+	if(!buf || !gcf) {
+		fprintf(g_err, "%s(): out of memory for %d files\n", __func__, b->count);
+		free(buf);
+		free(gcf);
+		batch_clear(b);
+		return;
+	}
+
+	// Read them all in, a file we can not read is left out
+	n = 0;
+	total = 0;
+	for(i=0; i<b->count; i++) {
+		GCFILE_INIT(&gcf[n]);
+		z = gcfile_open(&gcf[n], b->path[i], "r");
+		if(z != 0) { fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf[n])); continue; }
+		z = gcfile_enable(&gcf[n], TPAD_HASH_ALG);
+		if((z != 0) || (gcfile_read(&gcf[n], buf+total, b->len[i]) != b->len[i])) {
+			fprintf(g_err, "%s\n", GCFILE_GETERRMSG(&gcf[n]));
+			gcfile_close(&gcf[n]);
+			continue;
+		}
+		path[n] = b->path[i];
+		total += b->len[i];
+		n++;
+	}
+
+	if(n > 0) {
+		tbin_pack(&h, TBIN_BATCH, 0, total, n);
+		z = zmq_send(s, "",		0,				ZMQ_SNDMORE);
+		z = zmq_send(s, &h,		TBIN_HDRSIZE,	ZMQ_SNDMORE);
+		total = 0;
+		for(i=0; i<n; i++) {
+			tmp = remote_name(path[i]);
+			if(tmp) { z = zmq_send(s, tmp,	strlen(tmp),	ZMQ_SNDMORE); }
+			else { z = zmq_send(s, "",	0,	ZMQ_SNDMORE); }
+			z = zmq_send(s, buf+total,		gcfile_get_bytecount(&gcf[i]),	ZMQ_SNDMORE);
+			z = zmq_send(s, gcfile_get_digest(&gcf[i], TPAD_HASH_ALG), TPAD_DIGEST_SIZE, (i < n-1) ? ZMQ_SNDMORE : 0);
+			total += gcfile_get_bytecount(&gcf[i]);
+			free(tmp);
+		}
+
+		memset(errors, 0, sizeof(errors));
+		z = zmq_recv(s, empty,	sizeof(empty),	0);
+		z = zmq_recv(s, hbuf,	sizeof(hbuf),	0);
+		if((z == -1) || (tbin_unpack(&h, hbuf, z) != 0)) {
+			fprintf(g_err, "%s(): bad reply\n", __func__);
+			batch_report(gcf, path, n, NULL, NULL);
+		} else if((h.opcode & TBIN_ERRBIT) || (h.length != n)) {
+			z = zmq_recv(s, errors, sizeof(errors)-1, 0);
+			batch_report(gcf, path, n, NULL, NULL);
+			fprintf(g_err, "%s\n", errors);
+		} else {
+			z = zmq_recv(s, status, sizeof(status), 0);
+			if(z != n) { memset(status, 1, sizeof(status)); }
+			more = 0;
+			zmq_getsockopt(s, ZMQ_RCVMORE, &more, &moresz);
+			if(more) { z = zmq_recv(s, errors, sizeof(errors)-1, 0); }
+			batch_report(gcf, path, n, status, errors);
+		}
+	}
+
+	for(i=0; i<n; i++) { gcfile_close(&gcf[i]); }
+	free(gcf);
+	free(buf);
+	batch_clear(b);
+}
+
+// Print what the finished jobs had to say, in the order they were handed out.
+// Call with g_jlock held
+static void jobs_report(void)
+{
+	job_t *j;
+
+	while(g_jreported < g_jtaken) {
+		j = &g_jobq[g_jreported % JOBS_QUEUE];
+		if(!j->done) { break; }
+		if(j->outlen) { fwrite(j->out, 1, j->outlen, stdout); }
+		if(j->errlen) { fwrite(j->err, 1, j->errlen, stderr); }
+		free(j->out);
+		free(j->err);
+		memset(j, 0, sizeof(job_t));
+		g_jreported++;
+		pthread_cond_signal(&g_jroom);
+	}
+}
+
+// Take jobs in order while g_jtune wants this many workers
+static void* job_worker(void *arg)
+{
+	long me = (long)arg;
+	long files, bytes;
+	void *s;
+	job_t *j;
+	batch_t b;
+
+	s = zmq_socket(g_zContext, ZMQ_DEALER);
+	zmq_connect(s, g_zmqaddr);
+	ctune_init(&g_tune, g_BS, g_maxchunk);
+
+	pthread_mutex_lock(&g_jlock);
+	while(1) {
+		while(!g_jstop && ((g_jtaken == g_jsubmitted) || (me >= g_jtune.value))) { pthread_cond_wait(&g_jwork, &g_jlock); }
+		// Only once we are told to go and there is nothing left
+		if(g_jtaken == g_jsubmitted) { break; }
+
+		j = &g_jobq[g_jtaken++ % JOBS_QUEUE];
+		b = j->batch;
+		pthread_mutex_unlock(&g_jlock);
+
+		files = b.count;
+		bytes = b.bytes;
+		g_out = open_memstream(&j->out, &j->outlen);
+		g_err = open_memstream(&j->err, &j->errlen);
+		if(!g_out) { g_out = stdout; }
+		if(!g_err) { g_err = stderr; }
+		send_batch(s, &b);
+		if(g_out != stdout) { fclose(g_out); }
+		if(g_err != stderr) { fclose(g_err); }
+
+		pthread_mutex_lock(&g_jlock);
+		j->done = 1;
+		jobs_report();
+		if(jtune_done(&g_jtune, files, bytes)) {
+			if(g_verbosity >= 2) { fprintf(stderr, "jobs: %ld\n", g_jtune.value); }
+			pthread_cond_broadcast(&g_jwork);
+		}
+	}
+	pthread_mutex_unlock(&g_jlock);
+
+	zmq_close(s);
+	return NULL;
+}
+
+static void jobs_start(void)
+{
+	long i, n;
+
+	jtune_init(&g_jtune, g_jobs, JOBS_MAX);
+	n = g_jtune.fixed ? g_jtune.value : JOBS_MAX;
+	for(i=0; i<n; i++) {
+		if(pthread_create(&g_workers[i], NULL, job_worker, (void *)i) != 0) { break; }
+	}
+	g_nworkers = i;
+
+	// Whatever we got, all of them get to work
+	if(g_nworkers < n) {
+		fprintf(stderr, "pthread_create() failed, %d workers\n", g_nworkers);
+		g_jtune.fixed = 1;
+		g_jtune.value = (g_nworkers > 0) ? g_nworkers : 1;
+	}
+}
+
+// Wait for every job to be sent and reported
+static void jobs_finish(void)
+{
+	int i;
+
+	pthread_mutex_lock(&g_jlock);
+	g_jstop = 1;
+	pthread_cond_broadcast(&g_jwork);
+	pthread_mutex_unlock(&g_jlock);
+
+	for(i=0; i<g_nworkers; i++) { pthread_join(g_workers[i], NULL); }
+	if(g_verbosity >= 2) { fprintf(stderr, "jobs: %ld\n", g_jtune.value); }
+}
+
+// Hand b to the workers, b is empty again afterwards
+static void jobs_submit(batch_t *b)
+{
+	job_t *j;
+
+	if(b->count == 0) { return; }
+
+	pthread_mutex_lock(&g_jlock);
+	while((g_jsubmitted - g_jreported) == JOBS_QUEUE) { pthread_cond_wait(&g_jroom, &g_jlock); }
+	j = &g_jobq[g_jsubmitted++ % JOBS_QUEUE];
+	j->batch = *b;
+	j->done = 0;
+	// Not every worker may take it, wake them all
+	pthread_cond_broadcast(&g_jwork);
+	pthread_mutex_unlock(&g_jlock);
+
+	b->count = 0;
+	b->bytes = 0;
+}
+
+// Wait until every job handed out so far is reported
+static void jobs_drain(void)
+{
+	if(g_jobs == 1) { return; }
+
+	pthread_mutex_lock(&g_jlock);
+	while(g_jreported < g_jsubmitted) { pthread_cond_wait(&g_jroom, &g_jlock); }
+	pthread_mutex_unlock(&g_jlock);
+}
+
+// Send the batch here, or hand it to a worker with --jobs
+static void flush_batch(void *socket, batch_t *b)
+{
+	if(g_jobs != 1) { jobs_submit(b); return; }
+	send_batch(socket, b);
+}
+
+// A writer that still has path open would break our read lease, so we can not get one.
+// Returns 0 if we could not tell (not our file and no CAP_LEASE, or a filesystem without leases)
+static int being_written(char *path)
+{
+	int fd, z;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if(fd == -1) { return 0; }
+
+	z = fcntl(fd, F_SETLEASE, F_RDLCK);
+	if(z == 0) { (void) fcntl(fd, F_SETLEASE, F_UNLCK); }
+	else { z = ((errno == EAGAIN) || (errno == EBUSY)); }
+
+	close(fd);
+	return z;
+}
+
+static int sent_cmp(const void *a, const void *b)
+{
+	return strcmp(((const sent_t *)a)->name, ((const sent_t *)b)->name);
+}
+
+// Remember path as sent the way it is now.
+// A write or a rename over it changes its ctime, that is how sent_unchanged() tells
+static void sent_mark(char *path)
+{
+	size_t len;
+	struct stat st;
+	sent_t *p, **found;
+
+	if(stat(path, &st) != 0) { return; }
+	len = strlen(path);
+	p = calloc(1, sizeof(sent_t) + len + 1);
+	if(!p) { fprintf(stderr, "%s(): calloc() failed!\n", __func__); return; }
+	memcpy(p->name, path, len+1);
+
+	found = tsearch(p, &g_sent, sent_cmp);
+	if(!found) { free(p); return; }
+	if(*found != p) { free(p); p = *found; }
+	p->ctime = st.st_ctim;
+	p->size = (long)st.st_size;
+}
+
+// Has path been sent before, and not touched since?
+static int sent_unchanged(char *path)
+{
+	int z = 0;
+	size_t len;
+	struct stat st;
+	sent_t *key, **found;
+
+	if(!g_sent || (stat(path, &st) != 0)) { return 0; }
+	len = strlen(path);
+	key = malloc(sizeof(sent_t) + len + 1);
+	if(!key) { return 0; }
+	memcpy(key->name, path, len+1);
+
+	found = tfind(key, &g_sent, sent_cmp);
+	if(found) {
+		z = ((*found)->size == (long)st.st_size) &&
+			((*found)->ctime.tv_sec == st.st_ctim.tv_sec) && ((*found)->ctime.tv_nsec == st.st_ctim.tv_nsec);
+	}
+	free(key);
+	return z;
+}
+
+// Small files are saved up in b and sent in batches,
+// anything else flushes the batch and goes on its own
+static void send_one(void *socket, batch_t *b, char *path)
+{
+	long len, budget;
+	char *copy;
+
+	// Its IN_CLOSE_WRITE will bring it back
+	if(g_watch && being_written(path)) {
+		if(g_verbosity >= 2) { fprintf(g_out, "Still being written: %s\n", path); }
+		return;
+	}
+	if(g_watch && !g_delete) { sent_mark(path); }
+
+	budget = (BATCH_MAXBYTES < g_tune.max) ? BATCH_MAXBYTES : g_tune.max;
+	len = file_size(path, 0);
+	if((g_binary >= 4) && (g_batch > 1) && (len > 0) && (len <= g_small) && (len <= budget)) {
+		if((b->count == g_batch) || ((b->bytes + len) > budget)) { flush_batch(socket, b); }
+		copy = strdup(path);
+		if(!copy) { send_file(socket, path); return; }
+		b->path[b->count] = copy;
+		b->len[b->count] = len;
+		b->count++;
+		b->bytes += len;
+		return;
+	}
+
+	flush_batch(socket, b);
+
+	// A worker sends it as a batch of one
+	if(g_jobs != 1) {
+		copy = strdup(path);
+		if(!copy) { send_file(socket, path); return; }
+		b->path[0] = copy;
+		b->len[0] = len;
+		b->count = 1;
+		b->bytes = (len > 0) ? len : 0;
+		jobs_submit(b);
+		return;
+	}
+
+	send_file(socket, path);
+}
+
+// With changed set, a file --watch --keep sent before and nobody touched since is left out
+static void send_dir(void *socket, char *dir, int changed)
 {
 	int i, z, entries;
+	batch_t batch;
 	dir_t **farray = NULL;	// our array of directory entries
 
 	z = chdir(dir);
@@ -224,10 +1105,12 @@ static void send_dir(void *socket, char *dir)
 	// then the alphasort function to sort, and put the result in g_mod_dirent
 	entries = scandir(".", &farray, regfilesonly, alphasort);
 
-	// Do something with each file
+	memset(&batch, 0, sizeof(batch));
 	for (i=0; i<entries; i++) {
-		send_file(socket, farray[i]->d_name);
+		if(changed && sent_unchanged(farray[i]->d_name)) { continue; }
+		send_one(socket, &batch, farray[i]->d_name);
 	}
+	flush_batch(socket, &batch);
 
 	// Loop to free all dir entries since scandir made malloc calls
 	if(entries > 0) {
@@ -238,23 +1121,238 @@ static void send_dir(void *socket, char *dir)
 	}
 }
 
+// Send every file under dir, keeping their paths from it.
+// A few threads read the dirs while we send what they have found so far
+static void send_tree(void *socket, char *dir)
+{
+	size_t len;
+	char *name, *path;
+	walk_t *w;
+	batch_t batch;
+
+	len = strlen(dir);
+	g_top = malloc(len + 2);
+	if(!g_top) { fprintf(stderr, "%s(): malloc() failed!\n", __func__); return; }
+	snprintf(g_top, len + 2, "%s%s", dir, ((len > 0) && (dir[len-1] == '/')) ? "" : "/");
+	g_toplen = strlen(g_top);
+
+	w = walk_start(dir, g_walkers);
+	if(!w) { free(g_top); g_top = NULL; return; }
+
+	memset(&batch, 0, sizeof(batch));
+	while((name = walk_next(w))) {
+		path = malloc(g_toplen + strlen(name) + 1);
+		if(path) {
+			sprintf(path, "%s%s", g_top, name);
+			send_one(socket, &batch, path);
+			free(path);
+		}
+		free(name);
+	}
+	flush_batch(socket, &batch);
+	// The workers name their files from g_top
+	jobs_drain();
+
+	walk_stop(w);
+	free(g_top);
+	g_top = NULL;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((long long)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+static int pend_cmp(const void *a, const void *b)
+{
+	return strcmp(((const pend_t *)a)->name, ((const pend_t *)b)->name);
+}
+
+static void pend_unlink(pend_t **head, pend_t **tail, pend_t *p)
+{
+	if(p->prev) { p->prev->next = p->next; } else { *head = p->next; }
+	if(p->next) { p->next->prev = p->prev; } else { *tail = p->prev; }
+	p->prev = p->next = NULL;
+}
+
+// (Re)start the settle delay of name, a file heard from again goes to the back of the line
+static void pend_add(void **tree, pend_t **head, pend_t **tail, char *name)
+{
+	size_t len;
+	pend_t *p, **found;
+
+	len = strlen(name);
+	p = calloc(1, sizeof(pend_t) + len + 1);
+	if(!p) { fprintf(stderr, "%s(): calloc() failed!\n", __func__); return; }
+	memcpy(p->name, name, len+1);
+
+	found = tsearch(p, tree, pend_cmp);
+	if(!found) { free(p); return; }
+	if(*found != p) {
+		free(p);
+		p = *found;
+		pend_unlink(head, tail, p);
+	}
+
+	p->due = now_ms() + g_settle;
+	p->prev = *tail;
+	if(*tail) { (*tail)->next = p; } else { *head = p; }
+	*tail = p;
+}
+
+/*
+	Send what is in dir, then keep sending what shows up in it until we get a signal.
+	A file is only sent once it has been closed after writing (or moved in) and left alone for g_settle ms,
+	and never while someone still has it open for writing.
+	The watch goes up before the first pass, so nothing that is finished during it gets missed.
+*/
+static void watch_dir(void *socket, char *dir, sigset_t *mask)
+{
+	int z, ifd, sfd, rescan = 0;
+	long long wait;
+	ssize_t len;
+	char *p;
+	void *tree = NULL;
+	pend_t *head = NULL, *tail = NULL, *due, *last, *next;
+	batch_t batch;
+	struct inotify_event *ev;
+	struct signalfd_siginfo si;
+	struct pollfd pfd[2];
+	char buf[65536] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(ifd == -1) { fprintf(stderr, "inotify_init1() failed: %s\n", strerror(errno)); return; }
+	if(inotify_add_watch(ifd, dir, WATCH_EVENTS | IN_ONLYDIR) == -1) {
+		fprintf(stderr, "inotify_add_watch(%s) failed: %s\n", dir, strerror(errno));
+		close(ifd);
+		return;
+	}
+
+	sfd = signalfd(-1, mask, SFD_CLOEXEC);
+	if(sfd == -1) { fprintf(stderr, "signalfd() failed: %s\n", strerror(errno)); close(ifd); return; }
+
+	send_dir(socket, dir, 0);
+
+	pfd[0].fd = sfd;	pfd[0].events = POLLIN;
+	pfd[1].fd = ifd;	pfd[1].events = POLLIN;
+	while(1) {
+		wait = -1;
+		if(head) {
+			wait = head->due - now_ms();
+			if(wait < 0) { wait = 0; }
+		}
+
+		z = poll(pfd, 2, (int)wait);
+		if(z == -1) {
+			if(errno == EINTR) { continue; }
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+			break;
+		}
+
+		// HUP, INT, TERM and QUIT all mean the same thing, but only between files
+		if((pfd[0].revents & POLLIN) && (read(sfd, &si, sizeof(si)) == sizeof(si))) { break; }
+
+		if(pfd[1].revents & POLLIN) {
+			while((len = read(ifd, buf, sizeof(buf))) > 0) {
+				for(p=buf; p<(buf+len); p+=sizeof(struct inotify_event)+ev->len) {
+					ev = (struct inotify_event *)p;
+					if(ev->mask & IN_Q_OVERFLOW) { rescan = 1; continue; }
+					if((ev->len > 0) && !(ev->mask & IN_ISDIR)) { pend_add(&tree, &head, &tail, ev->name); }
+				}
+			}
+		}
+
+		// We missed some, the backlog pass finds them again.
+		// Whatever is left in the dir was not sent yet, unless it was kept on purpose
+		if(rescan) {
+			fprintf(stderr, "inotify queue overflowed, rescanning %s\n", dir);
+			send_dir(socket, ".", 1);
+			rescan = 0;
+		}
+
+		// Take everything that is due off the list first
+		due = last = NULL;
+		while(head && (head->due <= now_ms())) {
+			next = head;
+			pend_unlink(&head, &tail, next);
+			(void) tdelete(next, &tree, pend_cmp);
+			if(last) { last->next = next; } else { due = next; }
+			last = next;
+		}
+		if(!due) { continue; }
+
+		memset(&batch, 0, sizeof(batch));
+		// A rescan may have sent it already, as it is now
+		for(next=due; next; next=next->next) {
+			if((is_regfile(next->name, 0) == 1) && !sent_unchanged(next->name)) { send_one(socket, &batch, next->name); }
+		}
+		flush_batch(socket, &batch);
+
+		while(due) {
+			next = due->next;
+			free(due);
+			due = next;
+		}
+	}
+
+	while(head) {
+		next = head->next;
+		(void) tdelete(head, &tree, pend_cmp);
+		free(head);
+		head = next;
+	}
+	tdestroy(g_sent, free);
+	g_sent = NULL;
+	close(sfd);
+	close(ifd);
+}
+
 int main(int argc, char *argv[])
 {
-	void *zContext;
 	void *zReqSock;
+	sigset_t mask;
 
+	g_out = stdout;
+	g_err = stderr;
 	tpad_gcinit(TPAD_GCRYPT_MINVERS);
 	parse_args(argc, argv);
 
-	zContext = zmq_ctx_new();
-	zReqSock = zmq_socket(zContext, ZMQ_REQ);
+	// --watch only stops between files, block them before zmq starts its threads so they inherit it
+	sigemptyset(&mask);
+	if(g_watch) {
+		sigaddset(&mask, SIGHUP);
+		sigaddset(&mask, SIGINT);
+		sigaddset(&mask, SIGTERM);
+		sigaddset(&mask, SIGQUIT);
+		(void) sigprocmask(SIG_BLOCK, &mask, NULL);
+	}
+
+	g_zContext = zmq_ctx_new();
+	zReqSock = zmq_socket(g_zContext, ZMQ_DEALER);
 	zmq_connect(zReqSock, g_zmqaddr);
 
+	// Workers take the answer as it is, they do not say hello
+	if(!g_ascii) { g_binary = say_hello(zReqSock, &g_maxchunk); }
+	if(g_BS > g_maxchunk) {
+		fprintf(stderr, "TPAD takes chunks of up to %ld bytes, using that for --BS\n", g_maxchunk);
+		g_BS = g_maxchunk;
+	}
+	ctune_init(&g_tune, g_BS, g_maxchunk);
+
+	if(g_jobs != 1) { jobs_start(); }
 	if(g_file) { send_file(zReqSock, g_file); }
-	if(g_inputdir) { send_dir(zReqSock, g_inputdir); }
+	if(g_inputdir) {
+		if(g_watch) { watch_dir(zReqSock, g_inputdir, &mask); }
+		else if(g_recursive) { send_tree(zReqSock, g_inputdir); }
+		else { send_dir(zReqSock, g_inputdir, 0); }
+	}
+	if(g_jobs != 1) { jobs_finish(); }
 
 	zmq_close(zReqSock);
-	zmq_ctx_destroy(zContext);
+	zmq_ctx_destroy(g_zContext);
 
 	if(g_file) free(g_file);
 	if(g_inputdir) free(g_inputdir);
@@ -268,7 +1366,18 @@ struct options opts[] =
 	{ 3, "dir",		"Beam all files in this dir to the TPAD",	"d",  1 },
 	{ 4, "quiet",	"Be less verbose",							"q",  0 },
 	{ 5, "keep",	"Do not delete files after transmission",	NULL, 0 },
-	{ 9, "BS",		"Set the chunk transfer size",				NULL, 1 },
+	{ 6, "recursive",	"Beam the dirs under --dir too, keeping their paths",	"r", 0 },
+	{ 9, "BS",		"Set the chunk transfer size (0 = tune it)",	NULL, 1 },
+	{ 10, "window",	"Chunks in flight (0 picks one from BS)",	NULL, 1 },
+	{ 11, "ascii",	"Do not ask for the binary framing",		NULL, 0 },
+	{ 12, "small",	"Send files up to this size in one message (0 = never)",	NULL, 1 },
+	{ 13, "batch",	"Send up to this many small files together (0 = never)",	NULL, 1 },
+	{ 14, "watch",	"Keep beaming files as they show up in the dir",	NULL, 0 },
+	{ 15, "settle",	"--watch waits this many ms after a file is written",	NULL, 1 },
+	{ 16, "walkers",	"Threads reading dirs for --recursive",	NULL, 1 },
+	{ 17, "jobs",	"Files sent at once, each on its own socket (0 = tune it)",	NULL, 1 },
+	{ 18, "stripes",	"Send a large file in this many parts at once",	NULL, 1 },
+	{ 19, "stripe-min",	"--stripes only splits files of at least this size",	NULL, 1 },
 	{ 0, NULL,		NULL,										NULL, 0 }
 };
 
@@ -303,9 +1412,42 @@ static void parse_args(int argc, char **argv)
 			case 5:
 				g_delete = 0;
 				break;
+			case 6:
+				g_recursive = 1;
+				break;
 			case 9:
 				g_BS = atol(args);
 				break;
+			case 10:
+				g_window = atol(args);
+				break;
+			case 11:
+				g_ascii = 1;
+				break;
+			case 12:
+				g_small = atol(args);
+				break;
+			case 13:
+				g_batch = atoi(args);
+				break;
+			case 14:
+				g_watch = 1;
+				break;
+			case 15:
+				g_settle = atol(args);
+				break;
+			case 16:
+				g_walkers = atoi(args);
+				break;
+			case 17:
+				g_jobs = atoi(args);
+				break;
+			case 18:
+				g_stripes = atoi(args);
+				break;
+			case 19:
+				g_stripemin = atol(args);
+				break;
 			default:
 				fprintf(stderr, "Unexpected getopts Error! (%d)\n", c);
 				break;
@@ -320,6 +1462,56 @@ static void parse_args(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if((g_BS < 0) || (g_BS > MAXCHUNKLIMIT)) {
+		fprintf(stderr, "--BS must be between 0 and %d!\n", MAXCHUNKLIMIT);
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_window < 0) || (g_window > MAXWINDOW)) {
+		fprintf(stderr, "--window must be between 0 and %d!\n", MAXWINDOW);
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_batch < 0) || (g_batch > BATCH_MAXFILES)) {
+		fprintf(stderr, "--batch must be between 0 and %d!\n", BATCH_MAXFILES);
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_watch && !g_inputdir) {
+		fprintf(stderr, "I need a dir to watch! (Fix with -d)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_watch && g_recursive) {
+		fprintf(stderr, "--watch only looks at the dir itself, it does not go with --recursive!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_walkers < 1) || (g_walkers > 64)) {
+		fprintf(stderr, "--walkers must be between 1 and 64!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_jobs < 0) || (g_jobs > JOBS_MAX)) {
+		fprintf(stderr, "--jobs must be between 0 and %d!\n", JOBS_MAX);
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_stripes < 1) || (g_stripes > STRIPE_MAXPARTS)) {
+		fprintf(stderr, "--stripes must be between 1 and %d!\n", STRIPE_MAXPARTS);
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_stripemin < (2L * STRIPE_ALIGN)) {
+		fprintf(stderr, "--stripe-min must be at least %d!\n", 2 * STRIPE_ALIGN);
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_settle < 0) || (g_settle > 3600000)) {
+		fprintf(stderr, "--settle must be between 0 and 3600000!\n");
+		exit(EXIT_FAILURE);
+	}
+
 	/*if(!g_inputdir) {
 		fprintf(stderr, "I need a dir to save files to! (Fix with -d)\n");
 		exit(EXIT_FAILURE);
@@ -0,0 +1,59 @@
+#!/bin/bash
+
+# Wire bytes per chunk besides the data, ASCII against binary framing.
+# beam sends a SIZE byte file in BS byte chunks through wirecount.exe to a tpad,
+# absorb pulls it back block by block (XFR) and streamed (STREAM).
+# Overhead up is what the client sent per chunk, down what tpad sent back, the file's own bytes taken out.
+
+SIZE=${SIZE:-10485760}
+BS=${BS:-1000}
+PORT=${PORT:-18384}
+RELAY=$((PORT+1))
+WORK=`mktemp -d`
+mkdir ${WORK}/src ${WORK}/pad ${WORK}/dst
+head -c ${SIZE} /dev/urandom > ${WORK}/src/chunkcost.bin
+CHUNKS=$(( (SIZE + BS - 1) / BS ))
+
+../tpad.exe -Z tcp://127.0.0.1:${PORT} -d ${WORK}/pad > ${WORK}/tpad.log 2>&1 &
+TPAD=$!
+./wirecount.exe ${RELAY} ${PORT} ${WORK}/count &
+COUNT=$!
+sleep 0.5
+
+# wirecount.exe keeps a running total, so look at it before and after.
+# $1 name, $2 1 if the data went up, rest is the command line
+measure()
+{
+  local NAME=$1 UP=$2 U0 D0 U D
+  shift 2
+  read U0 D0 < ${WORK}/count
+  "$@" > ${WORK}/client.log 2>&1 || { echo "${NAME}: failed"; cat ${WORK}/client.log; return; }
+  sleep 0.5
+  read U D < ${WORK}/count
+  U=$((U - U0))
+  D=$((D - D0))
+  if [ ${UP} -eq 1 ]; then U=$((U - SIZE)); else D=$((D - SIZE)); fi
+  awk -v n="${NAME}" -v u=${U} -v d=${D} -v c=${CHUNKS} \
+    'BEGIN { printf("%-14s up %6.1f  down %6.1f  total %6.1f bytes per chunk\n", n, u/c, d/c, (u+d)/c) }'
+  if [ ${UP} -eq 0 ]; then
+    cmp -s ${WORK}/src/chunkcost.bin ${WORK}/dst/chunkcost.bin || echo "${NAME}: absorbed file differs"
+    rm -f ${WORK}/dst/chunkcost.bin
+  fi
+}
+
+ADDR=tcp://127.0.0.1:${RELAY}
+BEAM="../beam.exe -Z ${ADDR} -d ${WORK}/src --keep --BS ${BS} --small 0"
+ABSORB="../absorb.exe -Z ${ADDR} -d ${WORK}/dst --BS ${BS}"
+echo "0 0" > ${WORK}/count
+echo "${SIZE} bytes in ${CHUNKS} chunks of ${BS}"
+measure "PUT ascii" 1 ${BEAM} --ascii
+measure "XFR ascii" 0 ${ABSORB} --pull --ascii
+measure "PUT binary" 1 ${BEAM}
+measure "XFR binary" 0 ${ABSORB} --pull
+${BEAM} > /dev/null 2>&1
+measure "STREAM binary" 0 ${ABSORB}
+
+kill ${COUNT}
+kill -INT ${TPAD}
+wait ${TPAD}
+rm -rf ${WORK}
@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Drivers and microbenchmarks for tpad, run ../compile.sh first for the tpad they talk to
+
+set -e
+
+GCCFLAGS=`libgcrypt-config --cflags`
+GCLIBS=`libgcrypt-config --libs`
+
+COMMONDIR="../../common"
+CFLAGS="-Wall -I.. -I${COMMONDIR} -DUSE_POSIX_BASENAME ${GCCFLAGS} -O2"
+
+rm -f *.exe
+
+gcc ${CFLAGS} xferfind.c ../xfer.c ${COMMONDIR}/rnum.c -lzmq -lpthread ${GCLIBS} -o xferfind.exe
+gcc ${CFLAGS} putflood.c -lzmq -o putflood.exe
+gcc ${CFLAGS} wirecount.c -lpthread -o wirecount.exe
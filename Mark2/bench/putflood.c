@@ -0,0 +1,207 @@
+/*
+	xfer is an easy to use interface to libgcrypt with FILE operations
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+	putflood: opens count PUTs (10000 by default) against one tpad and holds all of them open at once,
+	then finishes every one with a single binary PUT chunk and checks that tpad let go of them all.
+	It fails if any open is refused, so the old 64 transfer ceiling can not creep back in.
+	The files land in tpad's spool as putflood.<n>, remove them afterwards.
+
+	usage: putflood.exe tcp://127.0.0.1:8384 [count]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <zmq.h>
+
+#include "transporter.h"
+#include "tbin.h"
+
+#define FLOOD_DEFAULT (10000)
+#define FLOOD_FILESIZE (1024)
+// Requests in flight, ROUTER drops replies once the pipe back to us is full
+#define FLOOD_WINDOW (256)
+
+static void *g_s;
+static unsigned char g_data[FLOOD_FILESIZE];
+
+static long usec_since(struct timespec *a)
+{
+	struct timespec b;
+
+	clock_gettime(CLOCK_MONOTONIC, &b);
+	return ((b.tv_sec - a->tv_sec) * 1000000L) + ((b.tv_nsec - a->tv_nsec) / 1000L);
+}
+
+static int recv_str(char *buf, size_t len)
+{
+	int z;
+
+	z = zmq_recv(g_s, buf, len-1, 0);
+	if(z < 0) { return z; }
+	if(z > (int)len-1) { z = len-1; }
+	buf[z] = 0;
+	return z;
+}
+
+static int more(void)
+{
+	int m = 0;
+	size_t ms = sizeof(m);
+
+	zmq_getsockopt(g_s, ZMQ_RCVMORE, &m, &ms);
+	return m;
+}
+
+static void skip_rest(void)
+{
+	char junk[256];
+
+	while(more()) { (void) zmq_recv(g_s, junk, sizeof(junk), 0); }
+}
+
+static void send_open(long i)
+{
+	char name[64], size[24];
+
+	snprintf(name, sizeof(name), "putflood.%ld", i);
+	snprintf(size, sizeof(size), "%d", FLOOD_FILESIZE);
+	zmq_send(g_s, "",		0,					ZMQ_SNDMORE);
+	zmq_send(g_s, TCMD_PUT,	strlen(TCMD_PUT)+1,	ZMQ_SNDMORE);
+	zmq_send(g_s, "",		1,					ZMQ_SNDMORE);
+	zmq_send(g_s, name,		strlen(name)+1,		ZMQ_SNDMORE);
+	zmq_send(g_s, size,		strlen(size)+1,		0);
+}
+
+// Returns the id of the opened transfer, 0 if tpad refused it
+static uint64_t recv_open(void)
+{
+	char empty[4], status[16], msg2[1536];
+
+	(void) zmq_recv(g_s, empty, sizeof(empty), 0);
+	recv_str(status, sizeof(status));
+	recv_str(msg2, sizeof(msg2));
+	skip_rest();
+	if(strcmp(status, TSTAT_OK) != 0) {
+		fprintf(stderr, "PUT refused: %s\n", msg2);
+		return 0;
+	}
+	return strtoull(msg2, NULL, 10);
+}
+
+static void send_chunk(uint64_t id)
+{
+	tbin_hdr_t h;
+
+	tbin_pack(&h, TBIN_PUT, id, 0, FLOOD_FILESIZE);
+	zmq_send(g_s, "",		0,				ZMQ_SNDMORE);
+	zmq_send(g_s, &h,		TBIN_HDRSIZE,	ZMQ_SNDMORE);
+	zmq_send(g_s, g_data,	FLOOD_FILESIZE,	0);
+}
+
+// Returns 1 once tpad answered with the file's digest (length > 0), its transfer is over
+static int recv_chunk(void)
+{
+	int z;
+	char empty[4], errmsg[256];
+	unsigned char hbuf[TBIN_HDRSIZE+1];
+	tbin_hdr_t h;
+
+	(void) zmq_recv(g_s, empty, sizeof(empty), 0);
+	z = zmq_recv(g_s, hbuf, sizeof(hbuf), 0);
+	if((z < 0) || tbin_unpack(&h, hbuf, z)) { skip_rest(); return 0; }
+	if(h.opcode & TBIN_ERRBIT) {
+		errmsg[0] = 0;
+		if(more()) { recv_str(errmsg, sizeof(errmsg)); }
+		skip_rest();
+		fprintf(stderr, "PUT chunk failed: %s\n", errmsg);
+		return 0;
+	}
+	skip_rest();
+	return (h.length > 0);
+}
+
+static void print_stats(char *when)
+{
+	char empty[4], status[16], resp[256];
+
+	zmq_send(g_s, "",			0,					ZMQ_SNDMORE);
+	zmq_send(g_s, TCMD_CMD,		strlen(TCMD_CMD)+1,	ZMQ_SNDMORE);
+	zmq_send(g_s, STATSCMD,		strlen(STATSCMD)+1,	ZMQ_SNDMORE);
+	zmq_send(g_s, "",			1,					ZMQ_SNDMORE);
+	zmq_send(g_s, "",			1,					0);
+	(void) zmq_recv(g_s, empty, sizeof(empty), 0);
+	recv_str(status, sizeof(status));
+	recv_str(resp, sizeof(resp));
+	skip_rest();
+	printf("%s: %s\n", when, resp);
+}
+
+int main(int argc, char *argv[])
+{
+	long sent, got, count = FLOOD_DEFAULT;
+	long opened = 0, finished = 0;
+	uint64_t *ids;
+	void *ctx;
+	struct timespec start;
+
+	if(argc < 2) { fprintf(stderr, "usage: %s <tpad zmq addr> [count]\n", argv[0]); return 2; }
+	if(argc > 2) { count = atol(argv[2]); }
+	if(count < 1) { fprintf(stderr, "count must be at least 1!\n"); return 2; }
+
+	ids = calloc(count, sizeof(uint64_t));
+	if(!ids) { fprintf(stderr, "calloc(%ld) failed!\n", count); return 1; }
+	memset(g_data, 'p', sizeof(g_data));
+
+	ctx = zmq_ctx_new();
+	g_s = zmq_socket(ctx, ZMQ_DEALER);
+	if(zmq_connect(g_s, argv[1]) != 0) { fprintf(stderr, "zmq_connect(%s) failed!\n", argv[1]); return 1; }
+
+	// DEALER hands the replies back in the order tpad sends them, not the order we asked,
+	// so only the number that made it counts until every transfer is open
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(sent=0, got=0; got<count; got++) {
+		while((sent < count) && ((sent - got) < FLOOD_WINDOW)) { send_open(sent++); }
+		ids[opened] = recv_open();
+		if(ids[opened]) { opened++; }
+	}
+	printf("opened %ld of %ld PUTs in %.3fs\n", opened, count, usec_since(&start) / 1e6);
+	print_stats("all open");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(sent=0, got=0; got<opened; got++) {
+		while((sent < opened) && ((sent - got) < FLOOD_WINDOW)) { send_chunk(ids[sent++]); }
+		finished += recv_chunk();
+	}
+	printf("finished %ld of %ld PUTs in %.3fs\n", finished, opened, usec_since(&start) / 1e6);
+	print_stats("all done");
+
+	free(ids);
+	zmq_close(g_s);
+	zmq_ctx_destroy(ctx);
+
+	if((opened != count) || (finished != count)) {
+		printf("FAIL\n");
+		return 1;
+	}
+	printf("OK\n");
+	return 0;
+}
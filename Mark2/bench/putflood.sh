@@ -0,0 +1,20 @@
+#!/bin/bash
+
+# Start a tpad on a scratch spool, hold COUNT PUTs open against it at once, then clean up.
+# Exits non-zero if tpad refused any of them. TPADARGS are passed on to tpad.
+
+COUNT=${1:-10000}
+PORT=${PORT:-18384}
+SPOOL=`mktemp -d`
+
+../tpad.exe -Z tcp://127.0.0.1:${PORT} -d ${SPOOL} ${TPADARGS} &
+TPAD=$!
+sleep 0.5
+
+./putflood.exe tcp://127.0.0.1:${PORT} ${COUNT}
+RC=$?
+
+kill -INT ${TPAD}
+wait ${TPAD}
+rm -rf ${SPOOL}
+exit ${RC}
@@ -0,0 +1,153 @@
+/*
+	xfer is an easy to use interface to libgcrypt with FILE operations
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+	wirecount: a TCP relay that counts the bytes going each way.
+	Every connection to 127.0.0.1:<listen port> is passed on to 127.0.0.1:<tpad port>.
+	Whenever one closes, the totals over all connections so far are written to <out> as "up down\n",
+	up being what the clients sent and down what tpad sent back.
+
+	usage: wirecount.exe <listen port> <tpad port> <out>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define RELAY_BUFSIZE (1<<20)
+
+typedef struct {
+	int c;
+	int r;
+} relay_t;
+
+static int g_tpadport;
+static char *g_out;
+static long g_up = 0, g_down = 0;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int connect_tpad(void)
+{
+	int s;
+	struct sockaddr_in sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(g_tpadport);
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	s = socket(AF_INET, SOCK_STREAM, 0);
+	if(s < 0) { return -1; }
+	if(connect(s, (struct sockaddr *)&sa, sizeof(sa)) != 0) { close(s); return -1; }
+	return s;
+}
+
+// Returns the bytes passed on, 0 once from has closed
+static long pass(int from, int to, char *buf)
+{
+	ssize_t n, w, done;
+
+	n = read(from, buf, RELAY_BUFSIZE);
+	if(n <= 0) { return 0; }
+	for(done=0; done<n; done+=w) {
+		w = write(to, buf+done, n-done);
+		if(w <= 0) { return 0; }
+	}
+	return n;
+}
+
+static void* relay(void *arg)
+{
+	long n, up = 0, down = 0;
+	char *buf;
+	FILE *f;
+	relay_t *rl = arg;
+	struct pollfd fds[2];
+
+	buf = malloc(RELAY_BUFSIZE);
+	fds[0].fd = rl->c;	fds[0].events = POLLIN;
+	fds[1].fd = rl->r;	fds[1].events = POLLIN;
+	while(buf && (poll(fds, 2, -1) > 0)) {
+		if(fds[0].revents) {
+			n = pass(rl->c, rl->r, buf);
+			if(n == 0) { break; }
+			up += n;
+		}
+		if(fds[1].revents) {
+			n = pass(rl->r, rl->c, buf);
+			if(n == 0) { break; }
+			down += n;
+		}
+	}
+	close(rl->c);
+	close(rl->r);
+	free(buf);
+	free(rl);
+
+	pthread_mutex_lock(&g_lock);
+	g_up += up;
+	g_down += down;
+	f = fopen(g_out, "w");
+	if(f) { fprintf(f, "%ld %ld\n", g_up, g_down); fclose(f); }
+	pthread_mutex_unlock(&g_lock);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int ls, c, one = 1;
+	relay_t *rl;
+	pthread_t thr;
+	struct sockaddr_in sa;
+
+	if(argc < 4) { fprintf(stderr, "usage: %s <listen port> <tpad port> <out>\n", argv[0]); return 2; }
+	g_tpadport = atoi(argv[2]);
+	g_out = argv[3];
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(atoi(argv[1]));
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if((bind(ls, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen(ls, 16) != 0)) {
+		perror("bind/listen");
+		return 1;
+	}
+
+	while((c = accept(ls, NULL, NULL)) >= 0) {
+		rl = malloc(sizeof(relay_t));
+		if(!rl) { close(c); continue; }
+		rl->c = c;
+		rl->r = connect_tpad();
+		if(rl->r < 0) { close(c); free(rl); continue; }
+		if(pthread_create(&thr, NULL, relay, rl) != 0) { close(c); close(rl->r); free(rl); continue; }
+		pthread_detach(thr);
+	}
+
+	return 0;
+}
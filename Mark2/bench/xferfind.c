@@ -0,0 +1,114 @@
+/*
+	xfer is an easy to use interface to libgcrypt with FILE operations
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+	xferfind: what xfer_find() costs with 10 to 100000 transfers active.
+	It links the real xfer.c, with the file and catalog calls stubbed out
+	so that it does not need an fd per transfer.
+	"any" looks up transfers at random from all of them, once they no longer fit in the cache
+	that is a cache miss on the transfer itself whatever the table does.
+	"busy" keeps to FIND_BUSY of them, like a tpad with a few transfers moving and the rest idle,
+	which is what the table itself costs.
+
+	usage: xferfind.exe [lookups per step]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xfer.h"
+#include "catalog.h"
+
+#define FIND_LOOKUPS (1000000)
+#define FIND_BUSY (64)
+
+// Just enough of gcryptfile.c and catalog.c for xfer_new() and xfer_complete()
+int gcfile_open(gcfile_t *gcf, const char *path, const char *mode)
+{
+	snprintf(gcf->path, sizeof(gcf->path), "%s", path);
+	gcf->is_open = 1;
+	return 0;
+}
+
+void gcfile_close(gcfile_t *gcf) { gcf->is_open = 0; }
+void catalog_remove(char *path) { }
+void catalog_update(char *path) { }
+void catalog_unclaim(char *path) { }
+
+// Returns the average ns per xfer_find() of the ids in order, -1 if one went missing
+static double time_finds(xfer_id_t *order, long lookups)
+{
+	long i;
+	xfer_t *xp;
+	struct timespec a, b;
+
+	clock_gettime(CLOCK_MONOTONIC, &a);
+	for(i=0; i<lookups; i++) {
+		xp = xfer_find(order[i]);
+		if(!xp) { fprintf(stderr, "lost %lu!\n", (unsigned long)order[i]); return -1; }
+		xfer_release(xp);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &b);
+
+	return (double)(((b.tv_sec - a.tv_sec) * 1000000000L) + (b.tv_nsec - a.tv_nsec)) / lookups;
+}
+
+int main(int argc, char *argv[])
+{
+	long i, n, busy, active = 0, lookups = FIND_LOOKUPS;
+	long steps[] = { 10, 100, 1000, 10000, 100000, 0 };
+	double any, hot;
+	xfer_id_t *ids, *order;
+	xfer_t *xp;
+
+	if(argc > 1) { lookups = atol(argv[1]); }
+	if(lookups < 1) { fprintf(stderr, "lookups must be at least 1!\n"); return 2; }
+
+	ids = calloc(steps[4], sizeof(xfer_id_t));
+	order = calloc(lookups, sizeof(xfer_id_t));
+	if(!ids || !order) { fprintf(stderr, "calloc() failed!\n"); return 1; }
+
+	srand(time(NULL));
+	xfer_init(0);
+	for(n=0; steps[n]; n++) {
+		for(; active<steps[n]; active++) {
+			xp = xfer_new("xferfind", "r");
+			if(!xp) { fprintf(stderr, "xfer_new() failed at %ld!\n", active); return 1; }
+			ids[active] = xp->id;
+			xfer_release(xp);
+		}
+
+		// Pick the ids up front so that rand() is not part of what we time
+		for(i=0; i<lookups; i++) { order[i] = ids[rand() % active]; }
+		any = time_finds(order, lookups);
+
+		// The busy ones are spread over the table, not the last few we made
+		busy = (active < FIND_BUSY) ? active : FIND_BUSY;
+		for(i=0; i<lookups; i++) { order[i] = ids[((rand() % busy) * active) / busy]; }
+		hot = time_finds(order, lookups);
+
+		if((any < 0) || (hot < 0)) { return 1; }
+		printf("%6ld active: %6.1f ns per xfer_find() (any), %6.1f ns (%ld busy)\n", active, any, hot, busy);
+	}
+
+	free(order);
+	free(ids);
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+	Transporter is a ZMQ based file transfer utility
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "bufpool.h"
+
+bufpool_t* bufpool_create(unsigned long bufsize, int count)
+{
+	int i, z;
+	char *p;
+	bufpool_t *bp;
+
+	if((bufsize == 0) || (count < 1)) { return NULL; }
+
+	bp = calloc(1, sizeof(bufpool_t));
+	if(!bp) { return NULL; }
+
+	// Round each buffer up to a whole number of pages, so they all stay aligned
+	bp->bufsize = ((bufsize + BUFPOOL_ALIGN - 1) / BUFPOOL_ALIGN) * BUFPOOL_ALIGN;
+	bp->count = count;
+
+	z = posix_memalign(&bp->mem, BUFPOOL_ALIGN, bp->bufsize * count);
+	if(z != 0) { free(bp); return NULL; }
+
+	bp->freelist = calloc(count, sizeof(void *));
+	if(!bp->freelist) { free(bp->mem); free(bp); return NULL; }
+
+	p = bp->mem;
+	for(i=0; i<count; i++) { bp->freelist[i] = p + (i * bp->bufsize); }
+	bp->avail = count;
+
+	pthread_mutex_init(&bp->lock, NULL);
+	pthread_cond_init(&bp->cond, NULL);
+	return bp;
+}
+
+// Wait up to timeout_ms for a buffer to come back
+// return NULL if the pool stays empty
+void* bufpool_get(bufpool_t *bp, int timeout_ms)
+{
+	int z = 0;
+	void *buf = NULL;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if(ts.tv_nsec >= 1000000000L) { ts.tv_sec++; ts.tv_nsec -= 1000000000L; }
+
+	pthread_mutex_lock(&bp->lock);
+	while((bp->avail == 0) && (z != ETIMEDOUT)) {
+		z = pthread_cond_timedwait(&bp->cond, &bp->lock, &ts);
+	}
+	if(bp->avail > 0) { buf = bp->freelist[--bp->avail]; }
+	pthread_mutex_unlock(&bp->lock);
+
+	return buf;
+}
+
+void bufpool_put(bufpool_t *bp, void *buf)
+{
+	if(!buf) { return; }
+
+	pthread_mutex_lock(&bp->lock);
+	bp->freelist[bp->avail++] = buf;
+	pthread_cond_signal(&bp->cond);
+	pthread_mutex_unlock(&bp->lock);
+}
+
+// zmq_free_fn for zmq_msg_init_data(), hint is the pool
+void bufpool_free_cb(void *data, void *hint)
+{
+	bufpool_put((bufpool_t *)hint, data);
+}
+
+void bufpool_destroy(bufpool_t *bp)
+{
+	if(!bp) { return; }
+
+	pthread_cond_destroy(&bp->cond);
+	pthread_mutex_destroy(&bp->lock);
+	free(bp->freelist);
+	free(bp->mem);
+	free(bp);
+}
@@ -0,0 +1,44 @@
+/*
+	Transporter is a ZMQ based file transfer utility
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __TPAD_BUFPOOL_H__
+#define __TPAD_BUFPOOL_H__
+
+#include <pthread.h>
+
+#define BUFPOOL_ALIGN (4096)
+
+// A fixed set of equally sized, page aligned buffers
+// Buffers can be handed back from any thread (including zmq's I/O thread)
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long bufsize;
+	int count;
+	int avail;
+	void **freelist;
+	void *mem;
+} bufpool_t;
+
+bufpool_t* bufpool_create(unsigned long bufsize, int count);
+void* bufpool_get(bufpool_t *bp, int timeout_ms);
+void bufpool_put(bufpool_t *bp, void *buf);
+void bufpool_free_cb(void *data, void *hint);
+void bufpool_destroy(bufpool_t *bp);
+
+#endif
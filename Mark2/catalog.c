@@ -0,0 +1,811 @@
+/*
+	Transporter is a ZMQ based file transfer utility
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <search.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "catalog.h"
+#include "transporter.h"
+#include "rnum.h"
+
+// What tpad needs to hear about to keep up with the spool.
+// A file still being written only shows up once it is closed, IN_CREATE is for new dirs
+#define CAT_WATCH (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB | IN_CREATE)
+
+// A random pick with a filter tries this many files before it goes looking for one
+#define CAT_SAMPLES (32)
+
+// Each index is a treap, the entries carry their own links and a random priority
+static pthread_mutex_t g_clock = PTHREAD_MUTEX_INITIALIZER;
+static centry_t *g_root[CAT_NINDEX];
+static centry_t **g_all = NULL;
+static long g_count = 0;
+static long g_bytes = 0;
+static long g_max = 0;
+static centry_t *g_claims = NULL;	// by name, out of every index until the claim ends
+static long g_nclaimed = 0;
+static unsigned long g_seed = 0;
+static int g_notefd = -1;
+static int g_noted = 0;		// g_notefd was written to and nobody has read it yet
+
+// Every dir in the spool has its own inotify watch, this is where it is.
+// dir is "" for the spool itself, otherwise it ends in a '/'.
+// Only the thread that calls catalog_init() and catalog_events() touches these
+typedef struct {
+	int wd;
+	char dir[];
+} cwatch_t;
+
+static int g_ifd = -1;
+static void *g_watches = NULL;
+
+// What a scan found, before it goes into the catalog
+typedef struct {
+	centry_t **e;
+	long n, max;
+} clist_t;
+
+// What an index is sorted on, an entry or a cursor
+typedef struct {
+	long size;
+	time_t mtime;
+	const char *name;
+} ckey_t;
+
+// Call with g_clock held
+static unsigned long cat_prio(void)
+{
+	// xorshift64, we only need it to look random to the treaps
+	g_seed ^= g_seed << 13;
+	g_seed ^= g_seed >> 7;
+	g_seed ^= g_seed << 17;
+	return g_seed;
+}
+
+static int cat_cmp(int idx, ckey_t *k, centry_t *e)
+{
+	if(idx == CAT_BYTIME) {
+		if(k->mtime != e->mtime) { return (k->mtime < e->mtime) ? -1 : 1; }
+	} else if(idx == CAT_BYSIZE) {
+		if(k->size != e->size) { return (k->size < e->size) ? -1 : 1; }
+	}
+	return strcmp(k->name, e->name);
+}
+
+static void cat_setkey(ckey_t *k, centry_t *e)
+{
+	k->size = e->size;
+	k->mtime = e->mtime;
+	k->name = e->name;
+}
+
+// Split t into the entries before k and the ones after it
+static void cat_split(centry_t *t, int idx, ckey_t *k, centry_t **l, centry_t **r)
+{
+	if(!t) { *l = *r = NULL; return; }
+
+	if(cat_cmp(idx, k, t) > 0) {
+		*l = t;
+		cat_split(t->kid[idx][1], idx, k, &t->kid[idx][1], r);
+	} else {
+		*r = t;
+		cat_split(t->kid[idx][0], idx, k, l, &t->kid[idx][0]);
+	}
+}
+
+// Every entry in a comes before every entry in b
+static centry_t* cat_merge(int idx, centry_t *a, centry_t *b)
+{
+	if(!a) { return b; }
+	if(!b) { return a; }
+
+	if(a->prio > b->prio) {
+		a->kid[idx][1] = cat_merge(idx, a->kid[idx][1], b);
+		return a;
+	}
+
+	b->kid[idx][0] = cat_merge(idx, a, b->kid[idx][0]);
+	return b;
+}
+
+static void cat_insert(centry_t **t, int idx, centry_t *e, ckey_t *k)
+{
+	while(*t && ((*t)->prio >= e->prio)) {
+		t = &(*t)->kid[idx][cat_cmp(idx, k, *t) > 0];
+	}
+
+	cat_split(*t, idx, k, &e->kid[idx][0], &e->kid[idx][1]);
+	*t = e;
+}
+
+static void cat_unlink(centry_t **t, int idx, centry_t *e, ckey_t *k)
+{
+	while(*t && (*t != e)) {
+		t = &(*t)->kid[idx][cat_cmp(idx, k, *t) > 0];
+	}
+	if(!*t) { return; }
+
+	*t = cat_merge(idx, e->kid[idx][0], e->kid[idx][1]);
+	e->kid[idx][0] = NULL;
+	e->kid[idx][1] = NULL;
+}
+
+// The first (side 0) or the last (side 1) entry of an index
+static centry_t* cat_edge(int idx, int side)
+{
+	centry_t *t;
+
+	t = g_root[idx];
+	while(t && t->kid[idx][side]) { t = t->kid[idx][side]; }
+	return t;
+}
+
+// The entry right after k, or right before it going backwards (desc)
+static centry_t* cat_after(int idx, ckey_t *k, int desc)
+{
+	int c;
+	centry_t *t, *best = NULL;
+
+	t = g_root[idx];
+	while(t) {
+		c = cat_cmp(idx, k, t);
+		if(desc) { c = -c; }
+		if(c < 0) { best = t; t = t->kid[idx][desc]; }
+		else { t = t->kid[idx][!desc]; }
+	}
+
+	return best;
+}
+
+static centry_t* cat_find(centry_t *t, const char *name)
+{
+	int c;
+	ckey_t k;
+
+	k.name = name;
+	while(t) {
+		c = cat_cmp(CAT_BYNAME, &k, t);
+		if(c == 0) { return t; }
+		t = t->kid[CAT_BYNAME][c > 0];
+	}
+
+	return NULL;
+}
+
+// Call with g_clock held
+static int cat_add(centry_t *e)
+{
+	int i;
+	long max;
+	ckey_t k;
+	centry_t **tmp;
+
+	if(g_count == g_max) {
+		max = g_max ? (g_max * 2) : 1024;
+		tmp = realloc(g_all, max * sizeof(centry_t *));
+		if(!tmp) { return -1; }
+		g_all = tmp;
+		g_max = max;
+	}
+	e->slot = g_count;
+	g_all[g_count++] = e;
+	g_bytes += e->size;
+	if((g_notefd != -1) && !g_noted) {
+		g_noted = 1;
+		(void) eventfd_write(g_notefd, 1);
+	}
+
+	e->prio = cat_prio();
+	cat_setkey(&k, e);
+	for(i=0; i<CAT_NINDEX; i++) { cat_insert(&g_root[i], i, e, &k); }
+	return 0;
+}
+
+// Call with g_clock held
+static void cat_take(centry_t *e)
+{
+	int i;
+	ckey_t k;
+
+	cat_setkey(&k, e);
+	for(i=0; i<CAT_NINDEX; i++) { cat_unlink(&g_root[i], i, e, &k); }
+
+	// Fill its slot with the last one
+	g_all[e->slot] = g_all[--g_count];
+	g_all[e->slot]->slot = e->slot;
+	g_bytes -= e->size;
+}
+
+// Call with g_clock held
+static void cat_del(centry_t *e)
+{
+	cat_take(e);
+	free(e);
+}
+
+// Call with g_clock held
+static void cat_unclaim(centry_t *e)
+{
+	ckey_t k;
+
+	cat_setkey(&k, e);
+	cat_unlink(&g_claims, CAT_BYNAME, e, &k);
+	g_nclaimed--;
+	free(e);
+}
+
+static centry_t* cat_new(const char *name, struct stat *st)
+{
+	size_t len;
+	centry_t *e;
+
+	len = strlen(name);
+	e = calloc(1, sizeof(centry_t) + len + 1);
+	if(!e) { return NULL; }
+
+	memcpy(e->name, name, len+1);
+	e->size = (long)st->st_size;
+	e->mtime = st->st_mtime;
+	return e;
+}
+
+// Look at name again and bring the catalog in line with what is on disk
+void catalog_update(char *name)
+{
+	ckey_t k;
+	centry_t *e;
+	struct stat st;
+
+	if((stat(name, &st) != 0) || !S_ISREG(st.st_mode)) {
+		catalog_remove(name);
+		return;
+	}
+
+	pthread_mutex_lock(&g_clock);
+	// A claimed file gets looked at again once its claim ends
+	if(cat_find(g_claims, name)) { pthread_mutex_unlock(&g_clock); return; }
+
+	e = cat_find(g_root[CAT_BYNAME], name);
+	if(e && ((e->size != (long)st.st_size) || (e->mtime != st.st_mtime))) {
+		// Only the time and size indexes care, the name stays put
+		cat_setkey(&k, e);
+		cat_unlink(&g_root[CAT_BYTIME], CAT_BYTIME, e, &k);
+		cat_unlink(&g_root[CAT_BYSIZE], CAT_BYSIZE, e, &k);
+		g_bytes += (long)st.st_size - e->size;
+		e->size = (long)st.st_size;
+		e->mtime = st.st_mtime;
+		cat_setkey(&k, e);
+		cat_insert(&g_root[CAT_BYTIME], CAT_BYTIME, e, &k);
+		cat_insert(&g_root[CAT_BYSIZE], CAT_BYSIZE, e, &k);
+	} else if(!e) {
+		e = cat_new(name, &st);
+		if(e && cat_add(e)) { free(e); }
+	}
+	pthread_mutex_unlock(&g_clock);
+}
+
+void catalog_remove(char *name)
+{
+	centry_t *e;
+
+	pthread_mutex_lock(&g_clock);
+	// A claim is left to whoever holds it
+	e = cat_find(g_root[CAT_BYNAME], name);
+	if(e) { cat_del(e); }
+	pthread_mutex_unlock(&g_clock);
+}
+
+static int cat_wdcmp(const void *a, const void *b)
+{
+	int x = ((const cwatch_t *)a)->wd;
+	int y = ((const cwatch_t *)b)->wd;
+	return (x > y) - (x < y);
+}
+
+static cwatch_t* cat_watched(int wd)
+{
+	cwatch_t k, **found;
+
+	k.wd = wd;
+	found = tfind(&k, &g_watches, cat_wdcmp);
+	return found ? *found : NULL;
+}
+
+// Watch dir, or point its watch at where it is now if it was moved
+static void cat_watch(const char *dir)
+{
+	int wd;
+	size_t len;
+	cwatch_t *w, **found;
+	static int warned = 0;
+
+	if(g_ifd == -1) { return; }
+
+	wd = inotify_add_watch(g_ifd, dir[0] ? dir : ".", CAT_WATCH | IN_ONLYDIR | IN_DONT_FOLLOW);
+	if(wd == -1) {
+		// Out of watches, tpad still keeps track of its own transfers in there
+		if(!warned) { fprintf(stderr, "%s(): inotify_add_watch(%s) failed: %s\n", __func__, dir, strerror(errno)); }
+		warned = 1;
+		return;
+	}
+
+	len = strlen(dir);
+	w = malloc(sizeof(cwatch_t) + len + 1);
+	if(!w) { return; }
+	w->wd = wd;
+	memcpy(w->dir, dir, len+1);
+
+	found = tsearch(w, &g_watches, cat_wdcmp);
+	if(!found) { free(w); return; }
+	if(*found != w) { free(*found); *found = w; }
+}
+
+static void cat_unwatch(int wd)
+{
+	cwatch_t *w;
+
+	w = cat_watched(wd);
+	if(!w) { return; }
+	(void) tdelete(w, &g_watches, cat_wdcmp);
+	free(w);
+}
+
+static void cat_push(clist_t *l, const char *name, struct stat *st)
+{
+	long max;
+	centry_t *e, **tmp;
+
+	if(l->n == l->max) {
+		max = l->max ? (l->max * 2) : 1024;
+		tmp = realloc(l->e, max * sizeof(centry_t *));
+		if(!tmp) { return; }
+		l->e = tmp;
+		l->max = max;
+	}
+
+	e = cat_new(name, st);
+	if(e) { l->e[l->n++] = e; }
+}
+
+// Find every regular file under the open dir dfd (named dir) and watch every dir on the way.
+// Symlinks to dirs are not followed, dfd is closed when we are done
+static void cat_scandir(int dfd, const char *dir, clist_t *l)
+{
+	int fd, isdir;
+	DIR *d;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+
+	// Watch first, so nothing that happens while we read it gets lost
+	cat_watch(dir);
+
+	d = fdopendir(dfd);
+	if(!d) { close(dfd); return; }
+
+	while((de = readdir(d))) {
+		if((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0)) { continue; }
+		if(snprintf(path, sizeof(path)-1, "%s%s", dir, de->d_name) >= (int)sizeof(path)-1) { continue; }
+
+		isdir = (de->d_type == DT_DIR);
+		if(de->d_type == DT_UNKNOWN) {
+			isdir = ((fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(st.st_mode));
+		}
+
+		if(isdir) {
+			fd = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if(fd == -1) { continue; }
+			strcat(path, "/");
+			cat_scandir(fd, path, l);
+			continue;
+		}
+
+		if(fstatat(dirfd(d), de->d_name, &st, 0) != 0) { continue; }
+		if(!S_ISREG(st.st_mode)) { continue; }
+		cat_push(l, path, &st);
+	}
+
+	closedir(d);
+}
+
+// Add what is under dir ("" for the whole spool, otherwise ending in '/').
+// The reading is done before taking the lock, claimed files and files we already have are left alone.
+// With all set, the catalog is thrown away first
+static void cat_load(const char *dir, int all)
+{
+	int fd;
+	long i;
+	clist_t l;
+
+	fd = open(dir[0] ? dir : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(fd == -1) { if(all) { fprintf(stderr, "%s(): open(%s) failed: %s\n", __func__, dir, strerror(errno)); } return; }
+
+	memset(&l, 0, sizeof(l));
+	cat_scandir(fd, dir, &l);
+
+	pthread_mutex_lock(&g_clock);
+	while(all && (g_count > 0)) { cat_del(g_all[g_count-1]); }
+	for(i=0; i<l.n; i++) {
+		if(cat_find(g_claims, l.e[i]->name) || cat_find(g_root[CAT_BYNAME], l.e[i]->name) || cat_add(l.e[i])) { free(l.e[i]); }
+	}
+	pthread_mutex_unlock(&g_clock);
+
+	free(l.e);
+}
+
+// Everything under dir (ending in '/') is gone
+static void cat_drop(const char *dir)
+{
+	size_t len;
+	ckey_t k;
+	centry_t *e, *next;
+
+	len = strlen(dir);
+	k.name = dir;
+
+	pthread_mutex_lock(&g_clock);
+	e = cat_after(CAT_BYNAME, &k, 0);
+	while(e && (strncmp(e->name, dir, len) == 0)) {
+		cat_setkey(&k, e);
+		next = cat_after(CAT_BYNAME, &k, 0);
+		cat_del(e);
+		e = next;
+	}
+	pthread_mutex_unlock(&g_clock);
+}
+
+// Throw the catalog away and read the whole spool again, one stat() per file. Claims are kept
+void catalog_scan(void)
+{
+	cat_load("", 1);
+}
+
+int catalog_init(void)
+{
+	pthread_mutex_lock(&g_clock);
+	while(g_seed == 0) { g_seed = randomul(); }
+	pthread_mutex_unlock(&g_clock);
+
+	// The scan adds a watch for every dir it reads
+	g_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(g_ifd == -1) { fprintf(stderr, "%s(): inotify_init1() failed: %s\n", __func__, strerror(errno)); }
+
+	catalog_scan();
+	return g_ifd;
+}
+
+int catalog_notify(void)
+{
+	int fd;
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(fd == -1) { fprintf(stderr, "%s(): eventfd() failed: %s\n", __func__, strerror(errno)); return -1; }
+
+	pthread_mutex_lock(&g_clock);
+	g_notefd = fd;
+	g_noted = 0;
+	pthread_mutex_unlock(&g_clock);
+
+	return fd;
+}
+
+void catalog_notified(int fd)
+{
+	eventfd_t n;
+
+	pthread_mutex_lock(&g_clock);
+	(void) eventfd_read(fd, &n);
+	g_noted = 0;
+	pthread_mutex_unlock(&g_clock);
+}
+
+// Read everything inotify has for us
+void catalog_events(int fd)
+{
+	int rescan = 0;
+	ssize_t len;
+	char *p;
+	cwatch_t *w;
+	struct inotify_event *ev;
+	char name[PATH_MAX];
+	char buf[65536] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while((len = read(fd, buf, sizeof(buf))) > 0) {
+		for(p=buf; p<(buf+len); p+=sizeof(struct inotify_event)+ev->len) {
+			ev = (struct inotify_event *)p;
+			// We missed some, so nothing short of a rescan will do
+			if(ev->mask & IN_Q_OVERFLOW) { rescan = 1; continue; }
+			if(ev->mask & IN_IGNORED) { cat_unwatch(ev->wd); continue; }
+			if(ev->len == 0) { continue; }
+
+			w = cat_watched(ev->wd);
+			if(!w) { continue; }
+			if(snprintf(name, sizeof(name)-1, "%s%s", w->dir, ev->name) >= (int)sizeof(name)-1) { continue; }
+
+			// A dir that went away takes its files with it, one that showed up has to be read
+			if(ev->mask & IN_ISDIR) {
+				strcat(name, "/");
+				if(ev->mask & (IN_MOVED_FROM | IN_DELETE)) { cat_drop(name); }
+				if(ev->mask & (IN_MOVED_TO | IN_CREATE)) { cat_load(name, 0); }
+				continue;
+			}
+
+			// A new file is not done until it is closed
+			if(ev->mask & IN_CREATE) { continue; }
+			catalog_update(name);
+		}
+	}
+
+	if(rescan) {
+		fprintf(stderr, "%s(): inotify queue overflowed, rescanning\n", __func__);
+		catalog_scan();
+	}
+}
+
+// The number of files ready to be picked, and optionally how many bytes they hold
+long catalog_count(long *bytes)
+{
+	long count;
+
+	pthread_mutex_lock(&g_clock);
+	count = g_count;
+	if(bytes) { *bytes = g_bytes; }
+	pthread_mutex_unlock(&g_clock);
+
+	return count;
+}
+
+static int cat_index(int method, int *desc)
+{
+	*desc = ((method == NEWMETHOD) || (method == LRGMETHOD));
+	if((method == OLDMETHOD) || (method == NEWMETHOD)) { return CAT_BYTIME; }
+	if((method == LRGMETHOD) || (method == SMLMETHOD)) { return CAT_BYSIZE; }
+	return CAT_BYNAME;
+}
+
+void catalog_filter_init(cat_filter_t *f)
+{
+	f->glob = NULL;
+	f->minsize = 0;
+	f->maxsize = LONG_MAX;
+	f->minmtime = (time_t)LONG_MIN;
+	f->maxmtime = (time_t)LONG_MAX;
+}
+
+static int cat_match(centry_t *e, cat_filter_t *f)
+{
+	if(!f) { return 1; }
+	if((e->size < f->minsize) || (e->size > f->maxsize)) { return 0; }
+	if((e->mtime < f->minmtime) || (e->mtime > f->maxmtime)) { return 0; }
+	if(f->glob && (fnmatch(f->glob, e->name, 0) != 0)) { return 0; }
+	return 1;
+}
+
+// Where a walk of idx starts. If f limits the key of idx, skip straight to the limit
+static centry_t* cat_start(int idx, int desc, cat_filter_t *f)
+{
+	ckey_t k;
+
+	// Every name sorts after "", so (key, "") lands just ahead of the first file with that key
+	k.name = "";
+	if(f && (idx == CAT_BYTIME)) {
+		if(!desc && (f->minmtime != (time_t)LONG_MIN)) { k.mtime = f->minmtime; return cat_after(idx, &k, 0); }
+		if(desc && (f->maxmtime != (time_t)LONG_MAX)) { k.mtime = f->maxmtime + 1; return cat_after(idx, &k, 1); }
+	}
+	if(f && (idx == CAT_BYSIZE)) {
+		if(!desc && (f->minsize > 0)) { k.size = f->minsize; return cat_after(idx, &k, 0); }
+		if(desc && (f->maxsize != LONG_MAX)) { k.size = f->maxsize + 1; return cat_after(idx, &k, 1); }
+	}
+
+	return cat_edge(idx, desc);
+}
+
+// Past the far end of what f lets through, nothing further along idx can match
+static int cat_past(int idx, int desc, centry_t *e, cat_filter_t *f)
+{
+	if(!f) { return 0; }
+	if(idx == CAT_BYTIME) { return desc ? (e->mtime < f->minmtime) : (e->mtime > f->maxmtime); }
+	if(idx == CAT_BYSIZE) { return desc ? (e->size < f->minsize) : (e->size > f->maxsize); }
+	return 0;
+}
+
+// e, or the first file after it along idx that passes f
+static centry_t* cat_walk(int idx, int desc, centry_t *e, cat_filter_t *f)
+{
+	ckey_t k;
+
+	while(e && !cat_past(idx, desc, e, f)) {
+		if(cat_match(e, f)) { return e; }
+		cat_setkey(&k, e);
+		e = cat_after(idx, &k, desc);
+	}
+
+	return NULL;
+}
+
+// Call with g_clock held. Returns NULL if no file passes f
+static centry_t* cat_choose(int method, cat_filter_t *f)
+{
+	int idx, desc;
+	long i, start;
+	centry_t *e;
+
+	if(g_count == 0) { return NULL; }
+
+	if(method == RNDMETHOD) {
+		if(!f) { return g_all[cat_prio() % g_count]; }
+
+		// Try our luck, then take the first one that passes from a random place on
+		for(i=0; i<CAT_SAMPLES; i++) {
+			e = g_all[cat_prio() % g_count];
+			if(cat_match(e, f)) { return e; }
+		}
+		start = cat_prio() % g_count;
+		for(i=0; i<g_count; i++) {
+			e = g_all[(start + i) % g_count];
+			if(cat_match(e, f)) { return e; }
+		}
+		return NULL;
+	}
+
+	idx = cat_index(method, &desc);
+	return cat_walk(idx, desc, cat_start(idx, desc, f), f);
+}
+
+// Copy the name of the file method would pick into name.
+// Returns 0 if there was one, 1 if the spool is empty
+int catalog_pick(int method, char *name, size_t len)
+{
+	centry_t *e;
+
+	pthread_mutex_lock(&g_clock);
+	e = cat_choose(method, NULL);
+	if(e) { snprintf(name, len, "%s", e->name); }
+	pthread_mutex_unlock(&g_clock);
+
+	return (e == NULL);
+}
+
+// Like catalog_pick(), but only a file that passes f (NULL for any),
+// and it is also hidden from every other pick, page and count until catalog_unclaim()
+int catalog_claim(int method, cat_filter_t *f, char *name, size_t len)
+{
+	ckey_t k;
+	centry_t *e;
+
+	pthread_mutex_lock(&g_clock);
+	e = cat_choose(method, f);
+	if(!e) { pthread_mutex_unlock(&g_clock); return 1; }
+	snprintf(name, len, "%s", e->name);
+	cat_take(e);
+	cat_setkey(&k, e);
+	cat_insert(&g_claims, CAT_BYNAME, e, &k);
+	g_nclaimed++;
+	pthread_mutex_unlock(&g_clock);
+
+	return 0;
+}
+
+// Keep name out of the catalog while a GET or PUT has it open, the same way a claim does.
+// Returns 1 if it is claimed already
+int catalog_hold(char *name)
+{
+	ckey_t k;
+	centry_t *e;
+	struct stat st;
+
+	pthread_mutex_lock(&g_clock);
+	if(cat_find(g_claims, name)) { pthread_mutex_unlock(&g_clock); return 1; }
+
+	e = cat_find(g_root[CAT_BYNAME], name);
+	if(e) {
+		cat_take(e);
+	} else {
+		memset(&st, 0, sizeof(st));
+		e = cat_new(name, &st);
+		if(!e) { pthread_mutex_unlock(&g_clock); return -1; }
+		e->prio = cat_prio();
+	}
+	cat_setkey(&k, e);
+	cat_insert(&g_claims, CAT_BYNAME, e, &k);
+	g_nclaimed++;
+	pthread_mutex_unlock(&g_clock);
+
+	return 0;
+}
+
+// The claim on name is over but the file was left in place, put it back
+void catalog_unclaim(char *name)
+{
+	centry_t *e;
+
+	pthread_mutex_lock(&g_clock);
+	e = cat_find(g_claims, name);
+	if(e) { cat_unclaim(e); }
+	pthread_mutex_unlock(&g_clock);
+
+	if(e) { catalog_update(name); }
+}
+
+long catalog_nclaimed(void)
+{
+	long n;
+
+	pthread_mutex_lock(&g_clock);
+	n = g_nclaimed;
+	pthread_mutex_unlock(&g_clock);
+
+	return n;
+}
+
+// The sort key a cursor carries for method
+long catalog_key(cat_item_t *e, int method)
+{
+	if((method == OLDMETHOD) || (method == NEWMETHOD)) { return (long)e->mtime; }
+	if((method == LRGMETHOD) || (method == SMLMETHOD)) { return e->size; }
+	return 0;
+}
+
+/*
+	Copy up to count entries that come after the cursor (ckey, cname) in method's order
+	and pass f (NULL for any) into list, from the start when cname is NULL. newest and largest are the other two orders backwards.
+	Names with a newline in them would break a listing, so they are left out.
+	Returns how many were copied
+*/
+long catalog_page(int method, cat_filter_t *f, long ckey, char *cname, cat_item_t *list, long count)
+{
+	int idx, desc;
+	long n = 0;
+	ckey_t k;
+	centry_t *e;
+
+	idx = cat_index(method, &desc);
+	k.size = ckey;
+	k.mtime = (time_t)ckey;
+	k.name = cname;
+
+	pthread_mutex_lock(&g_clock);
+	e = cname ? cat_after(idx, &k, desc) : cat_start(idx, desc, f);
+	while((e = cat_walk(idx, desc, e, f)) && (n < count)) {
+		if(!strchr(e->name, '\n')) {
+			list[n].name = strdup(e->name);
+			if(!list[n].name) { break; }
+			list[n].size = e->size;
+			list[n].mtime = e->mtime;
+			n++;
+		}
+		cat_setkey(&k, e);
+		e = cat_after(idx, &k, desc);
+	}
+	pthread_mutex_unlock(&g_clock);
+
+	return n;
+}
@@ -0,0 +1,92 @@
+/*
+	Transporter is a ZMQ based file transfer utility
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __TPAD_CATALOG_H__
+#define __TPAD_CATALOG_H__
+
+#include <time.h>
+
+/*
+	The regular files in the spool (the current directory and every dir under it, named by their path from it),
+	kept in memory so the CMDs never have to scan it.
+	Every file sits in three ordered indexes: by name, by (mtime, name) and by (size, name),
+	plus an array to pick a random one from.
+	tpad keeps it current on its own: an upload is added once it is complete,
+	a download that deleted its file is removed.
+	A file handed out by CLAIMCMD is taken out of the indexes until its transfer is over.
+	Anything else that happens in the spool is picked up through inotify, every dir has a watch.
+	Symlinks to dirs are not followed.
+*/
+
+#define CAT_BYNAME (0)
+#define CAT_BYTIME (1)
+#define CAT_BYSIZE (2)
+#define CAT_NINDEX (3)
+
+typedef struct centry_s {
+	struct centry_s *kid[CAT_NINDEX][2];
+	unsigned long prio;
+	long slot;		// where it sits in the random pick array
+	long size;
+	time_t mtime;
+	char name[];
+} centry_t;
+
+// A copy of an entry handed out by catalog_page(), name must be free()'d
+typedef struct {
+	char *name;
+	long size;
+	time_t mtime;
+} cat_item_t;
+
+// What a CLAIMCMD or a manifest can be narrowed down to, catalog_filter_init() lets everything through.
+// glob is an fnmatch(3) pattern, the size and mtime limits are inclusive
+typedef struct {
+	char *glob;
+	long minsize, maxsize;
+	time_t minmtime, maxmtime;
+} cat_filter_t;
+
+// catalog_init() returns the inotify fd to hand to catalog_events() when it is readable
+int catalog_init(void);
+void catalog_events(int fd);
+void catalog_scan(void);
+
+// catalog_notify() returns an eventfd that becomes readable when a file is added.
+// A burst of them is one event, until catalog_notified() says it was dealt with
+int catalog_notify(void);
+void catalog_notified(int fd);
+
+void catalog_update(char *name);
+void catalog_remove(char *name);
+
+long catalog_count(long *bytes);
+int catalog_pick(int method, char *name, size_t len);
+
+// A claimed file belongs to one transfer, nobody else can pick, GET or PUT it until the claim ends
+int catalog_claim(int method, cat_filter_t *f, char *name, size_t len);
+void catalog_unclaim(char *name);
+// A GET or PUT holds its file by name like a claim, catalog_unclaim() lets it back in
+int catalog_hold(char *name);
+long catalog_nclaimed(void);
+
+void catalog_filter_init(cat_filter_t *f);
+long catalog_page(int method, cat_filter_t *f, long ckey, char *cname, cat_item_t *list, long count);
+long catalog_key(cat_item_t *e, int method);
+
+#endif
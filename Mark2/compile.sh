@@ -16,13 +16,13 @@ DBGCFLAGS="${CFLAGS} -ggdb3 -DDEBUG"
 
 rm -rf *.exe *.dbg
 
-gcc ${OPTCFLAGS} tpad.c tpad_*.c xfer.c ${COMMONDIR}/{async_zmq_reply,futils,getopts,gchelper,gcryptfile,rnum}.c -lzmq -lpthread ${GCLIBS} -o tpad.exe
-gcc ${DBGCFLAGS} tpad.c tpad_*.c xfer.c ${COMMONDIR}/{async_zmq_reply,futils,getopts,gchelper,gcryptfile,rnum}.c -lzmq -lpthread ${GCLIBS} -o tpad.dbg
+gcc ${OPTCFLAGS} tpad.c tpad_*.c xfer.c catalog.c bufpool.c ${COMMONDIR}/{async_zmq_reply,futils,getopts,gchelper,gcryptfile,rnum}.c -lzmq -lpthread ${GCLIBS} -o tpad.exe
+gcc ${DBGCFLAGS} tpad.c tpad_*.c xfer.c catalog.c bufpool.c ${COMMONDIR}/{async_zmq_reply,futils,getopts,gchelper,gcryptfile,rnum}.c -lzmq -lpthread ${GCLIBS} -o tpad.dbg
 
-gcc ${OPTCFLAGS} beam.c ${COMMONDIR}/{futils,getopts,gchelper,gcryptfile}.c -lzmq ${GCLIBS} -o beam.exe
-gcc ${DBGCFLAGS} beam.c ${COMMONDIR}/{futils,getopts,gchelper,gcryptfile}.c -lzmq ${GCLIBS} -o beam.dbg
+gcc ${OPTCFLAGS} beam.c walk.c ${COMMONDIR}/{futils,getopts,gchelper,gcryptfile}.c -lzmq -lpthread ${GCLIBS} -o beam.exe
+gcc ${DBGCFLAGS} beam.c walk.c ${COMMONDIR}/{futils,getopts,gchelper,gcryptfile}.c -lzmq -lpthread ${GCLIBS} -o beam.dbg
 
-gcc ${OPTCFLAGS} absorb.c ${COMMONDIR}/{futils,getopts,gchelper,gcryptfile}.c -lzmq ${GCLIBS} -o absorb.exe
-gcc ${DBGCFLAGS} absorb.c ${COMMONDIR}/{futils,getopts,gchelper,gcryptfile}.c -lzmq ${GCLIBS} -o absorb.dbg
+gcc ${OPTCFLAGS} absorb.c ${COMMONDIR}/{futils,getopts,gchelper,gcryptfile}.c -lzmq -lpthread ${GCLIBS} -o absorb.exe
+gcc ${DBGCFLAGS} absorb.c ${COMMONDIR}/{futils,getopts,gchelper,gcryptfile}.c -lzmq -lpthread ${GCLIBS} -o absorb.dbg
 
 strip *.exe
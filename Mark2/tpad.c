@@ -20,45 +20,156 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 #include <errno.h>
 #include <time.h>
+#include <zmq.h>
 
 #include "getopts.h"
 #include "async_zmq_reply.h"
 #include "transporter.h"
 #include "futils.h"
 #include "gchelper.h"
+#include "xfer.h"
+#include "bufpool.h"
+#include "catalog.h"
+
+#define HOUSEKEEPING_INTERVAL (1)
 
 static void parse_args(int argc, char **argv);
 void tpad_cb(zmq_reply_t *r, zmq_mf_t **mpa, int msgcnt, void *user_data);
 
 int g_shutdown = 0;
 int g_noclobber = 0;
+int g_workers = 4;
+int g_chunkbufs = 0;
+long g_maxchunk = DEFAULT_MAXCHUNK;
+long g_maxactive = DEFAULT_MAXACTIVE;
+long g_lease = DEFAULT_LEASE;
+bufpool_t *g_chunkpool = NULL;
 
 char *g_zmqaddr = NULL;
+char *g_pubaddr = NULL;
 char *g_outputdir = NULL;
 
-void sig_handler(int signum)
+// Every active transfer holds an open file, so let us have as many as we are allowed
+static void raise_nofile_limit(void)
 {
-	switch(signum) {
-		case SIGALRM:
-			//Do something useful here
-			//alarm(1);
-			break;
-		case SIGHUP:
-		case SIGINT:
-		case SIGTERM:
-		case SIGQUIT:
-			g_shutdown = 1;
+	struct rlimit rl;
+
+	if(getrlimit(RLIMIT_NOFILE, &rl) != 0) { return; }
+	if(rl.rlim_cur == rl.rlim_max) { return; }
+	rl.rlim_cur = rl.rlim_max;
+	if(setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+		fprintf(stderr, "setrlimit(RLIMIT_NOFILE, %lu) failed: %s\n", (unsigned long)rl.rlim_max, strerror(errno));
+	}
+}
+
+// Block the signals we care about before any threads are started,
+// so they only ever get delivered through the signalfd
+static void block_signals(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGHUP);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGQUIT);
+	(void) sigprocmask(SIG_BLOCK, mask, NULL);
+}
+
+static void housekeeping(void)
+{
+	unsigned long reaped;
+
+	// Free up the slots of clients that went away mid-transfer
+	if(g_lease > 0) {
+		reaped = xfer_reap(g_lease);
+		if(reaped) { fprintf(stderr, "%s(): reaped %lu idle transfers\n", __func__, reaped); }
+	}
+}
+
+// Let the absorbs listening on --pub know there is something to pick up.
+// Only the main thread touches pub, a subscriber that can not keep up just misses it
+static void publish(void *pub)
+{
+	long count;
+	char resp[32];
+
+	count = catalog_count(NULL);
+	if(count < 1) { return; }
+
+	snprintf(resp, sizeof(resp), "%ld", count);
+	(void) zmq_send(pub, FILESEVENT,	strlen(FILESEVENT),	ZMQ_SNDMORE | ZMQ_DONTWAIT);
+	(void) zmq_send(pub, resp,			strlen(resp),		ZMQ_DONTWAIT);
+}
+
+// Sleep in poll() until we get a signal, the housekeeping timer fires
+// or something changes in the spool
+static void main_loop(sigset_t *mask, int ifd, void *pub, int efd)
+{
+	int z, sfd, tfd;
+	uint64_t expirations;
+	struct signalfd_siginfo si;
+	struct itimerspec its;
+	struct pollfd pfd[4];
+
+	sfd = signalfd(-1, mask, SFD_CLOEXEC);
+	if(sfd == -1) { fprintf(stderr, "signalfd() failed: %s\n", strerror(errno)); return; }
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if(tfd == -1) { fprintf(stderr, "timerfd_create() failed: %s\n", strerror(errno)); close(sfd); return; }
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = HOUSEKEEPING_INTERVAL;
+	its.it_interval.tv_sec = HOUSEKEEPING_INTERVAL;
+	(void) timerfd_settime(tfd, 0, &its, NULL);
+
+	pfd[0].fd = sfd;	pfd[0].events = POLLIN;
+	pfd[1].fd = tfd;	pfd[1].events = POLLIN;
+	pfd[2].fd = ifd;	pfd[2].events = POLLIN;	// poll() skips it if it is -1
+	pfd[3].fd = efd;	pfd[3].events = POLLIN;
+
+	while(!g_shutdown) {
+		z = poll(pfd, 4, -1);
+		if(z == -1) {
+			if(errno == EINTR) { continue; }
+			fprintf(stderr, "poll() failed: %s\n", strerror(errno));
 			break;
+		}
+
+		// HUP, INT, TERM and QUIT all mean the same thing
+		if(pfd[0].revents & POLLIN) {
+			if(read(sfd, &si, sizeof(si)) == sizeof(si)) { g_shutdown = 1; }
+		}
+
+		if(pfd[1].revents & POLLIN) {
+			if(read(tfd, &expirations, sizeof(expirations)) == sizeof(expirations)) { housekeeping(); }
+		}
+
+		if(pfd[2].revents & POLLIN) { catalog_events(ifd); }
+
+		// After the inotify events, so the files they added go out in this one
+		if(pfd[3].revents & POLLIN) {
+			catalog_notified(efd);
+			publish(pub);
+		}
 	}
+
+	close(tfd);
+	close(sfd);
 }
 
 int main(int argc, char **argv)
 {
-	int z;
+	int z, ifd, efd = -1;
+	sigset_t mask;
 	zmq_reply_t *zrep = NULL;
+	void *zctx = NULL, *pub = NULL;
 
 	srand(time(NULL));
 	tpad_gcinit(TPAD_GCRYPT_MINVERS);
@@ -67,24 +178,44 @@ int main(int argc, char **argv)
 	z = chdir(g_outputdir);
 	if(z == -1) { fprintf(stderr, "chdir(%s) failed: %s\n", g_outputdir, strerror(errno)); exit(1); }
 
-	zrep = as_zmq_reply_create(g_zmqaddr, tpad_cb, 0, 0, 0, NULL);
-	if(!zrep) {
-		fprintf(stderr, "as_zmq_reply_create(%s) failed!\n", g_zmqaddr);
+	g_chunkpool = bufpool_create(g_maxchunk, g_chunkbufs);
+	if(!g_chunkpool) {
+		fprintf(stderr, "bufpool_create(%d x %ld) failed!\n", g_chunkbufs, g_maxchunk);
 		return 1;
 	}
 
-	signal(SIGINT,		sig_handler);
-	signal(SIGTERM, 	sig_handler);
-	signal(SIGQUIT,		sig_handler);
-	signal(SIGHUP,		sig_handler);
-	//signal(SIGALRM,	sig_handler);
-	//alarm(1);
+	raise_nofile_limit();
+	block_signals(&mask);
+	xfer_init(g_maxactive);
+	ifd = catalog_init();
+
+	if(g_pubaddr) {
+		zctx = zmq_ctx_new();
+		pub = zctx ? zmq_socket(zctx, ZMQ_PUB) : NULL;
+		if(!pub || (zmq_bind(pub, g_pubaddr) != 0)) {
+			fprintf(stderr, "zmq_bind(%s) failed: %s\n", g_pubaddr, zmq_strerror(zmq_errno()));
+			return 1;
+		}
+		efd = catalog_notify();
+	}
+
+	zrep = as_zmq_reply_create_pool(g_zmqaddr, tpad_cb, 0, 0, g_workers, NULL);
+	if(!zrep) {
+		fprintf(stderr, "as_zmq_reply_create_pool(%s) failed!\n", g_zmqaddr);
+		return 1;
+	}
 
-	z=0;	// Wait for the sweet release of death
-	while(!g_shutdown) { if(z>999) { z=0; } usleep(1000); z++; }
+	// Wait for the sweet release of death
+	main_loop(&mask, ifd, pub, efd);
 
 	as_zmq_reply_destroy(zrep);
+	if(pub) { zmq_close(pub); }
+	if(zctx) { zmq_ctx_destroy(zctx); }
+	if(efd != -1) { close(efd); }
+	if(ifd != -1) { close(ifd); }
+	bufpool_destroy(g_chunkpool);
 	if(g_zmqaddr) free(g_zmqaddr);
+	if(g_pubaddr) free(g_pubaddr);
 	if(g_outputdir) free(g_outputdir);
 	return 0;
 }
@@ -94,6 +225,12 @@ struct options opts[] =
 	{ 1, "ZMQ",	"Set the ZMQ BIND address",			"Z", 1 },
 	{ 2, "dir",	"chdir() to save files in",			"d", 1 },
 	{ 3, "nc",	"Do not clobber existing files",	NULL, 0 },
+	{ 4, "workers",	"Number of worker threads",		"w", 1 },
+	{ 5, "bufs",	"Number of chunk buffers to send from",	NULL, 1 },
+	{ 6, "maxactive",	"Limit concurrent transfers (0 = no limit)",	NULL, 1 },
+	{ 7, "lease",	"Reap transfers idle for this many seconds (0 = never)",	NULL, 1 },
+	{ 8, "maxchunk",	"Largest chunk to take or serve (bytes)",	NULL, 1 },
+	{ 9, "pub",	"Tell absorb --follow about new files on this ZMQ PUB address",	NULL, 1 },
 	{ 0, NULL,	NULL,								NULL, 0 }
 };
 
@@ -122,6 +259,24 @@ static void parse_args(int argc, char **argv)
 			case 3:
 				g_noclobber = 1;
 				break;
+			case 4:
+				g_workers = atoi(args);
+				break;
+			case 5:
+				g_chunkbufs = atoi(args);
+				break;
+			case 6:
+				g_maxactive = atol(args);
+				break;
+			case 7:
+				g_lease = atol(args);
+				break;
+			case 8:
+				g_maxchunk = atol(args);
+				break;
+			case 9:
+				g_pubaddr = strdup(args);
+				break;
 			default:
 				fprintf(stderr, "Unexpected getopts Error! (%d)\n", c);
 				break;
@@ -141,6 +296,37 @@ static void parse_args(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if(g_workers < 1) {
+		fprintf(stderr, "I need at least 1 worker thread! (Fix with -w)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if((g_maxchunk < 1) || (g_maxchunk > MAXCHUNKLIMIT)) {
+		fprintf(stderr, "--maxchunk must be between 1 and %d!\n", MAXCHUNKLIMIT);
+		exit(EXIT_FAILURE);
+	}
+
+	// Spend about CHUNKPOOL_BYTES on the pool, whatever the chunk size
+	if(g_chunkbufs == 0) {
+		g_chunkbufs = CHUNKPOOL_BYTES / g_maxchunk;
+		if(g_chunkbufs < CHUNKPOOL_MINCOUNT) { g_chunkbufs = CHUNKPOOL_MINCOUNT; }
+	}
+
+	if(g_chunkbufs < 1) {
+		fprintf(stderr, "I need at least 1 chunk buffer! (Fix with --bufs)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_maxactive < 0) {
+		fprintf(stderr, "maxactive can not be negative! (Fix with --maxactive)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_lease < 0) {
+		fprintf(stderr, "lease can not be negative! (Fix with --lease)\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if(!is_dir(g_outputdir, 1)) {
 		//fprintf(stderr, "%s is not a directory!\n", g_outputdir);
 		exit(EXIT_FAILURE);
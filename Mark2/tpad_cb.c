@@ -28,6 +28,53 @@ void tpad_cmd(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4);
 void tpad_put(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4);
 void tpad_get(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4);
 void tpad_xfr(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4);
+void tpad_put_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t *payload);
+void tpad_xfr_bin(zmq_reply_t *r, tbin_hdr_t *hdr);
+void tpad_sum_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t *payload);
+void tpad_stream_bin(zmq_reply_t *r, tbin_hdr_t *hdr);
+void tpad_file_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t **pl, int plcnt);
+void tpad_batch_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t **pl, int plcnt);
+void tpad_stripe_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t *payload);
+void tpad_part_bin(zmq_reply_t *r, tbin_hdr_t *hdr);
+void tpad_join_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t *payload);
+
+static void tpad_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t **pl, int plcnt)
+{
+	zmq_mf_t *payload = (plcnt > 0) ? pl[0] : NULL;
+
+	switch(hdr->opcode) {
+		case TBIN_PUT:
+			tpad_put_bin(r, hdr, payload);
+			break;
+		case TBIN_XFR:
+			tpad_xfr_bin(r, hdr);
+			break;
+		case TBIN_SUM:
+			tpad_sum_bin(r, hdr, payload);
+			break;
+		case TBIN_STREAM:
+			tpad_stream_bin(r, hdr);
+			break;
+		case TBIN_FILE:
+			tpad_file_bin(r, hdr, pl, plcnt);
+			break;
+		case TBIN_BATCH:
+			tpad_batch_bin(r, hdr, pl, plcnt);
+			break;
+		case TBIN_STRIPE:
+			tpad_stripe_bin(r, hdr, payload);
+			break;
+		case TBIN_PART:
+			tpad_part_bin(r, hdr);
+			break;
+		case TBIN_JOIN:
+			tpad_join_bin(r, hdr, payload);
+			break;
+		default:
+			tpad_bin_error(r, __func__, hdr, "INVALID OPCODE");
+			break;
+	}
+}
 
 void tpad_cb(zmq_reply_t *r, zmq_mf_t **mpa, int msgcnt, void *user_data)
 {
@@ -37,9 +84,23 @@ void tpad_cb(zmq_reply_t *r, zmq_mf_t **mpa, int msgcnt, void *user_data)
 	zmq_mf_t *msg2;
 	zmq_mf_t *msg3;
 	zmq_mf_t *msg4;
+	tbin_hdr_t hdr;
 
 	if(!mpa) { return; }
-	if(msgcnt != 4) { return; }
+
+	// Binary traffic is a header frame and its payload frames
+	if((msgcnt >= 1) && mpa[0]) {
+		if(tbin_unpack(&hdr, mpa[0]->buf, mpa[0]->size) == 0) {
+			tpad_bin(r, &hdr, &mpa[1], msgcnt-1);
+			return;
+		}
+	}
+
+	// Tell the client, rather than leave it waiting on an answer
+	if(msgcnt != 4) {
+		tpad_error(r, __func__, "INVALID MESSAGE", NULL);
+		return;
+	}
 
 	msg1 = mpa[0];	if(!msg1) { return; }
 	msg2 = mpa[1];	if(!msg2) { return; }
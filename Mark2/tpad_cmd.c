@@ -19,182 +19,230 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
-#include <dirent.h>
+#include <time.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 
 #include "async_zmq_reply.h"
 #include "transporter.h"
 #include "futils.h"
 #include "tpad_error.h"
-#include "rnum.h"
+#include "xfer.h"
+#include "catalog.h"
+#include "tbin.h"
 
-typedef struct dirent dir_t;
+extern long g_maxchunk;
 
-static int regfilesonly(const dir_t *entry)
-{
-	// Filter to find all regular files
-	if(is_regfile(entry->d_name, 0) == 1) return 1;
+void tpad_claim(zmq_reply_t *r, int method, cat_filter_t *f);
 
-	// default deny
-	return 0;
-}
+// The longest order line plus filters we take in msg3
+#define SPEC_MAXLEN (2048)
 
-static int count_files(char *dir)
+// The METHOD for an order named on the wire, -1 if there is no such order
+static int order_method(char *order)
 {
-	int entries;
-	int retval = 0;
-	dir_t **farray = NULL;	// our array of directory entries
-
-	// scans dir for all files, use filter to weed out non-files
-	// then the alphasort function to sort, and put the result in g_mod_dirent
-	entries = scandir(dir, &farray, regfilesonly, alphasort);
-	if(entries < 0) { return -1; }
-
-	retval = entries;
+	if(strcmp(order, "random") == 0) { return RNDMETHOD; }
+	if(strcmp(order, "oldest") == 0) { return OLDMETHOD; }
+	if(strcmp(order, "newest") == 0) { return NEWMETHOD; }
+	if(strcmp(order, "largest") == 0) { return LRGMETHOD; }
+	if(strcmp(order, "smallest") == 0) { return SMLMETHOD; }
+	if(strcmp(order, "name") == 0) { return NAMMETHOD; }
+	return -1;
+}
 
-	//Loop to free all dir entries since scandir made malloc calls
-	if(entries > 0) {
-		while(entries--) { free(farray[entries]); }
-		free(farray);
+/*
+	CLAIMCMD and MANIFESTCMD take filters on the lines after the order in msg3, one "key=value" each:
+	glob=<fnmatch pattern> minsize=<bytes> maxsize=<bytes> older=<seconds> newer=<seconds>
+	older and newer go by the age of the file's mtime.
+	Cuts spec off after its first line and fills in f from the rest.
+	Returns the number of filters, -1 with errmsg saying why if one does not parse
+*/
+static int parse_filters(char *spec, cat_filter_t *f, char *errmsg, size_t len)
+{
+	int n = 0;
+	char *line, *val, *tmp;
+	time_t now;
+
+	catalog_filter_init(f);
+	line = strchr(spec, '\n');
+	if(!line) { return 0; }
+	*line++ = 0;
+
+	now = time(NULL);
+	for(line=strtok_r(line, "\n", &tmp); line; line=strtok_r(NULL, "\n", &tmp)) {
+		val = strchr(line, '=');
+		if(!val) { snprintf(errmsg, len, "INVALID FILTER: %.64s", line); return -1; }
+		*val++ = 0;
+
+		if(strcmp(line, "glob") == 0) {
+			f->glob = val;
+		} else if(strcmp(line, "minsize") == 0) {
+			f->minsize = atol(val);
+		} else if(strcmp(line, "maxsize") == 0) {
+			f->maxsize = atol(val);
+		} else if(strcmp(line, "older") == 0) {
+			f->maxmtime = now - atol(val);
+		} else if(strcmp(line, "newer") == 0) {
+			f->minmtime = now - atol(val);
+		} else {
+			snprintf(errmsg, len, "INVALID FILTER: %.64s", line);
+			return -1;
+		}
+		n++;
 	}
 
-	return retval;
+	return n;
 }
 
 static void do_count(zmq_reply_t *r)
 {
-	int n, filecount;
-	char errmsg[128];
+	int n;
 	char resp[24];
 	char empty[4];
 
-	filecount = count_files(".");
-	if(filecount < 0) {
-		snprintf(errmsg, sizeof(errmsg), "ERROR COUNTING FILES");
-		tpad_error(r, __func__, errmsg, NULL);
-		return;
-	}
-
-	n = snprintf(resp, sizeof(resp), "%d", filecount);
+	n = snprintf(resp, sizeof(resp), "%ld", catalog_count(NULL));
 	memset(empty, 0, sizeof(empty));
 	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
 	(void) as_zmq_reply_send(r, resp,		n+1,				1);
 	(void) as_zmq_reply_send(r, empty,		1,					0);
 }
 
-// https://stackoverflow.com/questions/31633943/compare-two-times-in-c
-// http://www.cplusplus.com/reference/ctime/difftime/
-int oldestfirst(const struct dirent **d1, const struct dirent **d2)
+// files and bytes come from the catalog, like COUNTCMD they never touch the disk
+static void do_stats(zmq_reply_t *r)
 {
-	struct stat s1, s2;
-	const char *p1, *p2;
-
-	p1 = (*d1)->d_name;
-	p2 = (*d2)->d_name;
-	if(stat(p1, &s1) == 0) {
-		if(stat(p2, &s2) == 0) {
-			if(s1.st_mtime > s2.st_mtime) { return 1; }
-			if(s2.st_mtime > s1.st_mtime) { return -1; }
-		}
-	}
+	int n;
+	long files, bytes;
+	char resp[256];
+	char empty[4];
 
-	return 0;
+	files = catalog_count(&bytes);
+	n = snprintf(resp, sizeof(resp), "active=%lu reaped=%lu files=%ld bytes=%ld claimed=%ld",
+		xfer_active(), xfer_reaped(), files, bytes, catalog_nclaimed());
+	memset(empty, 0, sizeof(empty));
+	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
+	(void) as_zmq_reply_send(r, resp,		n+1,				1);
+	(void) as_zmq_reply_send(r, empty,		1,					0);
 }
 
-int newestfirst(const struct dirent **d1, const struct dirent **d2)
+/*
+	msg3: "<order> [count]", order is one of oldest newest largest smallest name (or random),
+	optionally followed by filters (see parse_filters())
+	msg4: the cursor from the previous page, empty for the first one
+	The reply is a listing of "size mtime name\n" lines and the cursor for the next page,
+	which is empty once the listing has reached the end of the spool.
+	The cursor is the sort key and name of the last entry, so files that come and go
+	between pages do not make the next one skip or repeat anything.
+	Ties are broken by name, backwards for newest and largest
+*/
+static void do_manifest(zmq_reply_t *r, zmq_mf_t *msg3, zmq_mf_t *msg4)
 {
-	struct stat s1, s2;
-	const char *p1, *p2;
-
-	p1 = (*d1)->d_name;
-	p2 = (*d2)->d_name;
-	if(stat(p1, &s1) == 0) {
-		if(stat(p2, &s2) == 0) {
-			if(s1.st_mtime > s2.st_mtime) { return -1; }
-			if(s2.st_mtime > s1.st_mtime) { return 1; }
-		}
+	int method, nf;
+	long i, n, count, ckey = 0;
+	size_t len, max;
+	char *resp, *tmp, *cname;
+	char order[SPEC_MAXLEN];
+	char cursor[1024+32];
+	char next[1024+32];
+	char errmsg[128];
+	cat_item_t *list, *e;
+	cat_filter_t f;
+
+	memset(order, 0, sizeof(order));
+	memset(cursor, 0, sizeof(cursor));
+	snprintf(order, sizeof(order), "%.*s", (int)msg3->size, (char *)msg3->buf);
+	nf = parse_filters(order, &f, errmsg, sizeof(errmsg));
+	if(nf < 0) {
+		tpad_error(r, __func__, errmsg, NULL);
+		return;
 	}
 
-	return 0;
-}
+	count = MANIFEST_PAGE;
+	tmp = strchr(order, ' ');
+	if(tmp) { *tmp = 0; count = atol(tmp+1); }
+	if(msg4->size > 0) { snprintf(cursor, sizeof(cursor), "%.*s", (int)msg4->size, (char *)msg4->buf); }
+	if((count < 1) || (count > MANIFEST_MAXPAGE)) { count = MANIFEST_MAXPAGE; }
 
-int largestfirst(const struct dirent **d1, const struct dirent **d2)
-{
-	struct stat s1, s2;
-	const char *p1, *p2;
-
-	p1 = (*d1)->d_name;
-	p2 = (*d2)->d_name;
-	if(stat(p1, &s1) == 0) {
-		if(stat(p2, &s2) == 0) {
-			if(s1.st_size > s2.st_size) { return -1; }
-			if(s2.st_size > s1.st_size) { return 1; }
+	// random lists by name, it is up to the client to shuffle
+	method = order_method(order);
+	if(method < 0) {
+		snprintf(errmsg, sizeof(errmsg), "INVALID ORDER: %.64s", order);
+		tpad_error(r, __func__, errmsg, NULL);
+		return;
+	}
+
+	// Pick up right after the cursor
+	cname = strchr(cursor, ' ');
+	if(cname) { ckey = atol(cursor); cname++; }
+
+	// Ask for one more than we send, to know if this page reaches the end
+	list = malloc((count+1) * sizeof(cat_item_t));
+	if(!list) {
+		tpad_error(r, __func__, "OUT OF MEMORY", NULL);
+		return;
+	}
+	n = catalog_page(method, nf ? &f : NULL, ckey, cname, list, count+1);
+
+	len = 0;
+	max = 4096;
+	resp = malloc(max);
+	next[0] = 0;
+	for(i=0; resp && (i<n) && (i<count); i++) {
+		e = &list[i];
+		if((max - len) < (strlen(e->name) + 64)) {
+			max *= 2;
+			tmp = realloc(resp, max);
+			if(!tmp) { free(resp); resp = NULL; break; }
+			resp = tmp;
 		}
+		len += snprintf(resp+len, max-len, "%ld %ld %s\n", e->size, (long)e->mtime, e->name);
+		if(n > count) { snprintf(next, sizeof(next), "%ld %s", catalog_key(e, method), e->name); }
 	}
 
-	return 0;
+	for(i=0; i<n; i++) { free(list[i].name); }
+	free(list);
+
+	if(!resp) {
+		tpad_error(r, __func__, "OUT OF MEMORY", NULL);
+		return;
+	}
+
+	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
+	(void) as_zmq_reply_send(r, resp,		len+1,				1);
+	(void) as_zmq_reply_send(r, next,		strlen(next)+1,		0);
+	free(resp);
 }
 
-int smallestfirst(const struct dirent **d1, const struct dirent **d2)
+// The client tells us the newest binary framing it speaks, we answer with the one we will use
+// and the largest chunk we serve. A tpad without HELLOCMD answers ERR and the client stays on ASCII
+static void do_hello(zmq_reply_t *r, char *version)
 {
-	struct stat s1, s2;
-	const char *p1, *p2;
-
-	p1 = (*d1)->d_name;
-	p2 = (*d2)->d_name;
-	if(stat(p1, &s1) == 0) {
-		if(stat(p2, &s2) == 0) {
-			if(s1.st_size > s2.st_size) { return 1; }
-			if(s2.st_size > s1.st_size) { return -1; }
-		}
-	}
+	int n, v;
+	char vers[16];
+	char maxchunk[32];
+
+	v = atoi(version);
+	if(v > TBIN_PROTO) { v = TBIN_PROTO; }
+	if(v < 0) { v = 0; }
 
-	return 0;
+	n = snprintf(vers, sizeof(vers), "%d", v);
+	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
+	(void) as_zmq_reply_send(r, vers,		n+1,				1);
+	n = snprintf(maxchunk, sizeof(maxchunk), "%ld", g_maxchunk);
+	(void) as_zmq_reply_send(r, maxchunk,	n+1,				0);
 }
 
-static void pick_file(zmq_reply_t *r, char *dir, int method)
+static void pick_file(zmq_reply_t *r, int method)
 {
-	int entries, which, n;
+	int n;
 	char errmsg[128];
 	char resp[1024+1];
 	char empty[4];
-	dir_t **farray = NULL;	// our array of directory entries
-
-	// scans dir for all files, use filter to weed out non-files
-	// then the used a specified sorting function to sort
-	if(method == OLDMETHOD) {
-		entries = scandir(dir, &farray, regfilesonly, oldestfirst);
-	} else if(method == NEWMETHOD) {
-		entries = scandir(dir, &farray, regfilesonly, newestfirst);
-	} else if(method == LRGMETHOD) {
-		entries = scandir(dir, &farray, regfilesonly, largestfirst);
-	} else if(method == SMLMETHOD) {
-		entries = scandir(dir, &farray, regfilesonly, smallestfirst);
-	} else {
-		entries = scandir(dir, &farray, regfilesonly, alphasort);
-	}
-
-	if(entries < 0) {
-		snprintf(errmsg, sizeof(errmsg), "scandir() FAILED");
-		tpad_error(r, __func__, errmsg, NULL);
-		return;
-	}
 
-	//Loop to free all dir entries since scandir made malloc calls
-	if(entries > 0) {
-		which = 0;
-		if(method == RNDMETHOD) { which = rpick(entries); }
-		n = snprintf(resp, sizeof(resp), "%s", farray[which]->d_name);
-		while(entries--) { free(farray[entries]); }
-		free(farray);
-	} else {
-		snprintf(errmsg, sizeof(errmsg), "ZERO FILES AVAILABLE");
+	if(catalog_pick(method, resp, sizeof(resp))) {
+		snprintf(errmsg, sizeof(errmsg), "%s", NOFILESMSG);
 		tpad_error(r, __func__, errmsg, NULL);
 		return;
 	}
+	n = strlen(resp);
 
 	memset(empty, 0, sizeof(empty));
 	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
@@ -202,6 +250,31 @@ static void pick_file(zmq_reply_t *r, char *dir, int method)
 	(void) as_zmq_reply_send(r, empty,		1,					0);
 }
 
+// msg3 is the order to claim in (random if it is empty) and any filters
+static void do_claim(zmq_reply_t *r, zmq_mf_t *msg3)
+{
+	int method, nf;
+	char order[SPEC_MAXLEN];
+	char errmsg[128];
+	cat_filter_t f;
+
+	snprintf(order, sizeof(order), "%.*s", (int)msg3->size, (char *)msg3->buf);
+	nf = parse_filters(order, &f, errmsg, sizeof(errmsg));
+	if(nf < 0) {
+		tpad_error(r, __func__, errmsg, NULL);
+		return;
+	}
+
+	method = order[0] ? order_method(order) : RNDMETHOD;
+	if(method < 0) {
+		snprintf(errmsg, sizeof(errmsg), "INVALID ORDER: %.64s", order);
+		tpad_error(r, __func__, errmsg, NULL);
+		return;
+	}
+
+	tpad_claim(r, method, nf ? &f : NULL);
+}
+
 void tpad_cmd(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4)
 {
 	char *cmd;
@@ -223,28 +296,48 @@ void tpad_cmd(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4)
 		return;
 	}
 
+	if(strcmp(cmd, STATSCMD) == 0) {
+		do_stats(r);
+		return;
+	}
+
+	if(strcmp(cmd, HELLOCMD) == 0) {
+		do_hello(r, (char *)msg3->buf);
+		return;
+	}
+
+	if(strcmp(cmd, MANIFESTCMD) == 0) {
+		do_manifest(r, msg3, msg4);
+		return;
+	}
+
+	if(strcmp(cmd, CLAIMCMD) == 0) {
+		do_claim(r, msg3);
+		return;
+	}
+
 	if(strcmp(cmd, RANDOMCMD) == 0) {
-		pick_file(r, ".", RNDMETHOD);
+		pick_file(r, RNDMETHOD);
 		return;
 	}
 
 	if(strcmp(cmd, OLDESTCMD) == 0) {
-		pick_file(r, ".", OLDMETHOD);
+		pick_file(r, OLDMETHOD);
 		return;
 	}
 
 	if(strcmp(cmd, NEWESTCMD) == 0) {
-		pick_file(r, ".", NEWMETHOD);
+		pick_file(r, NEWMETHOD);
 		return;
 	}
 
 	if(strcmp(cmd, LARGESTCMD) == 0) {
-		pick_file(r, ".", LRGMETHOD);
+		pick_file(r, LRGMETHOD);
 		return;
 	}
 
 	if(strcmp(cmd, SMALLESTCMD) == 0) {
-		pick_file(r, ".", SMLMETHOD);
+		pick_file(r, SMLMETHOD);
 		return;
 	}
 
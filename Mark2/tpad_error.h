@@ -23,8 +23,9 @@
 
 #include "transporter.h"
 #include "async_zmq_reply.h"
+#include "tbin.h"
 
-static void tpad_error(zmq_reply_t *r, const char *func, char *msg1, char *msg2)
+static inline void tpad_error(zmq_reply_t *r, const char *func, char *msg1, char *msg2)
 {
 	char empty[4];
 
@@ -44,4 +45,16 @@ static void tpad_error(zmq_reply_t *r, const char *func, char *msg1, char *msg2)
 	}
 }
 
+// The binary counterpart of tpad_error(), the reply echoes the request with TBIN_ERRBIT set
+static inline void tpad_bin_error(zmq_reply_t *r, const char *func, tbin_hdr_t *req, char *msg)
+{
+	tbin_hdr_t h;
+
+	fprintf(stderr, "%s(): %s\n", func, msg);
+
+	tbin_pack(&h, (req->opcode | TBIN_ERRBIT), req->id, req->offset, strlen(msg)+1);
+	(void) as_zmq_reply_send(r, &h,		TBIN_HDRSIZE,	1);
+	(void) as_zmq_reply_send(r, msg,	strlen(msg)+1,	0);
+}
+
 #endif
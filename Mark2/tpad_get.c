@@ -29,9 +29,68 @@
 #include "tpad_error.h"
 #include "gchelper.h"
 #include "xfer.h"
+#include "catalog.h"
 
 typedef struct dirent dir_t;
 
+// Check filename, then open a transfer to read it.
+// Returns the xfer locked, or NULL with errmsg saying why
+static xfer_t* get_open(char *filename, char *errmsg, size_t len)
+{
+	int z;
+	long size;
+	xfer_t *xp;
+
+	// A subpath has to stay inside the spool
+	if(path_security_check(filename) || path_safe_join(filename, 0)) {
+		snprintf(errmsg, len, "INVALID FILENAME %s", filename);
+		return NULL;
+	}
+
+	size = file_size(filename, 0);
+	if(size <= 0) {
+		snprintf(errmsg, len, "BAD FILESIZE: %ld(%s)", size, filename);
+		return NULL;
+	}
+
+	// Find an open transfer slot, then
+	// Make a new entry with filename, filesize, uuid, current offset
+	xp = xfer_new(filename, "r");
+	if(!xp) {
+		snprintf(errmsg, len, "Could not get open xfer slot for %s", filename);
+		return NULL;
+	}
+
+#ifdef DEBUG
+	printf("%s(): %s %s(%ld/%s)\n", __func__, "XFER", filename, size, xp->uuid);
+#endif
+
+	z = gcfile_enable(xp->gcf, TPAD_HASH_ALG);
+	if(z != 0) {
+		snprintf(errmsg, len, "gcfile_enable(%d) failed: %s", TPAD_HASH_ALG, GCFILE_GETERRMSG(xp->gcf));
+		xfer_complete(xp, 0);
+		return NULL;
+	}
+
+	// Fill in the details
+	xp->size = size;
+	xp->offset = 0L;
+	return xp;
+}
+
+// [OK][filename][filesize][uuid], for GET and CLAIMCMD alike
+static void get_reply(zmq_reply_t *r, xfer_t *xp, char *filename)
+{
+	char filesize[24];
+
+	snprintf(filesize, sizeof(filesize), "%ld", xp->size);
+	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
+	(void) as_zmq_reply_send(r, filename,	strlen(filename)+1,	1);
+	(void) as_zmq_reply_send(r, filesize,	strlen(filesize)+1,	1);
+	(void) as_zmq_reply_send(r, xp->uuid,	strlen(xp->uuid)+1,	0);
+	xfer_release(xp);
+}
+
 /*	absorb.c
 	z = zmq_send(s, TCMD_GET,	strlen(TCMD_GET)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, freq,		strlen(freq)+1,		ZMQ_SNDMORE);
@@ -40,10 +99,7 @@ typedef struct dirent dir_t;
 */
 static void get_file(zmq_reply_t *r, char *filename)
 {
-	int z;
-	long size;
 	xfer_t *xp;
-	char filesize[24];
 	char errmsg[1536];
 
 /*
@@ -52,49 +108,65 @@ static void get_file(zmq_reply_t *r, char *filename)
 #endif
 */
 
-	if(file_security_check(filename)) {
+	// Only a name inside the spool gets into the catalog, even for as long as a hold
+	if(path_security_check(filename) || path_safe_join(filename, 0)) {
 		snprintf(errmsg, sizeof(errmsg), "INVALID FILENAME %s", filename);
 		tpad_error(r, __func__, errmsg, NULL);
 		return;
 	}
 
-	size = file_size(filename, 0);
-	if(size <= 0) {
-		snprintf(errmsg, sizeof(errmsg), "BAD FILESIZE: %ld(%s)", size, filename);
+	// Hold it before it is opened, so nobody can write over it or claim it in between
+	if(catalog_hold(filename) != 0) {
+		snprintf(errmsg, sizeof(errmsg), "FILE IS CLAIMED %s", filename);
 		tpad_error(r, __func__, errmsg, NULL);
 		return;
 	}
 
-	// Find an open transfer slot, then
-	// Make a new entry with filename, filesize, uuid, current offset
-	xp = xfer_new(filename, "r");
+	xp = get_open(filename, errmsg, sizeof(errmsg));
 	if(!xp) {
-		snprintf(errmsg, sizeof(errmsg), "Could not get open xfer slot for %s", filename);
+		catalog_unclaim(filename);
 		tpad_error(r, __func__, errmsg, NULL);
 		return;
 	}
+	// The hold ends with the transfer, like a claim
+	xp->claimed = 1;
 
-#ifdef DEBUG
-	printf("%s(): %s %s(%ld/%s)\n", __func__, "XFER", filename, size, xp->uuid);
-#endif
+	get_reply(r, xp, filename);
+}
 
-	z = gcfile_enable(&xp->gcf, TPAD_HASH_ALG);
-	if(z != 0) {
-		xfer_complete(xp, 0);
-		snprintf(errmsg, sizeof(errmsg), "gcfile_enable(%d) failed: %s", TPAD_HASH_ALG, GCFILE_GETERRMSG(&xp->gcf));
+/*	absorb.c
+	z = zmq_send(s, TCMD_CMD,	strlen(TCMD_CMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, CLAIMCMD,	strlen(CLAIMCMD)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, spec,		strlen(spec)+1,		ZMQ_SNDMORE);
+	z = zmq_send(s, empty,		1,					0);
+	Pick the next file by method (that passes f) and open it in one go, the reply is the same as a GET.
+	The file stays hidden from everyone else until its transfer completes,
+	or is reaped after --lease seconds without a request and goes back to the spool
+*/
+void tpad_claim(zmq_reply_t *r, int method, cat_filter_t *f)
+{
+	xfer_t *xp;
+	char filename[1024+1];
+	char errmsg[1536];
+
+	if(catalog_claim(method, f, filename, sizeof(filename))) {
+		tpad_error(r, __func__, NOFILESMSG, NULL);
+		return;
+	}
+
+	xp = get_open(filename, errmsg, sizeof(errmsg));
+	if(!xp) {
+		catalog_unclaim(filename);
 		tpad_error(r, __func__, errmsg, NULL);
 		return;
 	}
+	xp->claimed = 1;
 
-	// Fill in the details
-	xp->size = size;
-	xp->offset = 0L;
+#ifdef DEBUG
+	printf("%s(): %s %s(%s)\n", __func__, "CLAIM", filename, xp->uuid);
+#endif
 
-	snprintf(filesize, sizeof(filesize), "%ld", size);
-	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
-	(void) as_zmq_reply_send(r, filename,	strlen(filename)+1,	1);
-	(void) as_zmq_reply_send(r, filesize,	strlen(filesize)+1,	1);
-	(void) as_zmq_reply_send(r, xp->uuid,	strlen(xp->uuid)+1,	0);
+	get_reply(r, xp, filename);
 }
 
 void tpad_get(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4)
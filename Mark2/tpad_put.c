@@ -28,105 +28,237 @@
 #include "tpad_error.h"
 #include "gchelper.h"
 #include "xfer.h"
+#include "catalog.h"
+#include "tbin.h"
 
 extern int g_noclobber;
+extern long g_maxchunk;
 
-/*	beam.c
-	z = zmq_send(s, TCMD_PUT,	strlen(TCMD_PUT)+1,	ZMQ_SNDMORE);
-	z = zmq_send(s, uuid,		strlen(uuid)+1,		ZMQ_SNDMORE);
-	z = zmq_send(s, filename,	strlen(filename)+1,	ZMQ_SNDMORE);
-	z = zmq_send(s, filesize,	strlen(filesize)+1,	0);
-*/
-void tpad_put_new(zmq_reply_t *r, char *filename, char *filesize)
+// Check filename and size, then open a transfer to write it.
+// Returns the xfer locked, or NULL with errmsg saying why
+xfer_t* put_open(char *filename, long size, char *errmsg, size_t len)
 {
 	int z, file_exists;
-	long size;
 	xfer_t *xp;
-	char offset[24];
-	char errmsg[1536];
-
-#ifdef DEBUG
-	printf("%s(): %s %s(%s)\n", __func__, "PUT", filename, filesize);
-#endif
 
-	if(file_security_check(filename)) {
-		snprintf(errmsg, sizeof(errmsg), "INVALID FILENAME %s", filename);
-		tpad_error(r, __func__, errmsg, NULL);
-		return;
+	if(path_security_check(filename)) {
+		snprintf(errmsg, len, "INVALID FILENAME %s", filename);
+		return NULL;
 	}
 
-	size = atol(filesize);
 	if(size <= 0) {
-		snprintf(errmsg, sizeof(errmsg), "BAD FILESIZE: %s", filesize);
-		tpad_error(r, __func__, errmsg, NULL);
-		return;
+		snprintf(errmsg, len, "BAD FILESIZE: %ld", size);
+		return NULL;
 	}
 
 	// If server is set to no_clobber, error if file exists
 	if(g_noclobber) {
 		file_exists = is_regfile(filename, 0);
 		if(file_exists != -1) {
-			snprintf(errmsg, sizeof(errmsg), "Server will not clobber %s", filename);
-			tpad_error(r, __func__, errmsg, NULL);
-			return;
+			snprintf(errmsg, len, "Server will not clobber %s", filename);
+			return NULL;
 		}
 	}
 
+	// A subpath gets the dirs it needs, as long as none of them is a symlink out of the spool
+	if(path_safe_join(filename, 1)) {
+		snprintf(errmsg, len, "INVALID PATH %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+
+	// Hold it before "w" truncates it: somebody pulling it would be handed a different file,
+	// and a file we are overwriting is not there to be picked until it is complete again
+	if(catalog_hold(filename) != 0) {
+		snprintf(errmsg, len, "FILE IS CLAIMED %s", filename);
+		return NULL;
+	}
+
 	// Find an open transfer slot, then
 	// Make a new entry with filename, filesize, uuid, current offset
 	xp = xfer_new(filename, "w");
 	if(!xp) {
-		snprintf(errmsg, sizeof(errmsg), "Could not get open xfer slot for %s", filename);
-		tpad_error(r, __func__, errmsg, NULL);
-		return;
+		catalog_unclaim(filename);
+		snprintf(errmsg, len, "Could not get open xfer slot for %s", filename);
+		return NULL;
 	}
+	// The hold ends with the transfer, like a claim
+	xp->claimed = 1;
 
 #ifdef DEBUG
 	printf("%s(): %s %s(%s)\n", __func__, "XFER", filename, xp->uuid);
 #endif
 
-/*
-	GCFILE_INIT(&newfile);
-	z = gcfile_open(&newfile, );
-	if(z != 0) {
-		snprintf(errmsg, sizeof(errmsg), "%s", gcfile_geterrmsg(&newfile));
-		tpad_error(r, __func__, errmsg, NULL);
-		return;
-	}
-*/
-
-	z = gcfile_enable(&xp->gcf, TPAD_HASH_ALG);
+	z = gcfile_enable(xp->gcf, TPAD_HASH_ALG);
 	if(z != 0) {
+		snprintf(errmsg, len, "gcfile_enable(%d) failed: %s", TPAD_HASH_ALG, GCFILE_GETERRMSG(xp->gcf));
 		xfer_complete(xp, 0);
-		snprintf(errmsg, sizeof(errmsg), "gcfile_enable(%d) failed: %s", TPAD_HASH_ALG, GCFILE_GETERRMSG(&xp->gcf));
-		tpad_error(r, __func__, errmsg, NULL);
-		return;
+		return NULL;
 	}
 
 	// Fill in the details
 	xp->size = size;
 	xp->offset = 0L;
+	return xp;
+}
+
+/*	beam.c
+	z = zmq_send(s, TCMD_PUT,	strlen(TCMD_PUT)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, uuid,		strlen(uuid)+1,		ZMQ_SNDMORE);
+	z = zmq_send(s, filename,	strlen(filename)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, filesize,	strlen(filesize)+1,	0);
+*/
+void tpad_put_new(zmq_reply_t *r, char *filename, char *filesize)
+{
+	xfer_t *xp;
+	char offset[24];
+	char errmsg[1536];
+
+#ifdef DEBUG
+	printf("%s(): %s %s(%s)\n", __func__, "PUT", filename, filesize);
+#endif
+
+	xp = put_open(filename, atol(filesize), errmsg, sizeof(errmsg));
+	if(!xp) {
+		tpad_error(r, __func__, errmsg, NULL);
+		return;
+	}
 
 	snprintf(offset, sizeof(offset), "%ld", xp->offset);
 	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1, 1);
 	(void) as_zmq_reply_send(r, xp->uuid,	strlen(xp->uuid)+1, 1);
 	(void) as_zmq_reply_send(r, offset,		strlen(offset)+1, 0);
+	xfer_release(xp);
 }
 
 /*	beam.c
 	z = zmq_send(s, TCMD_PUT,	strlen(TCMD_PUT)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, g_uuid,		strlen(g_uuid)+1,	ZMQ_SNDMORE);
 	z = zmq_send(s, buf,		bytes,				ZMQ_SNDMORE);
-	z = zmq_send(s, empty,		1,	0);
+	z = zmq_send(s, offset,		strlen(offset)+1,	0);
+	An empty offset means "right after the last chunk" (sequential beam)
+	beam can have several chunks in flight and the workers can take them in any order,
+	so a chunk that arrives early is held until the ones before it are written.
+	The reply always carries how far the file has been written
 */
-void tpad_put_chunk(zmq_reply_t *r, char *uuid, zmq_mf_t *msg3)
+static int put_write(xfer_t *xp, void *buf, long bytes, char *errmsg, size_t len)
 {
-	xfer_t *xp;
 	long written;
+
+	written = gcfile_write(xp->gcf, buf, bytes);
+	if(written != bytes) {
+		snprintf(errmsg, len, "written(%ld) != bytes(%ld)", written, bytes);
+		return 1;
+	}
+
+	xp->offset += written;
+	return 0;
+}
+
+// Write chunk at chunkoff, or hold it if the chunks in front of it have not arrived yet.
+// On error xp is released and errmsg says why
+static int put_chunk(xfer_t *xp, long chunkoff, zmq_mf_t *chunk, char *errmsg, size_t len)
+{
+	int z;
+	xfer_chunk_t *c;
+
+#ifdef DEBUG
+	printf("%s(): %s %s(%lu@%ld)\n", __func__, "PUT", GCFILE_GETPATH(xp->gcf), chunk->size, chunkoff);
+#endif
+
+	// A file sent in parts is only written through its parts
+	if(xp->stripes) {
+		xfer_release(xp);
+		snprintf(errmsg, len, "STRIPED: %ld", chunkoff);
+		return 1;
+	}
+
+	if((chunkoff < xp->offset) || ((chunkoff + (long)chunk->size) > xp->size)) {
+		xfer_release(xp);
+		snprintf(errmsg, len, "BAD OFFSET: %ld", chunkoff);
+		return 1;
+	}
+
+	if((long)chunk->size > g_maxchunk) {
+		xfer_release(xp);
+		snprintf(errmsg, len, "CHUNK TOO LARGE: %lu", chunk->size);
+		return 1;
+	}
+
+	if(chunkoff > xp->offset) {
+		z = xfer_stash(xp, chunkoff, &chunk->msg);
+		if(z) {
+			xfer_release(xp);
+			snprintf(errmsg, len, "CAN NOT HOLD CHUNK: %ld", chunkoff);
+			return 1;
+		}
+		return 0;
+	}
+
+	// Nor may it run into a chunk that is already held
+	if(xp->pending && ((chunkoff + (long)chunk->size) > xp->pending->offset)) {
+		xfer_release(xp);
+		snprintf(errmsg, len, "OVERLAPPING CHUNK: %ld", chunkoff);
+		return 1;
+	}
+
+	z = put_write(xp, chunk->buf, chunk->size, errmsg, len);
+	// Write out whatever was waiting on this chunk
+	while((z == 0) && (c = xfer_unstash(xp, xp->offset))) {
+		z = put_write(xp, zmq_msg_data(&c->msg), zmq_msg_size(&c->msg), errmsg, len);
+		xfer_chunk_free(c);
+	}
+	if(z) { xfer_release(xp); }
+
+	return z;
+}
+
+// Hand xp back. If that was the last chunk, close it out and return 1
+// with the hash (hex) and/or the digest (binary) filled in
+static int put_done(xfer_t *xp, char *hash, unsigned char *digest)
+{
+	char *hashptr;
+
+	if(xp->offset != xp->size) {
+		xfer_release(xp);
+		return 0;
+	}
+
+	if(hash) {
+		hashptr = gcfile_get_hash(xp->gcf, TPAD_HASH_ALG);
+		snprintf(hash, TPAD_HASH_SIZE+1, "%s", hashptr);
+		free(hashptr);
+	}
+	if(digest) {
+		memcpy(digest, gcfile_get_digest(xp->gcf, TPAD_HASH_ALG), TPAD_DIGEST_SIZE);
+	}
+
+	// A part hands its digest to the file it belongs to
+	if(xp->parent) {
+		xfer_part_done(xp->parent, xp->part, gcfile_get_digest(xp->gcf, TPAD_HASH_ALG));
+		xp->parent = 0;
+	}
+
+	xfer_complete(xp, 0);
+	return 1;
+}
+
+/*	beam.c
+	z = zmq_send(s, TCMD_PUT,	strlen(TCMD_PUT)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, g_uuid,		strlen(g_uuid)+1,	ZMQ_SNDMORE);
+	z = zmq_send(s, buf,		bytes,				ZMQ_SNDMORE);
+	z = zmq_send(s, offset,		strlen(offset)+1,	0);
+	An empty offset means "right after the last chunk" (sequential beam)
+	beam can have several chunks in flight and the workers can take them in any order,
+	so a chunk that arrives early is held until the ones before it are written.
+	The reply always carries how far the file has been written
+*/
+void tpad_put_chunk(zmq_reply_t *r, char *uuid, zmq_mf_t *msg3, zmq_mf_t *msg4)
+{
+	xfer_t *xp;
+	long chunkoff;
 	char offset[24];
 	char errmsg[64];
 	char hash[TPAD_HASH_SIZE+1];
-	char *hashptr;
 
 	// FIND UUID
 	xp = xfer_find_uuid(uuid);
@@ -136,34 +268,164 @@ void tpad_put_chunk(zmq_reply_t *r, char *uuid, zmq_mf_t *msg3)
 		return;
 	}
 
-#ifdef DEBUG
-	printf("%s(): %s %s(%lu)\n", __func__, "PUT", GCFILE_GETPATH(&xp->gcf), msg3->size);
-#endif
+	chunkoff = xp->offset;
+	if(msg4->size > 1) { chunkoff = atol((char *)msg4->buf); }
 
-	written = gcfile_write(&xp->gcf, msg3->buf, msg3->size);
-	if(written == msg3->size) {
-		xp->offset += written;
-		snprintf(offset, sizeof(offset), "%ld", xp->offset);
-	} else {
-		snprintf(errmsg, sizeof(errmsg), "written(%ld) != bytes(%ld)", written, msg3->size);
+	if(put_chunk(xp, chunkoff, msg3, errmsg, sizeof(errmsg))) {
 		tpad_error(r, __func__, errmsg, NULL);
 		return;
 	}
+	snprintf(offset, sizeof(offset), "%ld", xp->offset);
 
 	// Check for completion
 	memset(hash, 0, sizeof(hash));
-	if(xp->offset == xp->size) {
-		hashptr = gcfile_get_hash(&xp->gcf, TPAD_HASH_ALG);
-		snprintf(hash, sizeof(hash), "%s", hashptr);
-		free(hashptr);
-		xfer_complete(xp, 0);
-	}
+	(void) put_done(xp, hash, NULL);
 
 	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1, 1);
 	(void) as_zmq_reply_send(r, offset,		strlen(offset)+1, 1);
 	(void) as_zmq_reply_send(r, hash,		strlen(hash)+1, 0);
 }
 
+void tpad_put_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t *payload)
+{
+	xfer_t *xp;
+	int done;
+	long offset;
+	tbin_hdr_t h;
+	char errmsg[64];
+	unsigned char digest[TPAD_DIGEST_SIZE];
+
+	if(!payload || (payload->size != hdr->length)) {
+		tpad_bin_error(r, __func__, hdr, "BAD LENGTH");
+		return;
+	}
+
+	xp = xfer_find(hdr->id);
+	if(!xp) {
+		snprintf(errmsg, sizeof(errmsg), "UNKNOWN ID: %lu", (unsigned long)hdr->id);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	if(put_chunk(xp, (long)hdr->offset, payload, errmsg, sizeof(errmsg))) {
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+	offset = xp->offset;
+
+	done = put_done(xp, NULL, digest);
+	tbin_pack(&h, TBIN_PUT, hdr->id, offset, done ? TPAD_DIGEST_SIZE : 0);
+	(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, done);
+	if(done) { (void) as_zmq_reply_send(r, digest, TPAD_DIGEST_SIZE, 0); }
+}
+
+// Write a whole file from its [filename][data][digest] frames.
+// The file is only kept if its digest matches the one that came with it.
+// Returns 0 once it is written, on error errmsg says why
+static int put_whole(zmq_mf_t *name, zmq_mf_t *data, zmq_mf_t *digest, char *errmsg, size_t len)
+{
+	xfer_t *xp;
+	char filename[1024+1];
+
+	if((name->size < 1) || (name->size > sizeof(filename)-1) || (digest->size != TPAD_DIGEST_SIZE)) {
+		snprintf(errmsg, len, "BAD FILE MESSAGE");
+		return 1;
+	}
+
+	memcpy(filename, name->buf, name->size);
+	filename[name->size] = 0;
+
+#ifdef DEBUG
+	printf("%s(): %s %s(%lu)\n", __func__, "FILE", filename, data->size);
+#endif
+
+	xp = put_open(filename, (long)data->size, errmsg, len);
+	if(!xp) { return 1; }
+
+	if(put_write(xp, data->buf, data->size, errmsg, len)) {
+		xfer_complete(xp, 1);
+		return 1;
+	}
+
+	if(memcmp(digest->buf, gcfile_get_digest(xp->gcf, TPAD_HASH_ALG), TPAD_DIGEST_SIZE) != 0) {
+		xfer_complete(xp, 1);
+		snprintf(errmsg, len, "INVALID HASH: %s", filename);
+		return 1;
+	}
+
+	xfer_complete(xp, 0);
+	return 0;
+}
+
+// A whole file in one message: [filename][data][digest]
+void tpad_file_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t **pl, int plcnt)
+{
+	tbin_hdr_t h;
+	char errmsg[1536];
+
+	if((plcnt != 3) || (pl[1]->size != hdr->length) || (hdr->offset != hdr->length)) {
+		tpad_bin_error(r, __func__, hdr, "BAD FILE MESSAGE");
+		return;
+	}
+
+	if((long)hdr->length > g_maxchunk) {
+		snprintf(errmsg, sizeof(errmsg), "CHUNK TOO LARGE: %u", hdr->length);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	if(put_whole(pl[0], pl[1], pl[2], errmsg, sizeof(errmsg))) {
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	tbin_pack(&h, TBIN_FILE, 0, hdr->offset, 0);
+	(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, 0);
+}
+
+// Many small files in one message, [filename][data][digest] for each.
+// Every file gets a status byte in the reply, the ones that failed also get a line of errors
+void tpad_batch_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t **pl, int plcnt)
+{
+	int i, ok = 0;
+	size_t n = 0;
+	long total = 0;
+	tbin_hdr_t h;
+	char errmsg[1536];
+	char errors[BATCH_MAXFILES * 128];
+	unsigned char status[BATCH_MAXFILES];
+
+	if((hdr->length < 1) || (hdr->length > BATCH_MAXFILES) || (plcnt != (3 * (int)hdr->length))) {
+		tpad_bin_error(r, __func__, hdr, "BAD BATCH MESSAGE");
+		return;
+	}
+
+	for(i=0; i<plcnt; i+=3) { total += pl[i+1]->size; }
+	if((total != (long)hdr->offset) || (total > g_maxchunk)) {
+		snprintf(errmsg, sizeof(errmsg), "BAD BATCH SIZE: %ld", total);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	errors[0] = 0;
+	for(i=0; i<(int)hdr->length; i++) {
+		status[i] = put_whole(pl[3*i], pl[3*i+1], pl[3*i+2], errmsg, sizeof(errmsg));
+		if(status[i] == 0) { ok++; continue; }
+
+		fprintf(stderr, "%s(): %s\n", __func__, errmsg);
+		// snprintf() returns what it would have written, keep n inside errors once it is full
+		if(n < sizeof(errors)-1) {
+			n += snprintf(errors+n, sizeof(errors)-n, "%.127s\n", errmsg);
+			if(n > sizeof(errors)-1) { n = sizeof(errors)-1; }
+		}
+	}
+
+	tbin_pack(&h, TBIN_BATCH, 0, ok, hdr->length);
+	(void) as_zmq_reply_send(r, &h,			TBIN_HDRSIZE,	1);
+	(void) as_zmq_reply_send(r, status,		hdr->length,	1);
+	(void) as_zmq_reply_send(r, errors,		n+1,			0);
+}
+
 void tpad_put(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4)
 {
 	char *uuid, *filename, *filesize;
@@ -181,6 +443,6 @@ void tpad_put(zmq_reply_t *r, zmq_mf_t *msg2, zmq_mf_t *msg3, zmq_mf_t *msg4)
 		filesize = (char *)msg4->buf;
 		tpad_put_new(r, filename, filesize);
 	} else {
-		tpad_put_chunk(r, uuid, msg3);
+		tpad_put_chunk(r, uuid, msg3, msg4);
 	}
 }
@@ -0,0 +1,234 @@
+/*
+	Transporter is a ZMQ based file transfer utility
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "async_zmq_reply.h"
+#include "transporter.h"
+#include "futils.h"
+#include "tpad_error.h"
+#include "gchelper.h"
+#include "xfer.h"
+#include "catalog.h"
+#include "tbin.h"
+
+xfer_t* put_open(char *filename, long size, char *errmsg, size_t len);
+
+// The file of an upload in parts: preallocated, and held out of the catalog by put_open() until it is joined
+static xfer_t* stripe_put_open(zmq_mf_t *name, long size, char *errmsg, size_t len)
+{
+	xfer_t *xp;
+	char filename[1024+1];
+
+	if((name->size < 1) || (name->size > sizeof(filename)-1)) {
+		snprintf(errmsg, len, "BAD STRIPE MESSAGE");
+		return NULL;
+	}
+
+	memcpy(filename, name->buf, name->size);
+	filename[name->size] = 0;
+
+	xp = put_open(filename, size, errmsg, len);
+	if(!xp) { return NULL; }
+
+	if(file_preallocate(fileno(xp->gcf->f), size) != 0) {
+		snprintf(errmsg, len, "Could not preallocate %ld bytes for %s: %s", size, filename, strerror(errno));
+		xfer_complete(xp, 1);
+		return NULL;
+	}
+
+	return xp;
+}
+
+// A download we handed out (GET or CLAIMCMD) and have not started on yet
+static xfer_t* stripe_get_open(xfer_id_t id, long size, char *errmsg, size_t len)
+{
+	xfer_t *xp;
+
+	xp = xfer_find(id);
+	if(!xp) {
+		snprintf(errmsg, len, "UNKNOWN ID: %lu", (unsigned long)id);
+		return NULL;
+	}
+
+	if(xp->writing || xp->parent || (xp->offset != 0) || (xp->size != size)) {
+		xfer_release(xp);
+		snprintf(errmsg, len, "CAN NOT STRIPE: %lu", (unsigned long)id);
+		return NULL;
+	}
+
+	return xp;
+}
+
+void tpad_stripe_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t *payload)
+{
+	xfer_t *xp;
+	long size;
+	int nparts;
+	tbin_hdr_t h;
+	char errmsg[1536];
+
+	size = (long)hdr->offset;
+	nparts = (int)hdr->length;
+	if((nparts < 1) || (nparts > STRIPE_MAXPARTS) || (size < ((long)nparts * STRIPE_ALIGN))) {
+		snprintf(errmsg, sizeof(errmsg), "BAD STRIPE REQ: %d parts of %ld", nparts, size);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	if(payload) {
+		xp = stripe_put_open(payload, size, errmsg, sizeof(errmsg));
+	} else {
+		xp = stripe_get_open(hdr->id, size, errmsg, sizeof(errmsg));
+	}
+	if(!xp) {
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	if(xfer_stripe(xp, nparts) != 0) {
+		xfer_release(xp);
+		tpad_bin_error(r, __func__, hdr, "CAN NOT STRIPE");
+		return;
+	}
+
+#ifdef DEBUG
+	printf("%s(): %s %s(%ld/%d)\n", __func__, "STRIPE", GCFILE_GETPATH(xp->gcf), size, nparts);
+#endif
+
+	tbin_pack(&h, TBIN_STRIPE, xp->id, size, nparts);
+	xfer_release(xp);
+	(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, 0);
+}
+
+// Open a part of a striped file as a transfer of its own, over its range of the file
+void tpad_part_bin(zmq_reply_t *r, tbin_hdr_t *hdr)
+{
+	xfer_t *xp, *pp;
+	int part, nparts, writing;
+	long size, start, end;
+	tbin_hdr_t h;
+	char errmsg[1536];
+	char path[1024+1];
+
+	xp = xfer_find(hdr->id);
+	if(!xp) {
+		snprintf(errmsg, sizeof(errmsg), "UNKNOWN ID: %lu", (unsigned long)hdr->id);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	part = (int)hdr->offset;
+	if(!xp->stripes || (hdr->offset >= (uint64_t)xp->stripes->nparts) || xp->stripes->have[part]) {
+		xfer_release(xp);
+		snprintf(errmsg, sizeof(errmsg), "BAD PART: %lu", (unsigned long)hdr->offset);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	// Once it is counted, the part has to tell xfer_part_done() how it went
+	snprintf(path, sizeof(path), "%s", GCFILE_GETPATH(xp->gcf));
+	size = xp->size;
+	nparts = xp->stripes->nparts;
+	writing = xp->writing;
+	xp->stripes->open++;
+	xfer_release(xp);
+
+	stripe_range(size, nparts, part, &start, &end);
+	pp = xfer_new(path, writing ? "r+" : "r");
+	if(!pp) {
+		xfer_part_done(hdr->id, part, NULL);
+		snprintf(errmsg, sizeof(errmsg), "Could not get open xfer slot for %s", path);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+	pp->parent = hdr->id;
+	pp->part = part;
+
+	if(gcfile_enable(pp->gcf, TPAD_HASH_ALG) || gcfile_seek(pp->gcf, start)) {
+		snprintf(errmsg, sizeof(errmsg), "%s", GCFILE_GETERRMSG(pp->gcf));
+		xfer_complete(pp, 0);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+#ifdef DEBUG
+	printf("%s(): %s %s(%d: %ld-%ld/%s)\n", __func__, "PART", path, part, start, end, pp->uuid);
+#endif
+
+	// Offsets stay those of the whole file
+	pp->offset = start;
+	pp->size = end;
+	tbin_pack(&h, TBIN_PART, pp->id, start, 0);
+	xfer_release(pp);
+	(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, 0);
+}
+
+// Every part is in, check them against the digest of their digests and close out the file
+void tpad_join_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t *payload)
+{
+	xfer_t *xp;
+	int match;
+	xfer_stripes_t *st;
+	tbin_hdr_t h;
+	char errmsg[1536];
+	unsigned char digest[TPAD_DIGEST_SIZE];
+
+	xp = xfer_find(hdr->id);
+	if(!xp) {
+		snprintf(errmsg, sizeof(errmsg), "UNKNOWN ID: %lu", (unsigned long)hdr->id);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	st = xp->stripes;
+	if(!st || (hdr->offset != (uint64_t)xp->size)) {
+		xfer_release(xp);
+		snprintf(errmsg, sizeof(errmsg), "BAD JOIN: %lu", (unsigned long)hdr->offset);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	if((st->done != st->nparts) || st->open) {
+		snprintf(errmsg, sizeof(errmsg), "MISSING PARTS: %d of %d in", st->done, st->nparts);
+		xfer_complete(xp, xp->writing);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	gcry_md_hash_buffer(TPAD_HASH_ALG, digest, st->digests, st->nparts * TPAD_DIGEST_SIZE);
+	match = (payload && (payload->size == TPAD_DIGEST_SIZE) && (memcmp(payload->buf, digest, TPAD_DIGEST_SIZE) == 0));
+
+#ifdef DEBUG
+	printf("%s(): %s %s(%d parts) %s\n", __func__, "JOIN", GCFILE_GETPATH(xp->gcf), st->nparts, match ? "OK" : "BAD");
+#endif
+
+	// An upload goes into the catalog once it is whole, a download goes away
+	xfer_complete(xp, xp->writing ? !match : match);
+
+	if(!match) {
+		tpad_bin_error(r, __func__, hdr, "INVALID HASH");
+		return;
+	}
+
+	tbin_pack(&h, TBIN_JOIN, hdr->id, hdr->offset, 0);
+	(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, 0);
+}
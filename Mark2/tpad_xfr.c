@@ -29,78 +29,364 @@
 #include "tpad_error.h"
 #include "gchelper.h"
 #include "xfer.h"
+#include "bufpool.h"
+#include "tbin.h"
 
+extern bufpool_t *g_chunkpool;
+extern long g_maxchunk;
+
+// Read the next block of xp into a chunk pool buffer and hold it for when its request shows up.
+// The pool bounds what all transfers hold between them, we hold xp so we do not wait for a buffer:
+// -1 says the pool is empty for now and the request can be asked again
+static int read_ahead(xfer_t *xp, long BS)
+{
+	int z;
+	long left, bytes, chunkoff;
+	unsigned char *buf;
+	zmq_msg_t msg;
+
+	left = (xp->size - xp->offset);
+	if(left < BS) { BS = left; }
+	buf = bufpool_get(g_chunkpool, 0);
+	if(!buf) { return -1; }
+
+	chunkoff = xp->offset;
+	bytes = gcfile_read(xp->gcf, buf, BS);
+	if(bytes != BS) { bufpool_put(g_chunkpool, buf); return -2; }
+	xp->offset += bytes;
+
+	// The buffer goes back to the pool once zmq has sent it
+	if(zmq_msg_init_data(&msg, buf, bytes, bufpool_free_cb, g_chunkpool) != 0) {
+		bufpool_put(g_chunkpool, buf);
+		return -4;
+	}
+
+	z = xfer_stash(xp, chunkoff, &msg);
+	zmq_msg_close(&msg);
+	if(z) { return -3; }
+
+	return 0;
+}
+
+// Put the block at offset of xp in msg, from what we read ahead or from buf.
+// buf comes from the chunk pool before xp was looked up, so nobody waits on xp while the pool is short,
+// it may be NULL when the pool was empty and is used or handed back to the pool here.
+// The file is still read (and hashed) in order: with anyorder set, a request past xp->offset
+// reads ahead and holds the blocks in between until they are asked for.
+// xp is released either way, on error errmsg says why
+static int xfr_block(xfer_t *xp, unsigned char *buf, long offset, long BS, int anyorder, zmq_msg_t *msg, char *errmsg, size_t len)
+{
+	int z;
+	xfer_chunk_t *c;
+	long left, bytes;
+
+	if((BS <= 0) || (BS > g_maxchunk) || (BS > g_chunkpool->bufsize)) {
+		xfer_release(xp);
+		if(buf) { bufpool_put(g_chunkpool, buf); }
+		snprintf(errmsg, len, "BAD CHUNK REQ SIZE: %ld", BS);
+		return 1;
+	}
+
+	// Already read ahead for this one?
+	c = xfer_unstash(xp, offset);
+	if(c) {
+		xfer_release(xp);
+		if(buf) { bufpool_put(g_chunkpool, buf); }
+		zmq_msg_init(msg);
+		zmq_msg_move(msg, &c->msg);
+		xfer_chunk_free(c);
+		return 0;
+	}
+
+	if((offset < xp->offset) || (offset >= xp->size) || (!anyorder && (offset != xp->offset))) {
+		snprintf(errmsg, len, "BAD OFFSET: %ld != %ld", offset, xp->offset);
+		xfer_release(xp);
+		if(buf) { bufpool_put(g_chunkpool, buf); }
+		return 1;
+	}
+
+	if(!buf) {
+		xfer_release(xp);
+		snprintf(errmsg, len, "SERVER BUSY");
+		return 1;
+	}
+
+	// What we read ahead so far stays held if the pool runs dry
+	while(xp->offset < offset) {
+		z = read_ahead(xp, BS);
+		if(z != 0) {
+			xfer_release(xp);
+			bufpool_put(g_chunkpool, buf);
+			if(z == -1) { snprintf(errmsg, len, "SERVER BUSY"); }
+			else { snprintf(errmsg, len, "CAN NOT READ AHEAD TO: %ld", offset); }
+			return 1;
+		}
+	}
+
+	if(xp->offset != offset) {
+		snprintf(errmsg, len, "BAD OFFSET: %ld != %ld", offset, xp->offset);
+		xfer_release(xp);
+		bufpool_put(g_chunkpool, buf);
+		return 1;
+	}
+
+	left = (xp->size - xp->offset);
+	bytes = (left < BS) ? left : BS;
+	if(gcfile_read(xp->gcf, buf, bytes) != bytes) {
+		xfer_release(xp);
+		bufpool_put(g_chunkpool, buf);
+		snprintf(errmsg, len, "READ FAILED AT: %ld", offset);
+		return 1;
+	}
+	xp->offset += bytes;
+	xfer_release(xp);
+
+	// The buffer goes back to the pool once zmq has sent it
+	if(zmq_msg_init_data(msg, buf, bytes, bufpool_free_cb, g_chunkpool) != 0) {
+		bufpool_put(g_chunkpool, buf);
+		snprintf(errmsg, len, "zmq_msg_init_data() failed");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+	A BS of "+N" comes from an absorb that keeps several requests outstanding.
+	It gets "bytes@offset" back so it can place replies that come back out of order,
+	an old tpad just sees N and answers with bytes alone.
+*/
 static void get_xfer_block(zmq_reply_t *r, char *uuid, long offset, char *bshash)
 {
 	xfer_t *xp;
-	int n, delete;
+	int n, delete, pipelined;
 	char empty[4];
 	char errmsg[128];
-	long left, bytes, BS;
-	unsigned char *buf;
-	char len[32];
+	long bytes;
+	char len[48];
 	char *hashptr;
+	unsigned char *buf;
+	zmq_msg_t msg;
 
 	memset(empty, 0, sizeof(empty));
 
+	// Before xp is held, the last request (the hash) and a block read ahead do without it
+	buf = bufpool_get(g_chunkpool, CHUNKPOOL_WAIT);
+
 	// FIND UUID
 	xp = xfer_find_uuid(uuid);
 	if(!xp) {
+		if(buf) { bufpool_put(g_chunkpool, buf); }
 		snprintf(errmsg, sizeof(errmsg), "UNKNOWN UUID: %s", uuid);
 		tpad_error(r, __func__, errmsg, NULL);
 		return;
 	}
 
 #ifdef DEBUG
-	printf("%s(): %s %s(%lu)\n", __func__, "XFR", GCFILE_GETPATH(&xp->gcf), offset);
+	printf("%s(): %s %s(%lu)\n", __func__, "XFR", GCFILE_GETPATH(xp->gcf), offset);
 #endif
 
-	if(offset != xp->offset) {
-		snprintf(errmsg, sizeof(errmsg), "BAD OFFSET: %ld != %ld", offset, xp->offset);
-		tpad_error(r, __func__, errmsg, NULL);
-		return;
-	}
-
-	if(offset == xp->size) {
-		hashptr = gcfile_get_hash(&xp->gcf, TPAD_HASH_ALG);
+	if((offset == xp->size) && (xp->offset == xp->size)) {
+		hashptr = gcfile_get_hash(xp->gcf, TPAD_HASH_ALG);
 		if(strcmp(hashptr, bshash)) {
 			delete = 0;
 			tpad_error(r, __func__, "INVALID HASH", NULL);
 		} else {
 			delete = 1;
+			// A part hands its digest to its file, only the JOIN removes it
+			if(xp->parent) {
+				xfer_part_done(xp->parent, xp->part, gcfile_get_digest(xp->gcf, TPAD_HASH_ALG));
+				xp->parent = 0;
+				delete = 0;
+			}
 			(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
 			(void) as_zmq_reply_send(r, empty,		1,					1);
 			(void) as_zmq_reply_send(r, empty,		1,					0);
 #ifdef DEBUG
-			printf("%s(): %s %s\n", __func__, "DEL", GCFILE_GETPATH(&xp->gcf));
+			printf("%s(): %s %s\n", __func__, "DEL", GCFILE_GETPATH(xp->gcf));
 #endif
 		}
 		free(hashptr);
 		xfer_complete(xp, delete);
+		if(buf) { bufpool_put(g_chunkpool, buf); }
 		return;
 	}
 
-	BS = atol(bshash);
-	if(BS > MAXCHUNKSIZE) {
-		snprintf(errmsg, sizeof(errmsg), "CHUNK REQ TOO LARGE: %ld", BS);
-		tpad_error(r, __func__, errmsg, NULL);
+	pipelined = (bshash[0] == '+');
+	if(xfr_block(xp, buf, offset, atol(bshash), pipelined, &msg, errmsg, sizeof(errmsg))) {
+		// A pipelined absorb asks again for a block we had no buffer for, so say which one
+		if(pipelined && (strcmp(errmsg, "SERVER BUSY") == 0)) {
+			snprintf(len, sizeof(len), "@%ld", offset);
+			tpad_error(r, __func__, errmsg, len);
+		} else {
+			tpad_error(r, __func__, errmsg, NULL);
+		}
 		return;
 	}
 
-	buf = malloc(BS);
-	left = (xp->size - xp->offset);
-	if(left < BS) {
-		bytes = gcfile_read(&xp->gcf, buf, left);
+	bytes = (long)zmq_msg_size(&msg);
+	if(pipelined) {
+		n = snprintf(len, sizeof(len), "%ld@%ld", bytes, offset);
 	} else {
-		bytes = gcfile_read(&xp->gcf, buf, BS);
+		n = snprintf(len, sizeof(len), "%ld", bytes);
 	}
-	xp->offset += bytes;
-
-	n = snprintf(len, sizeof(len), "%ld", bytes);
 	(void) as_zmq_reply_send(r, TSTAT_OK,	strlen(TSTAT_OK)+1,	1);
-	(void) as_zmq_reply_send(r, buf,		bytes,				1);
+	(void) as_zmq_reply_send_msg(r, &msg,						1);
 	(void) as_zmq_reply_send(r, len,		n+1,				0);
-	free(buf);
+}
+
+void tpad_xfr_bin(zmq_reply_t *r, tbin_hdr_t *hdr)
+{
+	xfer_t *xp;
+	tbin_hdr_t h;
+	char errmsg[128];
+	unsigned char *buf;
+	zmq_msg_t msg;
+
+	// Before xp is held, a block read ahead does without it
+	buf = bufpool_get(g_chunkpool, CHUNKPOOL_WAIT);
+
+	xp = xfer_find(hdr->id);
+	if(!xp) {
+		if(buf) { bufpool_put(g_chunkpool, buf); }
+		snprintf(errmsg, sizeof(errmsg), "UNKNOWN ID: %lu", (unsigned long)hdr->id);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	if(xfr_block(xp, buf, (long)hdr->offset, (long)hdr->length, 1, &msg, errmsg, sizeof(errmsg))) {
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	tbin_pack(&h, TBIN_XFR, hdr->id, hdr->offset, zmq_msg_size(&msg));
+	(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, 1);
+	(void) as_zmq_reply_send_msg(r, &msg, 0);
+}
+
+// Push blocks of a download until the credit in hdr->offset runs out, then the digest.
+// The worker can send any number of messages for the one request, see async_zmq_reply.c.
+// Credit is what keeps this bounded: the ROUTER in front of us drops messages
+// at its high-water mark instead of blocking, so it can not be the flow control.
+// Blocks come out of the chunk pool like any XFR, and xp is only held while a block is read,
+// so the reaper and a SUM do not wait for the whole credit to go out
+void tpad_stream_bin(zmq_reply_t *r, tbin_hdr_t *hdr)
+{
+	xfer_t *xp;
+	int last;
+	long BS, limit, bytes, chunkoff, size;
+	tbin_hdr_t h;
+	char errmsg[128];
+	unsigned char *buf;
+	unsigned char digest[TPAD_DIGEST_SIZE];
+	zmq_msg_t msg;
+
+	// Late credit for a transfer that is already done, nobody is waiting for an answer
+	xp = xfer_find(hdr->id);
+	if(!xp) {
+		fprintf(stderr, "%s(): UNKNOWN ID: %lu\n", __func__, (unsigned long)hdr->id);
+		return;
+	}
+
+	BS = (long)hdr->length;
+	if(xp->writing || (BS <= 0) || (BS > g_maxchunk) || (BS > g_chunkpool->bufsize)) {
+		xfer_release(xp);
+		snprintf(errmsg, sizeof(errmsg), "BAD STREAM REQ: %ld", BS);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	limit = (long)hdr->offset;
+	if(limit > xp->size) { limit = xp->size; }
+	xfer_release(xp);
+
+	while(1) {
+		// The buffer goes back to the pool once zmq has sent it
+		buf = bufpool_get(g_chunkpool, CHUNKPOOL_WAIT);
+		if(!buf) {
+			tpad_bin_error(r, __func__, hdr, "SERVER BUSY");
+			return;
+		}
+
+		xp = xfer_find(hdr->id);
+		if(!xp) { bufpool_put(g_chunkpool, buf); return; }
+		if(xp->offset >= limit) { xfer_release(xp); bufpool_put(g_chunkpool, buf); return; }
+
+		size = xp->size;
+		chunkoff = xp->offset;
+		bytes = size - chunkoff;
+		if(bytes > BS) { bytes = BS; }
+		if(gcfile_read(xp->gcf, buf, bytes) != bytes) {
+			xfer_release(xp);
+			bufpool_put(g_chunkpool, buf);
+			snprintf(errmsg, sizeof(errmsg), "READ FAILED AT: %ld", chunkoff);
+			tpad_bin_error(r, __func__, hdr, errmsg);
+			return;
+		}
+		xp->offset += bytes;
+		last = (xp->offset == size);
+		if(last) { memcpy(digest, gcfile_get_digest(xp->gcf, TPAD_HASH_ALG), TPAD_DIGEST_SIZE); }
+		xfer_release(xp);
+
+		if(zmq_msg_init_data(&msg, buf, bytes, bufpool_free_cb, g_chunkpool) != 0) {
+			bufpool_put(g_chunkpool, buf);
+			tpad_bin_error(r, __func__, hdr, "SERVER BUSY");
+			return;
+		}
+
+		tbin_pack(&h, TBIN_XFR, hdr->id, chunkoff, bytes);
+		(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, 1);
+		(void) as_zmq_reply_send_msg(r, &msg, 0);
+
+		if(last) {
+			tbin_pack(&h, TBIN_SUM, hdr->id, size, TPAD_DIGEST_SIZE);
+			(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, 1);
+			(void) as_zmq_reply_send(r, digest, TPAD_DIGEST_SIZE, 0);
+			return;
+		}
+	}
+}
+
+// absorb has the whole file, the source goes away if the digests match.
+// A part of a file only hands its digest on, the JOIN decides
+void tpad_sum_bin(zmq_reply_t *r, tbin_hdr_t *hdr, zmq_mf_t *payload)
+{
+	xfer_t *xp;
+	int match, del;
+	tbin_hdr_t h;
+	char errmsg[128];
+
+	xp = xfer_find(hdr->id);
+	if(!xp) {
+		snprintf(errmsg, sizeof(errmsg), "UNKNOWN ID: %lu", (unsigned long)hdr->id);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	if((hdr->offset != xp->size) || (xp->offset != xp->size)) {
+		snprintf(errmsg, sizeof(errmsg), "BAD OFFSET: %lu != %ld", (unsigned long)hdr->offset, xp->size);
+		xfer_release(xp);
+		tpad_bin_error(r, __func__, hdr, errmsg);
+		return;
+	}
+
+	match = (payload && (payload->size == TPAD_DIGEST_SIZE) &&
+		(memcmp(payload->buf, gcfile_get_digest(xp->gcf, TPAD_HASH_ALG), TPAD_DIGEST_SIZE) == 0));
+	del = match;
+	if(match && xp->parent) {
+		xfer_part_done(xp->parent, xp->part, gcfile_get_digest(xp->gcf, TPAD_HASH_ALG));
+		xp->parent = 0;
+		del = 0;
+	}
+	xfer_complete(xp, del);
+
+	if(!match) {
+		tpad_bin_error(r, __func__, hdr, "INVALID HASH");
+		return;
+	}
+
+	tbin_pack(&h, TBIN_SUM, hdr->id, hdr->offset, 0);
+	(void) as_zmq_reply_send(r, &h, TBIN_HDRSIZE, 0);
 }
 
 /*
@@ -19,7 +19,45 @@
 #ifndef __TRANSPORTER_H__
 #define __TRANSPORTER_H__
 
+// The largest chunk a tpad takes and serves is set with --maxchunk and told to clients in HELLOCMD,
+// a tpad that does not answer HELLOCMD handles up to MAXCHUNKSIZE
 #define MAXCHUNKSIZE (524288)
+#define DEFAULT_MAXCHUNK (4194304)
+#define MAXCHUNKLIMIT (33554432)
+
+// tpad serves chunks out of a fixed pool of --maxchunk buffers,
+// by default as many as fit in CHUNKPOOL_BYTES. Blocks read ahead for absorb come out of it too
+#define CHUNKPOOL_BYTES (67108864)
+#define CHUNKPOOL_MINCOUNT (4)
+#define CHUNKPOOL_WAIT (1000)
+// absorb asks again this many times when tpad is out of buffers
+#define BUSY_RETRIES (8)
+
+// beam keeps up to MAXWINDOW chunks of a file in flight.
+// Chunks that reach tpad ahead of a gap are held until it fills,
+// but never more than PENDING_MAXBYTES of them per transfer
+#define MAXWINDOW (256)
+#define PENDING_MAXBYTES (67108864)
+// With --window 0 beam aims for about this many bytes in flight
+#define WINDOW_AUTOBYTES (4194304)
+// beam sends files up to this size in a single message, name, data and digest together
+#define SMALLFILE_MAX (65536)
+// and packs up to BATCH_MAXFILES of them (BATCH_MAXBYTES in all) into one message.
+// Each file is 3 frames, async_zmq_reply takes up to AS_ZMQ_MAX_PARTS of them
+#define BATCH_MAXFILES (64)
+#define BATCH_MAXBYTES (1048576)
+// absorb gives up on a streaming download after this many ms without a message
+#define STREAM_TIMEOUT (30000)
+// and after a failed one throws away what is still on its way, until it has been quiet this many ms
+#define STREAM_DRAIN (2*CHUNKPOOL_WAIT)
+// beam and absorb --stripes move a file of at least STRIPE_MINSIZE in up to STRIPE_MAXPARTS parts at once,
+// each part starts on a STRIPE_ALIGN boundary
+#define STRIPE_MINSIZE (67108864)
+#define STRIPE_MAXPARTS (16)
+#define STRIPE_ALIGN (1048576)
+// tpad --pub publishes FILESEVENT whenever files show up in the spool,
+// absorb --follow sleeps until it hears one, or for FOLLOW_RECHECK ms in case it missed it
+#define FOLLOW_RECHECK (10000)
 
 #define TSTAT_ERR "ERR"
 #define TSTAT_OK  "OK"
@@ -37,11 +75,25 @@
 #define NEWESTCMD "::newestfile()::"
 #define LARGESTCMD "::largestfile()::"
 #define SMALLESTCMD "::smallestfile()::"
+#define STATSCMD "::stats()::"
+#define HELLOCMD "::hello()::"
+#define MANIFESTCMD "::manifest()::"
+#define CLAIMCMD "::claim()::"
+// Not a CMD, the topic of a --pub message. The next frame is the file count
+#define FILESEVENT "::files()::"
+
+// The error text of a pick or CLAIMCMD on an empty spool
+#define NOFILESMSG "ZERO FILES AVAILABLE"
 
 #define RNDMETHOD (0)
 #define OLDMETHOD (1)
 #define NEWMETHOD (2)
 #define LRGMETHOD (3)
 #define SMLMETHOD (4)
+#define NAMMETHOD (5)
+
+// MANIFESTCMD hands out the spool this many files at a time, unless asked for fewer
+#define MANIFEST_PAGE (1000)
+#define MANIFEST_MAXPAGE (10000)
 
 #endif
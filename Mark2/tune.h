@@ -0,0 +1,186 @@
+/*
+	Transporter is a ZMQ based file transfer utility
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __TPAD_TUNE_H__
+#define __TPAD_TUNE_H__
+
+#include <string.h>
+#include <time.h>
+
+/*
+	Picks a value by the throughput it buys, beam and absorb use it for the chunk size and beam for its --jobs.
+	Throughput is measured over epochs of at least epoch_count units (chunks, files) and epoch_usec.
+	The value doubles while that buys at least gain, then settles on the best value seen.
+	Every probe settled epochs it tries doubling again.
+	With slow_usec set it is halved when a single unit of the value takes longer than that at the measured rate,
+	and tune_backoff() halves it when the other end says it is short on memory.
+	A value given on the command line is used as is.
+*/
+
+typedef struct {
+	long start, min;
+	long epoch_count;
+	long epoch_usec;
+	long slow_usec;		// 0 never halves it on its own
+	double gain;
+	int probe;
+} tune_metric_t;
+
+typedef struct {
+	const tune_metric_t *m;
+	long value;
+	long min, max;
+	int fixed;
+	int settled;	// epochs since it settled, 0 while growing
+	long best;
+	double best_rate;
+	long bytes;
+	long count;
+	struct timespec start;
+} tune_t;
+
+// Start a new measurement, the time between files should not count against a value
+static inline void tune_epoch(tune_t *t)
+{
+	t->bytes = 0;
+	t->count = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+// value <= 0 means tune it
+static inline void tune_init(tune_t *t, const tune_metric_t *m, long value, long max)
+{
+	memset(t, 0, sizeof(tune_t));
+	t->m = m;
+	t->max = max;
+	t->min = (m->min < max) ? m->min : max;
+	t->fixed = (value > 0);
+	if(value <= 0) { value = m->start; }
+	if(value > max) { value = max; }
+	t->value = value;
+	t->best = value;
+	tune_epoch(t);
+}
+
+static inline void tune_set(tune_t *t, long value)
+{
+	if(value > t->max) { value = t->max; }
+	if(value < t->min) { value = t->min; }
+	t->value = value;
+}
+
+// The other end is running short, take smaller bites for a while
+static inline void tune_backoff(tune_t *t)
+{
+	if(t->fixed) { return; }
+	tune_set(t, t->value / 2);
+	t->best = t->value;
+	t->best_rate = 0;
+	t->settled = 1;
+	tune_epoch(t);
+}
+
+// Count units worth bytes that made it through, returns 1 if t->value changed
+static inline int tune_done(tune_t *t, long count, long bytes)
+{
+	long usec, old;
+	double rate;
+	struct timespec now;
+	const tune_metric_t *m = t->m;
+
+	t->bytes += bytes;
+	t->count += count;
+	if(t->fixed) { return 0; }
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usec = ((now.tv_sec - t->start.tv_sec) * 1000000L) + ((now.tv_nsec - t->start.tv_nsec) / 1000L);
+	if((t->count < m->epoch_count) || (usec < m->epoch_usec)) { return 0; }
+
+	// bytes per usec, the same MB/s get_stats() prints
+	old = t->value;
+	rate = (double)t->bytes / (double)usec;
+	if(m->slow_usec && (((double)old / rate) > m->slow_usec)) {
+		tune_set(t, old / 2);
+		t->best = t->value;
+		t->best_rate = 0;
+		t->settled = 1;
+	} else if(!t->settled) {
+		if(rate > (t->best_rate * m->gain)) {
+			t->best = old;
+			t->best_rate = rate;
+			tune_set(t, old * 2);
+			if(t->value == old) { t->settled = 1; }
+		} else {
+			// More did not help, go back to the best one
+			t->value = t->best;
+			t->settled = 1;
+		}
+	} else if(++t->settled > m->probe) {
+		t->best = old;
+		t->best_rate = rate;
+		t->settled = 0;
+		tune_set(t, old * 2);
+	}
+
+	tune_epoch(t);
+	return (t->value != old);
+}
+
+/*
+	The chunk size beam and absorb use, up to the largest chunk tpad will take.
+	It is halved when a chunk takes longer than CTUNE_SLOWCHUNK_USEC.
+*/
+
+#define CTUNE_MIN (4096)
+#define CTUNE_START (65536)
+#define CTUNE_EPOCH_CHUNKS (8)
+#define CTUNE_EPOCH_USEC (20000)
+#define CTUNE_SLOWCHUNK_USEC (250000)
+#define CTUNE_GAIN (1.10)
+#define CTUNE_PROBE (16)
+
+static const tune_metric_t ctune_metric = {
+	CTUNE_START, CTUNE_MIN, CTUNE_EPOCH_CHUNKS, CTUNE_EPOCH_USEC, CTUNE_SLOWCHUNK_USEC, CTUNE_GAIN, CTUNE_PROBE
+};
+
+typedef tune_t ctune_t;
+
+static inline void ctune_init(ctune_t *t, long size, long max) { tune_init(t, &ctune_metric, size, max); }
+static inline void ctune_epoch(ctune_t *t) { tune_epoch(t); }
+static inline void ctune_backoff(ctune_t *t) { tune_backoff(t); }
+static inline int ctune_chunk(ctune_t *t, long bytes) { return tune_done(t, 1, bytes); }
+
+/*
+	How many beam --jobs workers send at once, starting with one.
+*/
+
+#define JTUNE_EPOCH_FILES (16)
+#define JTUNE_EPOCH_USEC (250000)
+#define JTUNE_GAIN (1.10)
+#define JTUNE_PROBE (16)
+
+static const tune_metric_t jtune_metric = {
+	1, 1, JTUNE_EPOCH_FILES, JTUNE_EPOCH_USEC, 0, JTUNE_GAIN, JTUNE_PROBE
+};
+
+typedef tune_t jtune_t;
+
+static inline void jtune_init(jtune_t *t, int n, int max) { tune_init(t, &jtune_metric, n, max); }
+static inline int jtune_done(jtune_t *t, long files, long bytes) { return tune_done(t, files, bytes); }
+
+#endif
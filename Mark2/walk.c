@@ -0,0 +1,226 @@
+/*
+	Transporter is a ZMQ based file transfer utility
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "walk.h"
+
+static void walk_push_dir(walk_t *w, const char *path)
+{
+	size_t len;
+	wdir_t *d;
+
+	len = strlen(path);
+	d = malloc(sizeof(wdir_t) + len + 1);
+	if(!d) { fprintf(stderr, "%s(): malloc() failed, skipping %s\n", __func__, path); return; }
+	memcpy(d->path, path, len+1);
+
+	pthread_mutex_lock(&w->lock);
+	d->next = w->dirs;
+	w->dirs = d;
+	pthread_cond_signal(&w->dirs_cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// Returns -1 once the walk has been stopped
+static int walk_push_file(walk_t *w, const char *path)
+{
+	char *name;
+
+	name = strdup(path);
+	if(!name) { fprintf(stderr, "%s(): strdup() failed, skipping %s\n", __func__, path); return 0; }
+
+	pthread_mutex_lock(&w->lock);
+	while((w->count == WALK_QUEUE) && !w->stop) { pthread_cond_wait(&w->room_cond, &w->lock); }
+	if(w->stop) { pthread_mutex_unlock(&w->lock); free(name); return -1; }
+	w->files[(w->head + w->count) % WALK_QUEUE] = name;
+	w->count++;
+	pthread_cond_signal(&w->file_cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return 0;
+}
+
+// Queue the files of one dir and the dirs under it
+static void walk_dir(walk_t *w, wdir_t *d)
+{
+	int fd, type;
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	char path[PATH_MAX];
+
+	fd = openat(w->topfd, d->path[0] ? d->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(fd == -1) { fprintf(stderr, "open(%s) failed: %s\n", d->path, strerror(errno)); return; }
+
+	dp = fdopendir(fd);
+	if(!dp) { fprintf(stderr, "fdopendir(%s) failed: %s\n", d->path, strerror(errno)); close(fd); return; }
+
+	while((de = readdir(dp))) {
+		if((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0)) { continue; }
+		if(snprintf(path, sizeof(path)-1, "%s%s", d->path, de->d_name) >= (int)sizeof(path)-1) {
+			fprintf(stderr, "%s%s: path too long\n", d->path, de->d_name);
+			continue;
+		}
+
+		// A symlink counts for what it points to, unless that is a dir
+		type = de->d_type;
+		if(type == DT_UNKNOWN) {
+			if(fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) { continue; }
+			type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : (S_ISLNK(st.st_mode) ? DT_LNK : 0));
+		}
+		if(type == DT_LNK) {
+			if(fstatat(dirfd(dp), de->d_name, &st, 0) != 0) { continue; }
+			type = S_ISREG(st.st_mode) ? DT_REG : 0;
+		}
+
+		if(type == DT_DIR) {
+			strcat(path, "/");
+			walk_push_dir(w, path);
+		} else if(type == DT_REG) {
+			if(walk_push_file(w, path)) { break; }
+		}
+	}
+
+	closedir(dp);
+}
+
+static void* walker(void *arg)
+{
+	wdir_t *d;
+	walk_t *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	while(1) {
+		while(!w->dirs && !w->done && !w->stop) { pthread_cond_wait(&w->dirs_cond, &w->lock); }
+		if(w->stop || !w->dirs) { break; }
+
+		d = w->dirs;
+		w->dirs = d->next;
+		w->reading++;
+		pthread_mutex_unlock(&w->lock);
+
+		walk_dir(w, d);
+		free(d);
+
+		pthread_mutex_lock(&w->lock);
+		w->reading--;
+		// Nobody is left to find another dir
+		if(!w->dirs && (w->reading == 0)) {
+			w->done = 1;
+			pthread_cond_broadcast(&w->dirs_cond);
+			pthread_cond_broadcast(&w->file_cond);
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+walk_t* walk_start(const char *dir, int threads)
+{
+	int i;
+	walk_t *w;
+
+	w = calloc(1, sizeof(walk_t));
+	if(!w) { return NULL; }
+
+	w->topfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(w->topfd == -1) { fprintf(stderr, "open(%s) failed: %s\n", dir, strerror(errno)); free(w); return NULL; }
+
+	w->threads = calloc(threads, sizeof(pthread_t));
+	if(!w->threads) { close(w->topfd); free(w); return NULL; }
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->dirs_cond, NULL);
+	pthread_cond_init(&w->room_cond, NULL);
+	pthread_cond_init(&w->file_cond, NULL);
+	walk_push_dir(w, "");
+
+	for(i=0; i<threads; i++) {
+		if(pthread_create(&w->threads[i], NULL, walker, w) != 0) { break; }
+	}
+	w->nthreads = i;
+
+	if(w->nthreads == 0) {
+		fprintf(stderr, "%s(): pthread_create() failed!\n", __func__);
+		walk_stop(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+// The next file, by its path from the top (free() it when done), NULL when there are no more
+char* walk_next(walk_t *w)
+{
+	char *name = NULL;
+
+	pthread_mutex_lock(&w->lock);
+	while((w->count == 0) && !w->done) { pthread_cond_wait(&w->file_cond, &w->lock); }
+	if(w->count > 0) {
+		name = w->files[w->head];
+		w->head = (w->head + 1) % WALK_QUEUE;
+		w->count--;
+		pthread_cond_signal(&w->room_cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return name;
+}
+
+// Stop the walkers, whether they are done or not, and free what is left
+void walk_stop(walk_t *w)
+{
+	int i;
+	wdir_t *d;
+
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->dirs_cond);
+	pthread_cond_broadcast(&w->room_cond);
+	pthread_mutex_unlock(&w->lock);
+
+	for(i=0; i<w->nthreads; i++) { pthread_join(w->threads[i], NULL); }
+
+	while(w->count > 0) {
+		free(w->files[w->head]);
+		w->head = (w->head + 1) % WALK_QUEUE;
+		w->count--;
+	}
+	while((d = w->dirs)) {
+		w->dirs = d->next;
+		free(d);
+	}
+
+	pthread_cond_destroy(&w->file_cond);
+	pthread_cond_destroy(&w->room_cond);
+	pthread_cond_destroy(&w->dirs_cond);
+	pthread_mutex_destroy(&w->lock);
+	close(w->topfd);
+	free(w->threads);
+	free(w);
+}
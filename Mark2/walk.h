@@ -0,0 +1,62 @@
+/*
+	Transporter is a ZMQ based file transfer utility
+	Copyright (C) 2022 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef __BEAM_WALK_H__
+#define __BEAM_WALK_H__
+
+#include <pthread.h>
+
+// Threads reading dirs unless asked for another number
+#define WALK_THREADS (4)
+// Files found but not taken yet, the walkers wait once this many are queued
+#define WALK_QUEUE (1024)
+
+/*
+	Find every regular file under a dir with a few threads reading dirs at once.
+	Files come out of walk_next() in no particular order as soon as they are found,
+	the tree is never held in memory, only the dirs that still have to be read.
+	Dirs are opened with openat() from the one we started in, symlinks to dirs are not followed.
+*/
+
+typedef struct wdir_s {
+	struct wdir_s *next;
+	char path[];	// "" for the top, otherwise ends in '/'
+} wdir_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t dirs_cond;	// a dir to read, or nothing left to do
+	pthread_cond_t room_cond;	// room in files
+	pthread_cond_t file_cond;	// a file to take, or nothing left to find
+	int topfd;
+	wdir_t *dirs;
+	int reading;	// walkers in the middle of a dir
+	int done;
+	int stop;
+	char *files[WALK_QUEUE];
+	int head;
+	int count;
+	int nthreads;
+	pthread_t *threads;
+} walk_t;
+
+walk_t* walk_start(const char *dir, int threads);
+char* walk_next(walk_t *w);
+void walk_stop(walk_t *w);
+
+#endif
@@ -17,66 +17,434 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "xfer.h"
+#include "catalog.h"
 #include "rnum.h"
+#include "transporter.h"
+#include "gchelper.h"
 
-xfer_t g_xlist[MAXACTIVE];
+// Active transfers are chained off g_buckets by id
+// Inactive entries sit on g_freelist until xfer_new() needs one
+static pthread_mutex_t g_xlock = PTHREAD_MUTEX_INITIALIZER;
+static xfer_t **g_buckets = NULL;
+static unsigned long g_nbuckets = 0;
+static unsigned long g_active = 0;
+static unsigned long g_maxactive = DEFAULT_MAXACTIVE;
+static unsigned long g_reaped = 0;
+static xfer_t *g_freelist = NULL;
 
-void xfer_init(void)
+// The ids are random, but mix them anyway in case a client makes its own
+static inline unsigned long xfer_bucket(xfer_id_t id, unsigned long nbuckets)
 {
-	memset(&g_xlist[0], 0, sizeof(g_xlist));
+	id ^= id >> 33;
+	id *= 0xff51afd7ed558ccdULL;
+	id ^= id >> 33;
+	return (unsigned long)(id & (nbuckets - 1));
 }
 
-xfer_t* xfer_new(char *path, char *mode)
+static time_t xfer_now(void)
+{
+	struct timespec ts;
+
+	// Leases go by the second, the coarse clock is plenty and xfer_find() calls this every time
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+void xfer_init(unsigned long maxactive)
+{
+	pthread_mutex_lock(&g_xlock);
+	g_maxactive = maxactive;
+	if(!g_buckets) {
+		g_nbuckets = XFER_MINBUCKETS;
+		g_buckets = calloc(g_nbuckets, sizeof(xfer_t *));
+	}
+	pthread_mutex_unlock(&g_xlock);
+}
+
+// Call with g_xlock held
+static int xfer_grow_freelist(void)
+{
+	int i;
+	xfer_t *slab;
+	xfer_cold_t *cold;
+
+	// Line the entries up with the cache so that xfer_find() misses once per transfer
+	if(posix_memalign((void **)&slab, XFER_CACHELINE, XFER_SLAB * sizeof(xfer_t)) != 0) { return -1; }
+	memset(slab, 0, XFER_SLAB * sizeof(xfer_t));
+
+	cold = calloc(XFER_SLAB, sizeof(xfer_cold_t));
+	if(!cold) { free(slab); return -2; }
+
+	for(i=0; i<XFER_SLAB; i++) {
+		pthread_mutex_init(&slab[i].lock, NULL);
+		slab[i].gcf = &cold[i].gcf;
+		slab[i].uuid = &cold[i].uuid[0];
+		slab[i].next = g_freelist;
+		g_freelist = &slab[i];
+	}
+
+	return 0;
+}
+
+// Call with g_xlock held
+static void xfer_grow_buckets(void)
+{
+	unsigned long i, b, nbuckets;
+	xfer_t **buckets;
+	xfer_t *xp, *next;
+
+	nbuckets = g_nbuckets * 2;
+	buckets = calloc(nbuckets, sizeof(xfer_t *));
+	if(!buckets) { return; }	// Keep the longer chains
+
+	for(i=0; i<g_nbuckets; i++) {
+		for(xp=g_buckets[i]; xp; xp=next) {
+			next = xp->next;
+			b = xfer_bucket(xp->id, nbuckets);
+			xp->next = buckets[b];
+			buckets[b] = xp;
+		}
+	}
+
+	free(g_buckets);
+	g_buckets = buckets;
+	g_nbuckets = nbuckets;
+}
+
+// Call with g_xlock held
+static xfer_t* xfer_lookup(xfer_id_t id)
 {
-	int i, z, openslot;
 	xfer_t *xp;
 
-	openslot = 0;
-	for(i=0; i<MAXACTIVE; i++) {
-		xp = &g_xlist[i];
-		if(!GCFILE_ISOPEN(&xp->gcf)) {
-			openslot = 1;
-			break;
+	for(xp=g_buckets[xfer_bucket(id, g_nbuckets)]; xp; xp=xp->next) {
+		if(xp->id == id) { return xp; }
+	}
+
+	return NULL;
+}
+
+xfer_t* xfer_new(char *path, char *mode)
+{
+	int z;
+	unsigned long b;
+	xfer_t *xp = NULL;
+
+	// Take an entry off the free list under the table lock
+	pthread_mutex_lock(&g_xlock);
+	if((g_maxactive == 0) || (g_active < g_maxactive)) {
+		if(!g_freelist) { (void) xfer_grow_freelist(); }
+		if(g_freelist) {
+			xp = g_freelist;
+			g_freelist = xp->next;
+			xp->next = NULL;
+			xp->inuse = 1;
+			g_active++;
 		}
 	}
+	pthread_mutex_unlock(&g_xlock);
 
-	if(openslot == 0) { return NULL; }
+	if(!xp) { return NULL; }
 
-	GCFILE_INIT(&xp->gcf);
-	z = gcfile_open(&xp->gcf, path, mode);
-	if(z != 0) { return NULL; }
+	// Do the file work under the xfer lock
+	pthread_mutex_lock(&xp->lock);
+	GCFILE_INIT(xp->gcf);
+	z = gcfile_open(xp->gcf, path, mode);
+	if(z != 0) { xfer_complete(xp, 0); return NULL; }
+	xp->writing = (mode[0] != 'r') || (strchr(mode, '+') != NULL);
+	xp->last = xfer_now();
 
-	snprintf(xp->uuid, sizeof(xp->uuid), "%lu", randomul());
+	// Only make it visible to xfer_find() once the file is open
+	pthread_mutex_lock(&g_xlock);
+	do { xp->id = randomul(); } while((xp->id == 0) || xfer_lookup(xp->id));
+	if((g_active * XFER_BUCKETS_PER_XFER) > g_nbuckets) { xfer_grow_buckets(); }
+	b = xfer_bucket(xp->id, g_nbuckets);
+	xp->next = g_buckets[b];
+	g_buckets[b] = xp;
+	pthread_mutex_unlock(&g_xlock);
+
+	snprintf(xp->uuid, XFER_UUIDLEN, "%lu", (unsigned long)xp->id);
 	return xp;
 }
 
-xfer_t* xfer_find_uuid(char *uuid)
+xfer_t* xfer_find(xfer_id_t id)
 {
-	int i;
 	xfer_t *xp;
 
-	for(i=0; i<MAXACTIVE; i++) {
-		xp = &g_xlist[i];
-		if(GCFILE_ISOPEN(&xp->gcf)) {
-			if(strncmp(uuid, xp->uuid, 24) == 0) {
-				return &g_xlist[i];
-			}
-		}
+	if(id == 0) { return NULL; }
+
+	pthread_mutex_lock(&g_xlock);
+	xp = xfer_lookup(id);
+	pthread_mutex_unlock(&g_xlock);
+
+	if(!xp) { return NULL; }
+
+	// Never wait on an xfer while holding the table lock (see xfer_complete)
+	// The entry might have been completed (or reused) while we waited, so check it again.
+	// xfer_complete() clears id before it lets go, and the file is open before an id is set,
+	// so the id is all we need to look at and the cold half stays out of the cache
+	pthread_mutex_lock(&xp->lock);
+	if(xp->id != id) {
+		pthread_mutex_unlock(&xp->lock);
+		return NULL;
 	}
 
-	return NULL;
+	xp->last = xfer_now();
+	return xp;
+}
+
+xfer_t* xfer_find_uuid(char *uuid)
+{
+	char *end;
+	xfer_id_t id;
+
+	errno = 0;
+	id = strtoull(uuid, &end, 10);
+	if((errno != 0) || (end == uuid) || (*end != 0)) { return NULL; }
+
+	return xfer_find(id);
+}
+
+void xfer_release(xfer_t *xp)
+{
+	pthread_mutex_unlock(&xp->lock);
 }
 
 void xfer_complete(xfer_t *xp, int del)
 {
 	char *path;
+	xfer_t **pp;
+	xfer_chunk_t *c;
+
+	while(xp->pending) {
+		c = xp->pending;
+		xp->pending = c->next;
+		xfer_chunk_free(c);
+	}
+	xp->npending = 0;
+	xp->pending_bytes = 0;
 
-	gcfile_close(&xp->gcf);
-	path = GCFILE_GETPATH(&xp->gcf);
+	// A part that did not make it, the file is for its parent to keep or remove
+	if(xp->parent) {
+		xfer_part_done(xp->parent, xp->part, NULL);
+		del = 0;
+	}
+	if(xp->stripes) {
+		free(xp->stripes->have);
+		free(xp->stripes->digests);
+		free(xp->stripes);
+	}
+
+	gcfile_close(xp->gcf);
+	path = GCFILE_GETPATH(xp->gcf);
+	// Keep the spool catalog in step with what we did to the file,
+	// a claim ends with its transfer and catalog_unclaim() looks at the file again
 	if(del) { remove(path); }
-	GCFILE_INIT(&xp->gcf);
-	memset(xp, 0, sizeof(xfer_t));
+	if(xp->claimed) { catalog_unclaim(path); }
+	else if(del) { catalog_remove(path); }
+	else if(xp->writing) { catalog_update(path); }
+	GCFILE_INIT(xp->gcf);
+
+	pthread_mutex_lock(&g_xlock);
+	if(xp->id) {
+		for(pp=&g_buckets[xfer_bucket(xp->id, g_nbuckets)]; *pp; pp=&(*pp)->next) {
+			if(*pp == xp) { *pp = xp->next; break; }
+		}
+	}
+	xp->id = 0;
+	xp->size = 0;
+	xp->offset = 0;
+	xp->last = 0;
+	xp->writing = 0;
+	xp->claimed = 0;
+	xp->stripes = NULL;
+	xp->parent = 0;
+	xp->part = 0;
+	xp->inuse = 0;
+	xp->uuid[0] = 0;
+	xp->next = g_freelist;
+	g_freelist = xp;
+	g_active--;
+	pthread_mutex_unlock(&g_xlock);
+
+	pthread_mutex_unlock(&xp->lock);
+}
+
+int xfer_stripe(xfer_t *xp, int nparts)
+{
+	xfer_stripes_t *st;
+
+	if(xp->stripes || (nparts < 1)) { return -1; }
+
+	st = calloc(1, sizeof(xfer_stripes_t));
+	if(!st) { return -1; }
+	st->have = calloc(nparts, 1);
+	st->digests = calloc(nparts, TPAD_DIGEST_SIZE);
+	if(!st->have || !st->digests) {
+		free(st->have);
+		free(st->digests);
+		free(st);
+		return -1;
+	}
+
+	st->nparts = nparts;
+	xp->stripes = st;
+	return 0;
+}
+
+// Call with the part locked (if there is one yet), we lock its file's transfer.
+// Nothing ever locks them the other way around
+void xfer_part_done(xfer_id_t parent, int part, unsigned char *digest)
+{
+	xfer_t *xp;
+	xfer_stripes_t *st;
+
+	xp = xfer_find(parent);
+	if(!xp) { return; }
+
+	st = xp->stripes;
+	if(st) {
+		if(st->open > 0) { st->open--; }
+		if(digest && (part >= 0) && (part < st->nparts) && !st->have[part]) {
+			memcpy(st->digests + (part * TPAD_DIGEST_SIZE), digest, TPAD_DIGEST_SIZE);
+			st->have[part] = 1;
+			st->done++;
+		}
+	}
+
+	xfer_release(xp);
+}
+
+// Hold on to a chunk until its turn comes:
+// an upload chunk that arrived early, or a download chunk we had to read ahead of its request.
+// Returns -1 if it overlaps a chunk we already have or we are holding too much
+int xfer_stash(xfer_t *xp, long offset, zmq_msg_t *msg)
+{
+	long size;
+	xfer_chunk_t *c, *prev = NULL, **pp;
+
+	size = (long)zmq_msg_size(msg);
+	if(xp->npending >= MAXWINDOW) { return -1; }
+	if((xp->pending_bytes + size) > PENDING_MAXBYTES) { return -1; }
+
+	for(pp=&xp->pending; *pp; pp=&(*pp)->next) {
+		if((*pp)->offset >= offset) { break; }
+		prev = *pp;
+	}
+	// The chunk size can change along the way, so compare ranges and not just offsets
+	if(prev && (offset < (prev->offset + (long)zmq_msg_size(&prev->msg)))) { return -1; }
+	if(*pp && ((offset + size) > (*pp)->offset)) { return -1; }
+
+	c = malloc(sizeof(xfer_chunk_t));
+	if(!c) { return -1; }
+	c->offset = offset;
+	zmq_msg_init(&c->msg);
+	zmq_msg_move(&c->msg, msg);
+	c->next = *pp;
+	*pp = c;
+
+	xp->npending++;
+	xp->pending_bytes += size;
+	return 0;
+}
+
+// Take back the chunk held for offset, if there is one
+xfer_chunk_t* xfer_unstash(xfer_t *xp, long offset)
+{
+	xfer_chunk_t *c, **pp;
+
+	for(pp=&xp->pending; *pp; pp=&(*pp)->next) {
+		if((*pp)->offset >= offset) { break; }
+	}
+	c = *pp;
+	if(!c || (c->offset != offset)) { return NULL; }
+
+	*pp = c->next;
+	xp->npending--;
+	xp->pending_bytes -= (long)zmq_msg_size(&c->msg);
+	return c;
+}
+
+void xfer_chunk_free(xfer_chunk_t *c)
+{
+	zmq_msg_close(&c->msg);
+	free(c);
+}
+
+// Close every transfer that has been idle for longer than lease seconds
+// A partial upload is removed, the source file of a download is left alone
+// (a claimed one goes back to the catalog for someone else to pick)
+unsigned long xfer_reap(time_t lease)
+{
+	unsigned long i, count = 0;
+	time_t now;
+	xfer_t **pp;
+	xfer_t *xp, *reap = NULL;
+
+	now = xfer_now();
+
+	// We can not wait on an xfer while holding the table lock,
+	// so only take the ones nobody is using right now.
+	pthread_mutex_lock(&g_xlock);
+	for(i=0; i<g_nbuckets; i++) {
+		pp = &g_buckets[i];
+		while(*pp) {
+			xp = *pp;
+			if(((now - xp->last) > lease) && (pthread_mutex_trylock(&xp->lock) == 0)) {
+				// A striped file waits for its parts, its last part to end touches it
+				if(((now - xp->last) > lease) && !(xp->stripes && xp->stripes->open)) {
+					// Unhook it so xfer_find() can not hand it out again
+					*pp = xp->next;
+					xp->id = 0;
+					xp->next = reap;
+					reap = xp;
+					continue;
+				}
+				pthread_mutex_unlock(&xp->lock);
+			}
+			pp = &xp->next;
+		}
+	}
+	pthread_mutex_unlock(&g_xlock);
+
+	while(reap) {
+		xp = reap;
+		reap = xp->next;
+		xfer_complete(xp, xp->writing);
+		count++;
+	}
+
+	if(count) {
+		pthread_mutex_lock(&g_xlock);
+		g_reaped += count;
+		pthread_mutex_unlock(&g_xlock);
+	}
+
+	return count;
+}
+
+unsigned long xfer_active(void)
+{
+	unsigned long active;
+
+	pthread_mutex_lock(&g_xlock);
+	active = g_active;
+	pthread_mutex_unlock(&g_xlock);
+
+	return active;
+}
+
+unsigned long xfer_reaped(void)
+{
+	unsigned long reaped;
+
+	pthread_mutex_lock(&g_xlock);
+	reaped = g_reaped;
+	pthread_mutex_unlock(&g_xlock);
+
+	return reaped;
 }
@@ -19,26 +19,100 @@
 #ifndef __TPAD_XFER_H__
 #define __TPAD_XFER_H__
 
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <zmq.h>
+
 #include "gcryptfile.h"
 
-// MAXACTIVE was set to 256, but gcrypt was giving us errors after about 70 or so
-// maybe we were running out of secure memory?
-#define MAXACTIVE (64)
-#define UUIDSIZE (64)
+// MAXACTIVE used to be 64, because gcrypt ran out of secure memory after about 70 handles.
+// gcfile_open() no longer asks for secure memory, so the only limits are fds and RAM.
+// xfer_init(0) admits as many transfers as we can open.
+#define DEFAULT_MAXACTIVE (0)
+
+// A transfer that sees no requests for this many seconds gets reaped
+#define DEFAULT_LEASE (300)
+
+// The table grows by XFER_SLAB entries at a time, entries are never freed
+#define XFER_SLAB (64)
+#define XFER_MINBUCKETS (256)
+// The bucket array doubles whenever there would be fewer than XFER_BUCKETS_PER_XFER buckets per active transfer,
+// so a chain holds half a transfer on average however many there are
+#define XFER_BUCKETS_PER_XFER (2)
+#define XFER_CACHELINE (64)
+
+// The uuid on the wire is the decimal form of a 64-bit transfer id
+#define XFER_UUIDLEN (24)
+
+typedef uint64_t xfer_id_t;
+
+// A chunk that is not at xp->offset, kept in its zmq message until its turn comes
+typedef struct xfer_chunk_s {
+	long offset;
+	zmq_msg_t msg;
+	struct xfer_chunk_s *next;
+} xfer_chunk_t;
 
-// If we wanted exclusive access to the files being transferred,
-// should we reaplce the uuid with filename?
+// A file that moves in parts (TBIN_STRIPE), kept on the file's own transfer.
+// Every part is a transfer of its own that points back at it with parent
+typedef struct {
+	int nparts;
+	int open;		// parts under way, the file's transfer is not reaped while there are any
+	int done;		// parts whose digest is in
+	unsigned char *have;	// a flag per part
+	unsigned char *digests;	// TPAD_DIGEST_SIZE bytes per part
+} xfer_stripes_t;
 
+// The parts of a transfer we only touch when opening, closing or reporting
 typedef struct {
 	gcfile_t gcf;
-	char uuid[UUIDSIZE];
+	char uuid[XFER_UUIDLEN];
+} xfer_cold_t;
+
+// The parts of a transfer we touch on every chunk.
+// xfer_find() only needs the first cache line, with a glibc mutex lock through last fill it
+typedef struct xfer_s {
+	pthread_mutex_t lock;
+	xfer_id_t id;
+	struct xfer_s *next;	// hash chain when active, free list when not
+	time_t last;		// CLOCK_MONOTONIC_COARSE seconds of the last request
+	int inuse;
+	int writing;
+	int claimed;		// holds its file in the catalog, see catalog_hold()
 	long size;
 	long offset;
-	//time_t last;
-} xfer_t;
+	gcfile_t *gcf;
+	char *uuid;
+	xfer_chunk_t *pending;	// sorted by offset
+	int npending;
+	long pending_bytes;
+	xfer_stripes_t *stripes;	// on the transfer of a striped file
+	xfer_id_t parent;	// on a part, the transfer of its file
+	int part;
+} __attribute__ ((aligned(XFER_CACHELINE))) xfer_t;
 
+// xfer_new() and xfer_find*() return the xfer locked.
+// The caller must hand it back with xfer_release() or xfer_complete()
+void xfer_init(unsigned long maxactive);
 xfer_t* xfer_new(char *path, char *mode);
+xfer_t* xfer_find(xfer_id_t id);
 xfer_t* xfer_find_uuid(char *uuid);
+void xfer_release(xfer_t *xp);
 void xfer_complete(xfer_t *xp, int del);
 
+// xfer_stripe() has xp move in nparts parts.
+// xfer_part_done() tells the transfer parent that its part is over, with its digest if it made it
+int xfer_stripe(xfer_t *xp, int nparts);
+void xfer_part_done(xfer_id_t parent, int part, unsigned char *digest);
+
+// xfer_stash() takes the message over, xfer_unstash() hands back the chunk at offset
+int xfer_stash(xfer_t *xp, long offset, zmq_msg_t *msg);
+xfer_chunk_t* xfer_unstash(xfer_t *xp, long offset);
+void xfer_chunk_free(xfer_chunk_t *c);
+
+unsigned long xfer_reap(time_t lease);
+unsigned long xfer_active(void);
+unsigned long xfer_reaped(void);
+
 #endif
@@ -22,11 +22,16 @@
 extern "C" {
 #endif
 
+#include <zmq.h>
+
 #define AS_ZMQ_MAX_PARTS (256)
 
+// buf points straight into msg, which is only kept alive until the callback returns.
+// Copy anything that has to outlive the callback.
 typedef struct {
 	void *buf;
 	unsigned long size;
+	zmq_msg_t msg;
 } zmq_mf_t;
 
 #ifdef __cplusplus
@@ -15,9 +15,7 @@
 	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
-#ifdef DEBUG
 #include <stdio.h>
-#endif
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -29,10 +27,32 @@
 #include <zmq.h>
 #include "async_zmq_reply.h"
 
+// A pool worker starts every message it sends with the envelope of the request it is answering
+static int as_zmq_reply_envelope(zmq_reply_t *reply, int more)
+{
+	int i;
+	zmq_msg_t zEnv;
+
+	if(!reply->midmsg) {
+		for(i=0; i<reply->nenv; i++) {
+			zmq_msg_init(&zEnv);
+			zmq_msg_copy(&zEnv, &reply->env[i]);
+			if(zmq_msg_send(&zEnv, reply->zSocket, ZMQ_SNDMORE) == -1) {
+				zmq_msg_close(&zEnv);
+				return -1;
+			}
+		}
+	}
+
+	reply->midmsg = more;
+	return 0;
+}
+
 int as_zmq_reply_send(zmq_reply_t *reply, void *buf, int len, int more)
 {
 	int n, flags=0;
 
+	if(as_zmq_reply_envelope(reply, more) != 0) { return -1; }
 	if(more) { flags = ZMQ_SNDMORE; }
 	n = zmq_send(reply->zSocket, buf, len, flags);
 #ifdef DEBUG
@@ -43,51 +63,191 @@ int as_zmq_reply_send(zmq_reply_t *reply, void *buf, int len, int more)
 	return n;
 }
 
+// Send buf without copying it, zmq calls ffn(buf, hint) once it is done with buf
+// ffn is always called, even when the send fails
+int as_zmq_reply_send_zc(zmq_reply_t *reply, void *buf, int len, int more, zmq_free_fn *ffn, void *hint)
+{
+	int n, flags=0;
+	zmq_msg_t zMessage;
+
+	if(zmq_msg_init_data(&zMessage, buf, len, ffn, hint) != 0) {
+		ffn(buf, hint);
+		return -1;
+	}
+
+	if(as_zmq_reply_envelope(reply, more) != 0) {
+		zmq_msg_close(&zMessage);
+		return -1;
+	}
+	if(more) { flags = ZMQ_SNDMORE; }
+	n = zmq_msg_send(&zMessage, reply->zSocket, flags);
+	if(n == -1) { zmq_msg_close(&zMessage); }
+#ifdef DEBUG
+	if(n != len) {
+		fprintf(stderr, "zmq_msg_send() returned %d!\n", n);
+	}
+#endif
+	return n;
+}
+
+// Send a message we already built, zmq owns msg afterwards either way
+int as_zmq_reply_send_msg(zmq_reply_t *reply, zmq_msg_t *msg, int more)
+{
+	int n, flags=0;
+
+	if(as_zmq_reply_envelope(reply, more) != 0) {
+		zmq_msg_close(msg);
+		return -1;
+	}
+	if(more) { flags = ZMQ_SNDMORE; }
+	n = zmq_msg_send(msg, reply->zSocket, flags);
+	if(n == -1) { zmq_msg_close(msg); }
+#ifdef DEBUG
+	if(n == -1) {
+		fprintf(stderr, "zmq_msg_send() returned %d!\n", n);
+	}
+#endif
+	return n;
+}
+
+// Bind our end of the control PAIR before the thread that owns the other end exists
+static int as_zmq_reply_bind_control(zmq_reply_t *reply)
+{
+	char addr[64];
+
+	snprintf(addr, sizeof(addr), "inproc://zr_control_%p", (void *)reply);
+	reply->zControl = zmq_socket(reply->zContext, ZMQ_PAIR);
+	if(!reply->zControl) { return -1; }
+	return zmq_bind(reply->zControl, addr);
+}
+
+// Called from inside the thread, a zmq socket must stay with the thread that uses it
+static void* as_zmq_reply_open_control(zmq_reply_t *reply)
+{
+	char addr[64];
+	void *zCtlSock;
+
+	snprintf(addr, sizeof(addr), "inproc://zr_control_%p", (void *)reply);
+	zCtlSock = zmq_socket(reply->zContext, ZMQ_PAIR);
+	if(!zCtlSock) { return NULL; }
+	if(zmq_connect(zCtlSock, addr) != 0) {
+		zmq_close(zCtlSock);
+		return NULL;
+	}
+	return zCtlSock;
+}
+
+// Drop the envelope of the last request
+static void as_zmq_reply_clear_envelope(zmq_reply_t *reply)
+{
+	while(reply->nenv > 0) {
+		reply->nenv--;
+		zmq_msg_close(&reply->env[reply->nenv]);
+	}
+	reply->midmsg = 0;
+}
+
+// Move the envelope (everything up to and including the empty delimiter) out of parts
+// Returns how many parts it took, or -1 if there is no delimiter
+static int as_zmq_reply_take_envelope(zmq_reply_t *reply, zmq_mf_t *parts, int mpi)
+{
+	int i, d;
+
+	as_zmq_reply_clear_envelope(reply);
+
+	for(d=0; d<mpi; d++) {
+		if(parts[d].size == 0) { break; }
+	}
+	if((d == mpi) || (d >= AS_ZMQ_MAX_ENV)) { return -1; }
+
+	for(i=0; i<=d; i++) {
+		zmq_msg_init(&reply->env[i]);
+		zmq_msg_move(&reply->env[i], &parts[i].msg);
+	}
+	reply->nenv = d+1;
+	return reply->nenv;
+}
+
 static void* zmq_reply_thread(void *param)
 {
-	int mpi, msgsize, more, i;
+	int mpi, msgsize, more, i, r, e;
 	size_t smore=sizeof(more);
-	zmq_msg_t zMessage;
+	zmq_mf_t *parts;
 	zmq_mf_t **mpa;
 	zmq_mf_t *thispart;
+	zmq_pollitem_t items[2];
+	void *zCtlSock;
 	ZRParam_t *p = (ZRParam_t *)param;
 	zmq_reply_t *reply = p->q;
 
 	prctl(PR_SET_NAME, AS_ZMQ_REPLY_THREADNAME, 0, 0, 0);
 
-	// we repeat until the connection has been closed
-	zmq_msg_init(&zMessage);
-	reply->connected = 1;
-	while(!reply->do_close) {
-		msgsize = zmq_msg_recv(&zMessage, reply->zSocket, ZMQ_DONTWAIT);
+	// The parts array is reused for every request this thread handles
+	parts = calloc(AS_ZMQ_MAX_PARTS, sizeof(zmq_mf_t));
+	mpa = calloc(AS_ZMQ_MAX_PARTS, sizeof(zmq_mf_t *));
+	zCtlSock = as_zmq_reply_open_control(reply);
+	if(!parts || !mpa || !zCtlSock) {
+		if(zCtlSock) { zmq_close(zCtlSock); }
+		free(mpa);
+		free(parts);
+		p->cb(reply, NULL, 0, p->user_data);
+		free(p);
+		return (NULL);
+	}
+
+	items[0].socket = reply->zSocket;
+	items[0].events = ZMQ_POLLIN;
+	items[1].socket = zCtlSock;
+	items[1].events = ZMQ_POLLIN;
+
+	// Sleep in zmq_poll() until we get a request or we are told to shut down
+	while(1) {
+		r = zmq_poll(items, 2, -1);
+		if(r == -1) {
+			if(errno == EINTR) { continue; }
+			else break;
+		}
+		if(items[1].revents & ZMQ_POLLIN) { break; }
+		if(!(items[0].revents & ZMQ_POLLIN)) { continue; }
+
+		zmq_msg_init(&parts[0].msg);
+		msgsize = zmq_msg_recv(&parts[0].msg, reply->zSocket, ZMQ_DONTWAIT);
 		if(msgsize == -1) {
-			if(errno == EAGAIN) { usleep(100); continue; }
+			zmq_msg_close(&parts[0].msg);
+			if((errno == EAGAIN) || (errno == EINTR)) { continue; }
 			else break;
 		}
 
-		mpa = calloc(AS_ZMQ_MAX_PARTS, sizeof(zmq_mf_t *));
+		// Hand the callback pointers into the zmq messages instead of copies
 		mpi = 0;
 		do {
-			if(mpi > 0) { msgsize = zmq_msg_recv(&zMessage, reply->zSocket, 0); }
-			thispart = mpa[mpi++] = calloc(1, sizeof(zmq_mf_t));
-			thispart->size = msgsize;
-			thispart->buf = calloc(1, msgsize);
-			memcpy(thispart->buf, zmq_msg_data(&zMessage), msgsize);
-			zmq_msg_close(&zMessage); zmq_msg_init(&zMessage);
+			thispart = mpa[mpi] = &parts[mpi];
+			if(mpi > 0) {
+				zmq_msg_init(&thispart->msg);
+				msgsize = zmq_msg_recv(&thispart->msg, reply->zSocket, 0);
+			}
+			thispart->size = (msgsize < 0) ? 0 : msgsize;
+			thispart->buf = zmq_msg_data(&thispart->msg);
+			mpi++;
 			zmq_getsockopt(reply->zSocket, ZMQ_RCVMORE, &more, &smore);
 		} while(more && (mpi<AS_ZMQ_MAX_PARTS));
 
-		p->cb(reply, mpa, mpi, p->user_data);
+		// A DEALER worker hands the callback only what follows the envelope
+		e = 0;
+		if(reply->env) { e = as_zmq_reply_take_envelope(reply, parts, mpi); }
+		if(e >= 0) { p->cb(reply, &mpa[e], mpi-e, p->user_data); }
 
-		for(i=0; i<AS_ZMQ_MAX_PARTS; i++) {
-			if(mpa[i]) { free(mpa[i]->buf); free(mpa[i]); }
+		for(i=0; i<mpi; i++) {
+			zmq_msg_close(&parts[i].msg);
+			mpa[i] = NULL;
 		}
-		free(mpa);
 	}
 
-	zmq_msg_close(&zMessage);
+	as_zmq_reply_clear_envelope(reply);
+	zmq_close(zCtlSock);
 	p->cb(reply, NULL, 0, p->user_data);
-	reply->closed = 1;
+	free(mpa);
+	free(parts);
 	free(p);
 #ifdef DEBUG
 	printf("%s() EXIT\n", __func__);
@@ -97,15 +257,14 @@ static void* zmq_reply_thread(void *param)
 
 static int as_zmq_reply_attach(zmq_reply_t *reply, void *func, void *user)
 {
-	pthread_t thr_id;
 	ZRParam_t *p = (ZRParam_t *)calloc(1, sizeof(ZRParam_t));
 
 	p->q = reply;
 	p->cb = func;
 	p->user_data = user;
 
-	if( pthread_create(&thr_id, NULL, &zmq_reply_thread, p) ) { goto bail; }
-	if( pthread_detach(thr_id) ) { goto bail; }
+	if( pthread_create(&reply->thr_id, NULL, &zmq_reply_thread, p) ) { goto bail; }
+	reply->connected = 1;
 
 	return 0;
 
@@ -114,6 +273,18 @@ bail:
 	return -1;
 }
 
+// Wake the thread through its control socket and wait for it to exit
+static void as_zmq_reply_stop(zmq_reply_t *reply)
+{
+	if(reply->connected) {
+		(void) zmq_send(reply->zControl, AS_ZMQ_TERMINATE, strlen(AS_ZMQ_TERMINATE), 0);
+		pthread_join(reply->thr_id, NULL);
+		reply->connected = 0;
+	}
+	if(reply->zControl) { zmq_close(reply->zControl); }
+	reply->zControl = NULL;
+}
+
 zmq_reply_t* as_zmq_reply_create(char *zSockAddr, void *func, int recv_hwm, int send_hwm, int do_connect, void *user)
 {
 	int r;
@@ -139,6 +310,11 @@ zmq_reply_t* as_zmq_reply_create(char *zSockAddr, void *func, int recv_hwm, int
 		goto bail;
 	}
 
+	r = as_zmq_reply_bind_control(reply);
+	if(r != 0) {
+		goto bail;
+	}
+
 	r = as_zmq_reply_attach(reply, func, user);
 	if(r != 0) {
 		goto bail;
@@ -147,22 +323,149 @@ zmq_reply_t* as_zmq_reply_create(char *zSockAddr, void *func, int recv_hwm, int
 	return reply;
 
 bail:
+	if(reply->zControl) { zmq_close(reply->zControl); }
 	zmq_close(reply->zSocket);
 	zmq_ctx_term(reply->zContext);
 	free(reply);
 	return NULL;
 }
 
+static void* zmq_proxy_thread(void *param)
+{
+	void *zCtlSock;
+	zmq_reply_t *reply = (zmq_reply_t *)param;
+
+	prctl(PR_SET_NAME, AS_ZMQ_PROXY_THREADNAME, 0, 0, 0);
+
+	// The proxy runs until as_zmq_reply_stop() sends TERMINATE on the control socket
+	zCtlSock = as_zmq_reply_open_control(reply);
+	if(zCtlSock) {
+		(void) zmq_proxy_steerable(reply->zSocket, reply->zBackend, NULL, zCtlSock);
+		zmq_close(zCtlSock);
+	}
+
+#ifdef DEBUG
+	printf("%s() EXIT\n", __func__);
+#endif
+	return (NULL);
+}
+
+static void as_zmq_reply_pool_teardown(zmq_reply_t *reply)
+{
+	int i;
+	zmq_reply_t *w;
+
+	// Stop the workers first, so nothing is left talking to the backend
+	for(i=0; i<=reply->workers; i++) {
+		w = &reply->wlist[i];
+		as_zmq_reply_stop(w);
+		if(w->zSocket) { zmq_close(w->zSocket); }
+		free(w->env);
+	}
+
+	as_zmq_reply_stop(reply);
+	zmq_close(reply->zBackend);
+	zmq_close(reply->zSocket);
+	zmq_ctx_term(reply->zContext);
+	free(reply->wlist);
+}
+
+// Bind a ROUTER to zSockAddr and share the incoming requests
+// across a pool of DEALER worker threads, each running func()
+zmq_reply_t* as_zmq_reply_create_pool(char *zSockAddr, void *func, int recv_hwm, int send_hwm, int workers, void *user)
+{
+	int r;
+	char addr[64];
+	zmq_reply_t *w;
+	zmq_reply_t *reply;
+
+	if(workers < 1) { return NULL; }
+
+	reply = calloc(1, sizeof(zmq_reply_t));
+	if(!reply) return NULL;
+
+	// Allocate one extra slot so teardown can find a worker that failed to attach
+	reply->wlist = calloc(workers+1, sizeof(zmq_reply_t));
+	if(!reply->wlist) { free(reply); return NULL; }
+
+	reply->zContext = zmq_ctx_new();
+	reply->zSocket = zmq_socket(reply->zContext, ZMQ_ROUTER);
+	reply->zBackend = zmq_socket(reply->zContext, ZMQ_DEALER);
+
+	r = zmq_setsockopt(reply->zSocket, ZMQ_RCVHWM, &recv_hwm, sizeof(recv_hwm));
+	if(r != 0) {
+		goto bail;
+	}
+
+	r = zmq_setsockopt(reply->zSocket, ZMQ_SNDHWM, &send_hwm, sizeof(send_hwm));
+	if(r != 0) {
+		goto bail;
+	}
+
+	r = zmq_bind(reply->zSocket, zSockAddr);
+	if(r != 0) {
+		goto bail;
+	}
+
+	r = as_zmq_reply_bind_control(reply);
+	if(r != 0) {
+		goto bail;
+	}
+
+	snprintf(addr, sizeof(addr), "inproc://zr_backend_%p", (void *)reply);
+	r = zmq_bind(reply->zBackend, addr);
+	if(r != 0) {
+		goto bail;
+	}
+
+	while(reply->workers < workers) {
+		w = &reply->wlist[reply->workers];
+		w->zContext = reply->zContext;
+		w->zSocket = zmq_socket(reply->zContext, ZMQ_DEALER);
+		w->env = calloc(AS_ZMQ_MAX_ENV, sizeof(zmq_msg_t));
+		if(!w->env) {
+			goto bail;
+		}
+
+		r = zmq_connect(w->zSocket, addr);
+		if(r != 0) {
+			goto bail;
+		}
+
+		r = as_zmq_reply_bind_control(w);
+		if(r != 0) {
+			goto bail;
+		}
+
+		r = as_zmq_reply_attach(w, func, user);
+		if(r != 0) {
+			goto bail;
+		}
+		reply->workers++;
+	}
+
+	if( pthread_create(&reply->thr_id, NULL, &zmq_proxy_thread, reply) ) { goto bail; }
+	reply->connected = 1;
+
+	return reply;
+
+bail:
+	as_zmq_reply_pool_teardown(reply);
+	free(reply);
+	return NULL;
+}
+
 void as_zmq_reply_destroy(zmq_reply_t *reply)
 {
 	if(!reply) { return; }
 
-	if(reply->connected) {
-		reply->do_close = 1;
-		while(!reply->closed) { usleep(1000); }
+	if(reply->wlist) {
+		as_zmq_reply_pool_teardown(reply);
+	} else {
+		as_zmq_reply_stop(reply);
 		zmq_close(reply->zSocket);
 		zmq_ctx_term(reply->zContext);
 	}
-	
+
 	free(reply);
 }
@@ -22,16 +22,36 @@
 extern "C" {
 #endif
 
+#include <pthread.h>
+
 #include "async_zmq_mpm.h"
 
 #define AS_ZMQ_REPLY_THREADNAME ("zmq_reply_thread")
+#define AS_ZMQ_PROXY_THREADNAME ("zmq_reply_proxy")
 
-typedef struct {
+#define AS_ZMQ_TERMINATE ("TERMINATE")
+
+// Most frames of routing envelope we keep for a request
+#define AS_ZMQ_MAX_ENV (8)
+
+typedef struct zmq_reply_s {
 	void *zContext;
 	void *zSocket;
+	void *zControl;		// our end of the inproc PAIR that wakes the thread for shutdown
+	pthread_t thr_id;
 	int connected;
-	int do_close;
-	int closed;
+
+	// Pool workers are DEALERs, so they can send any number of messages for one request.
+	// env is the routing envelope of the request being handled,
+	// it goes back out in front of every message until the next request comes in
+	zmq_msg_t *env;
+	int nenv;
+	int midmsg;
+
+	// Only used by the parent of a worker pool
+	void *zBackend;
+	int workers;
+	struct zmq_reply_s *wlist;
 } zmq_reply_t;
 
 #define ZR_READ_CALLBACK(CB) void (CB)(zmq_reply_t *, zmq_mf_t **, int, void *);
@@ -43,7 +63,10 @@ typedef struct {
 } ZRParam_t;
 
 int as_zmq_reply_send(zmq_reply_t *reply, void *buf, int len, int more);
+int as_zmq_reply_send_zc(zmq_reply_t *reply, void *buf, int len, int more, zmq_free_fn *ffn, void *hint);
+int as_zmq_reply_send_msg(zmq_reply_t *reply, zmq_msg_t *msg, int more);
 zmq_reply_t* as_zmq_reply_create(char *zSockAddr, void *func, int recv_hwm, int send_hwm, int do_connect, void *user);
+zmq_reply_t* as_zmq_reply_create_pool(char *zSockAddr, void *func, int recv_hwm, int send_hwm, int workers, void *user);
 void as_zmq_reply_destroy(zmq_reply_t *reply);
 
 #ifdef __cplusplus
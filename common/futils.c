@@ -23,6 +23,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 
 //off_t is of type (unsigned long int)? - 8 bytes on 64-bit systems
 //what happens to large files on 32-bit systems?
@@ -113,3 +115,76 @@ int file_security_check(void *filename)
 
 	return 0;
 }
+
+// Return 0 if path is a relative path that stays below the dir it is joined to:
+// names separated by single '/', none of them "." or ".."
+// Return anything else if it is not
+int path_security_check(const char *path)
+{
+	const char *p, *end;
+	size_t n;
+
+	if(!path[0]) { return 1; }
+	if(path[0] == '/') { return 2; }
+
+	for(p=path; ; p=end+1) {
+		end = strchr(p, '/');
+		n = end ? (size_t)(end - p) : strlen(p);
+		if(n == 0) { return 3; }
+		if((n == 1) && (p[0] == '.')) { return 4; }
+		if((n == 2) && (p[0] == '.') && (p[1] == '.')) { return 4; }
+		if(!end) { break; }
+	}
+
+	return 0;
+}
+
+// Walk the dirs path (which passed path_security_check) goes through, from the current dir,
+// making the ones that are missing if create is set.
+// They are opened with O_NOFOLLOW, so a symlink can not lead path out of the current dir.
+// Return 0 if path can be opened
+// Return -1 with errno set if not
+int path_safe_join(const char *path, int create)
+{
+	int dfd = AT_FDCWD, fd, err;
+	size_t n;
+	const char *p, *end;
+	char name[NAME_MAX+1];
+
+	for(p=path; (end = strchr(p, '/')); p=end+1) {
+		n = end - p;
+		if(n > NAME_MAX) { errno = ENAMETOOLONG; goto fail; }
+		memcpy(name, p, n);
+		name[n] = 0;
+
+		if(create && (mkdirat(dfd, name, 0755) != 0) && (errno != EEXIST)) { goto fail; }
+		fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if(fd == -1) { goto fail; }
+		if(dfd != AT_FDCWD) { close(dfd); }
+		dfd = fd;
+	}
+
+	if(dfd != AT_FDCWD) { close(dfd); }
+	return 0;
+
+fail:
+	err = errno;
+	if(dfd != AT_FDCWD) { close(dfd); }
+	errno = err;
+	return -1;
+}
+
+// Give the open file fd its full size up front, so parts of it can be written in any order
+// without the filesystem scattering it. Where that is not supported, just set the size.
+// Return 0 on success
+// Return -1 with errno set if not
+int file_preallocate(int fd, long size)
+{
+	int z;
+
+	z = posix_fallocate(fd, 0, (off_t)size);
+	if(z == 0) { return 0; }
+	if((z != EOPNOTSUPP) && (z != EINVAL)) { errno = z; return -1; }
+
+	return ftruncate(fd, (off_t)size);
+}
@@ -24,5 +24,8 @@ int is_regfile(const char *path, int v);
 int is_dir(const char *path, int v);
 
 int file_security_check(void *filename);
+int path_security_check(const char *path);
+int path_safe_join(const char *path, int create);
+int file_preallocate(int fd, long size);
 
 #endif
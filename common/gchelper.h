@@ -27,6 +27,7 @@
 
 #define TPAD_HASH_ALG (GCRY_MD_WHIRLPOOL)
 #define TPAD_HASH_SIZE ((512/8)*2)
+#define TPAD_DIGEST_SIZE (512/8)
 
 int tpad_gcinit(char *vers);
 //void tpad_gcerror(const char *what, gcry_error_t err, int exitcode);
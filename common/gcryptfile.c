@@ -50,7 +50,9 @@ int gcfile_open(gcfile_t *gcf, const char *path, const char *mode)
 
 	// We will init the context with GCRY_MD_NONE
 	// The user can select which algorithms they want to enable with gcfile_enable()
-	gcerr = gcry_md_open(&gcf->h, GCRY_MD_NONE, GCRY_MD_FLAG_SECURE);
+	// We only digest file contents, so there is no need to use up secure memory.
+	// GCRY_MD_FLAG_SECURE limited us to a few dozen open handles.
+	gcerr = gcry_md_open(&gcf->h, GCRY_MD_NONE, 0);
 	if(gcerr) {
 		gcfile_close(gcf);
 		snprintf(gcf->errmsg, sizeof(gcf->errmsg), "gcry_md_open() failed: %s", gcry_strerror(gcerr));
@@ -130,6 +132,23 @@ size_t gcfile_write(gcfile_t *gcf, const void *ptr, size_t nmemb)
 	return bytes;
 }
 
+// Move to offset before the first read or write, the digest only covers what comes after it.
+// return 0 on success
+// return non-zero on error
+int gcfile_seek(gcfile_t *gcf, long offset)
+{
+	if(!gcf->is_open) {
+		snprintf(gcf->errmsg, sizeof(gcf->errmsg), "gcfile_seek() failed: file is not open");
+		return -1;
+	}
+
+	if(fseeko(gcf->f, (off_t)offset, SEEK_SET) != 0) {
+		snprintf(gcf->errmsg, sizeof(gcf->errmsg), "fseeko(%s, %ld) failed: %s", gcf->path, offset, strerror(errno));
+		return -2;
+	}
+	return 0;
+}
+
 // This must be free()'d
 char* gcfile_get_hash(gcfile_t *gcf, int alg)
 {
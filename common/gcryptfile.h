@@ -44,6 +44,7 @@ int gcfile_open(gcfile_t *, const char *, const char *);
 int gcfile_enable(gcfile_t *, int);
 size_t gcfile_read(gcfile_t *, void *, size_t);
 size_t gcfile_write(gcfile_t *, const void *, size_t);
+int gcfile_seek(gcfile_t *, long);
 char* gcfile_get_hash(gcfile_t *, int);
 unsigned char* gcfile_get_digest(gcfile_t *, int);
 void gcfile_close(gcfile_t *);
@@ -25,15 +25,13 @@
 #include "gcryptfile.h"
 
 // this must be free()'d
-static char* get_stats(gcfile_t *gcf)
+// bytes moved in usec, chunksize is the chunk size the transfer ended up with, 0 leaves it out
+static char* rate_stats(unsigned long bytes, unsigned long usec, long chunksize)
 {
 	int n = 0;
-	unsigned long bytes;
-	unsigned long usec;
 	double speed;
 	char stats[256];
 
-	bytes = gcfile_get_bytecount(gcf);
 	if(bytes > 1000000) {
 		n += snprintf(stats+n, sizeof(stats)-n, "(%luMB)", bytes/1000000);
 	} else if(bytes > 1000) {
@@ -42,7 +40,6 @@ static char* get_stats(gcfile_t *gcf)
 		n += snprintf(stats+n, sizeof(stats)-n, "(%luB)", bytes);
 	}
 
-	usec = gcfile_get_duration(gcf);
 	if(usec == 0) { return strdup(stats); }
 	// If we don't have proper timing information, bail early
 
@@ -63,7 +60,22 @@ static char* get_stats(gcfile_t *gcf)
 	speed = (double)(bytes) / (double)(usec);
 	n += snprintf(stats+n, sizeof(stats)-n, " {%3.3fMB/s}", speed);
 
+	if(chunksize >= 1048576) {
+		n += snprintf(stats+n, sizeof(stats)-n, " <%ldMiB chunks>", chunksize/1048576);
+	} else if(chunksize >= 1024) {
+		n += snprintf(stats+n, sizeof(stats)-n, " <%ldKiB chunks>", chunksize/1024);
+	} else if(chunksize > 0) {
+		n += snprintf(stats+n, sizeof(stats)-n, " <%ldB chunks>", chunksize);
+	}
+
 	return strdup(stats);
 }
 
+// this must be free()'d
+// chunksize is the chunk size the transfer ended up with, 0 leaves it out
+static char* get_stats(gcfile_t *gcf, long chunksize)
+{
+	return rate_stats(gcfile_get_bytecount(gcf), gcfile_get_duration(gcf), chunksize);
+}
+
 #endif